@@ -0,0 +1,333 @@
+#include <sys/types.h>
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "aead.h"
+
+// Suite bytes on the wire. Anything else is not one of ours.
+#define SUITE_AES_GCM 0xa1
+#define SUITE_CHACHA 0xa2
+
+#define NONCE_SIZE 12
+
+// Counters this far behind the newest one seen are refused outright; the
+// bitmap remembers which of the ones inside it have been seen.
+#define REPLAY_WINDOW 1024
+
+// Peers remembered at once: a multicast group at its largest.
+#define MAX_PEERS 1024
+
+typedef struct AeadPeer {
+    uint64_t id;
+    int suite;
+    EVP_CIPHER_CTX *ctx;    // Keyed for the peer's datagrams.
+    uint64_t top;           // One past the highest counter accepted.
+    uint64_t seen[REPLAY_WINDOW / 64];
+} AeadPeer;
+
+struct Aead {
+    unsigned char key[AEAD_KEY_SIZE];
+    enum SwpCipher cipher;
+    uint64_t id;
+    uint64_t counter;
+    EVP_CIPHER_CTX *seal_ctx;   // Keyed once; each datagram only sets its nonce.
+    EVP_CIPHER_CTX *trial_ctx;  // Tries datagrams from ids not yet known.
+    AeadPeer *peers;
+    int npeers;
+    int last;                   // Peer of the latest datagram opened.
+    uint64_t rejected;
+};
+
+static void put_be64(unsigned char *ptr, uint64_t value) {
+    for (int idx = 7; idx >= 0; idx--) {
+        ptr[idx] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static uint64_t get_be64(const unsigned char *ptr) {
+    uint64_t value = 0;
+    for (int idx = 0; idx < 8; idx++) {
+        value = value << 8 | ptr[idx];
+    }
+    return value;
+}
+
+static bool have_aes_hw(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    return (hwcap & HWCAP_AES) && (hwcap & HWCAP_PMULL);
+#else
+    return false;
+#endif
+}
+
+static const EVP_CIPHER *suite_cipher(int suite) {
+    return suite == SUITE_AES_GCM ? EVP_aes_256_gcm() : EVP_chacha20_poly1305();
+}
+
+// An endpoint's key: HMAC-SHA256 of its suite and id under the shared key.
+static int key_ctx(Aead *aead, EVP_CIPHER_CTX *ctx, int suite, uint64_t id, int enc) {
+    static const char prefix[] = "libreliable aead";
+    unsigned char label[sizeof(prefix) - 1 + 1 + 8];
+    size_t label_len = sizeof(label);
+    memcpy(label, prefix, sizeof(prefix) - 1);
+    label[sizeof(prefix) - 1] = suite;
+    put_be64(label + sizeof(prefix), id);
+
+    unsigned char derived[EVP_MAX_MD_SIZE];
+    unsigned int derived_len;
+    if (HMAC(EVP_sha256(), aead->key, AEAD_KEY_SIZE, label, label_len,
+                derived, &derived_len) == NULL) {
+        return -1;
+    }
+    int ok = EVP_CipherInit_ex(ctx, suite_cipher(suite), NULL, derived, NULL, enc);
+    OPENSSL_cleanse(derived, sizeof(derived));
+    return ok == 1 ? 0 : -1;
+}
+
+int aead_load_key(const char *path, unsigned char key[AEAD_KEY_SIZE]) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror("aead_load_key");
+        return -1;
+    }
+    unsigned char buf[2 * AEAD_KEY_SIZE + 2];
+    size_t len = fread(buf, 1, sizeof(buf), file);
+    fclose(file);
+
+    if (len == AEAD_KEY_SIZE) {
+        memcpy(key, buf, AEAD_KEY_SIZE);
+        OPENSSL_cleanse(buf, sizeof(buf));
+        return 0;
+    }
+    while (len > 0 && isspace(buf[len - 1])) {
+        len--;
+    }
+    if (len == 2 * AEAD_KEY_SIZE) {
+        size_t idx;
+        for (idx = 0; idx < AEAD_KEY_SIZE; idx++) {
+            char hex[3] = { buf[2 * idx], buf[2 * idx + 1], '\0' };
+            char *end;
+            key[idx] = strtoul(hex, &end, 16);
+            if (!isxdigit((unsigned char)hex[0]) || *end != '\0') {
+                break;
+            }
+        }
+        OPENSSL_cleanse(buf, sizeof(buf));
+        if (idx == AEAD_KEY_SIZE) {
+            return 0;
+        }
+    }
+    fprintf(stderr, "aead_load_key: %s must hold %d bytes or %d hex digits.\n",
+            path, AEAD_KEY_SIZE, 2 * AEAD_KEY_SIZE);
+    return -1;
+}
+
+Aead *aead_new(const unsigned char key[AEAD_KEY_SIZE], enum SwpCipher cipher) {
+    Aead *aead = calloc(1, sizeof(*aead));
+    if (aead == NULL) {
+        return NULL;
+    }
+    memcpy(aead->key, key, AEAD_KEY_SIZE);
+    if (cipher == SwpCipherAuto) {
+        cipher = have_aes_hw() ? SwpCipherAesGcm : SwpCipherChaCha;
+    }
+    aead->cipher = cipher;
+    aead->last = -1;
+
+    unsigned char id[8];
+    aead->seal_ctx = EVP_CIPHER_CTX_new();
+    aead->trial_ctx = EVP_CIPHER_CTX_new();
+    aead->peers = calloc(MAX_PEERS, sizeof(AeadPeer));
+    if (aead->seal_ctx == NULL || aead->trial_ctx == NULL || aead->peers == NULL
+            || RAND_bytes(id, sizeof(id)) != 1) {
+        aead_free(aead);
+        return NULL;
+    }
+    aead->id = get_be64(id);
+    int suite = cipher == SwpCipherAesGcm ? SUITE_AES_GCM : SUITE_CHACHA;
+    if (key_ctx(aead, aead->seal_ctx, suite, aead->id, 1) < 0) {
+        aead_free(aead);
+        return NULL;
+    }
+    return aead;
+}
+
+enum SwpCipher aead_cipher(Aead *aead) {
+    return aead->cipher;
+}
+
+const char *aead_cipher_name(enum SwpCipher cipher) {
+    switch (cipher) {
+        case SwpCipherAesGcm:
+            return "AES-256-GCM";
+        case SwpCipherChaCha:
+            return "ChaCha20-Poly1305";
+        default:
+            return "none";
+    }
+}
+
+ssize_t aead_seal(Aead *aead, unsigned char *buf, size_t len) {
+    buf[0] = aead->cipher == SwpCipherAesGcm ? SUITE_AES_GCM : SUITE_CHACHA;
+    put_be64(buf + 1, aead->id);
+    put_be64(buf + 9, aead->counter);
+    unsigned char nonce[NONCE_SIZE] = { 0 };
+    put_be64(nonce + NONCE_SIZE - 8, aead->counter);
+    aead->counter++;
+
+    EVP_CIPHER_CTX *ctx = aead->seal_ctx;
+    unsigned char *text = buf + AEAD_ENVELOPE_SIZE;
+    int out_len, final_len;
+    if (EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, nonce) != 1
+            || EVP_EncryptUpdate(ctx, NULL, &out_len, buf, AEAD_ENVELOPE_SIZE) != 1
+            || EVP_EncryptUpdate(ctx, text, &out_len, text, len) != 1
+            || EVP_EncryptFinal_ex(ctx, text + out_len, &final_len) != 1
+            || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_SIZE,
+                text + len) != 1) {
+        return -1;
+    }
+    return AEAD_ENVELOPE_SIZE + len + AEAD_TAG_SIZE;
+}
+
+// Decrypts in place with ctx and checks the tag.
+static bool try_open(EVP_CIPHER_CTX *ctx, unsigned char *buf, size_t text_len) {
+    unsigned char nonce[NONCE_SIZE] = { 0 };
+    memcpy(nonce + NONCE_SIZE - 8, buf + 9, 8);
+    unsigned char *text = buf + AEAD_ENVELOPE_SIZE;
+    int out_len, final_len;
+    return EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce) == 1
+        && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_SIZE,
+                text + text_len) == 1
+        && EVP_DecryptUpdate(ctx, NULL, &out_len, buf, AEAD_ENVELOPE_SIZE) == 1
+        && EVP_DecryptUpdate(ctx, text, &out_len, text, text_len) == 1
+        && EVP_DecryptFinal_ex(ctx, text + out_len, &final_len) == 1;
+}
+
+// Refuses a counter that is too old or already seen.
+static bool fresh(AeadPeer *peer, uint64_t counter) {
+    if (counter >= peer->top) {
+        return true;
+    }
+    if (peer->top - counter > REPLAY_WINDOW) {
+        return false;
+    }
+    uint64_t bit = counter % REPLAY_WINDOW;
+    return !(peer->seen[bit / 64] & (1ULL << (bit % 64)));
+}
+
+static void mark_seen(AeadPeer *peer, uint64_t counter) {
+    if (counter >= peer->top) {
+        // Forget the counters that slide out of the window.
+        if (counter - peer->top >= REPLAY_WINDOW) {
+            memset(peer->seen, 0, sizeof(peer->seen));
+        } else {
+            for (uint64_t old = peer->top; old <= counter; old++) {
+                uint64_t bit = old % REPLAY_WINDOW;
+                peer->seen[bit / 64] &= ~(1ULL << (bit % 64));
+            }
+        }
+        peer->top = counter + 1;
+    }
+    uint64_t bit = counter % REPLAY_WINDOW;
+    peer->seen[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static AeadPeer *find_peer(Aead *aead, uint64_t id) {
+    if (aead->last >= 0 && aead->peers[aead->last].id == id) {
+        return &(aead->peers[aead->last]);
+    }
+    for (int idx = 0; idx < aead->npeers; idx++) {
+        if (aead->peers[idx].id == id) {
+            aead->last = idx;
+            return &(aead->peers[idx]);
+        }
+    }
+    return NULL;
+}
+
+// Keeps the context that just opened a datagram from a new peer. Once the
+// table is full, new peers take the slots after the latest one in turn.
+static AeadPeer *add_peer(Aead *aead, uint64_t id, int suite) {
+    int idx = aead->npeers < MAX_PEERS ? aead->npeers++ : (aead->last + 1) % MAX_PEERS;
+    AeadPeer *peer = &(aead->peers[idx]);
+    EVP_CIPHER_CTX *ctx = peer->ctx;
+    memset(peer, 0, sizeof(*peer));
+    peer->id = id;
+    peer->suite = suite;
+    peer->ctx = aead->trial_ctx;
+    aead->trial_ctx = ctx != NULL ? ctx : EVP_CIPHER_CTX_new();
+    aead->last = idx;
+    return peer;
+}
+
+ssize_t aead_open(Aead *aead, unsigned char *buf, size_t len) {
+    if (len < AEAD_OVERHEAD || (buf[0] != SUITE_AES_GCM && buf[0] != SUITE_CHACHA)) {
+        aead->rejected++;
+        return -1;
+    }
+    size_t text_len = len - AEAD_OVERHEAD;
+    uint64_t id = get_be64(buf + 1);
+    uint64_t counter = get_be64(buf + 9);
+
+    // Our own datagrams, reflected back at us, would open under the shared
+    // key, but never come from a peer.
+    if (id == aead->id) {
+        aead->rejected++;
+        return -1;
+    }
+
+    AeadPeer *peer = find_peer(aead, id);
+    if (peer != NULL) {
+        if (peer->suite != buf[0] || !fresh(peer, counter)
+                || !try_open(peer->ctx, buf, text_len)) {
+            aead->rejected++;
+            return -1;
+        }
+    } else {
+        // Only a datagram that authenticates earns its sender a slot.
+        if (aead->trial_ctx == NULL || key_ctx(aead, aead->trial_ctx, buf[0], id, 0) < 0
+                || !try_open(aead->trial_ctx, buf, text_len)) {
+            aead->rejected++;
+            return -1;
+        }
+        peer = add_peer(aead, id, buf[0]);
+    }
+    mark_seen(peer, counter);
+    return text_len;
+}
+
+uint64_t aead_rejected(Aead *aead) {
+    return aead->rejected;
+}
+
+void aead_free(Aead *aead) {
+    if (aead == NULL) {
+        return;
+    }
+    if (aead->peers != NULL) {
+        for (int idx = 0; idx < MAX_PEERS; idx++) {
+            EVP_CIPHER_CTX_free(aead->peers[idx].ctx);
+        }
+        free(aead->peers);
+    }
+    EVP_CIPHER_CTX_free(aead->seal_ctx);
+    EVP_CIPHER_CTX_free(aead->trial_ctx);
+    OPENSSL_cleanse(aead->key, sizeof(aead->key));
+    free(aead);
+}
@@ -0,0 +1,65 @@
+#ifndef AEAD_H
+#define AEAD_H
+
+/*
+ * Authenticated encryption of datagrams under a pre-shared key.
+ *
+ * Each datagram is sealed whole, header included, inside an envelope that
+ * names the cipher suite, the sending endpoint's random 64-bit id and that
+ * endpoint's datagram counter:
+ *
+ *     suite (1) | sender id (8) | counter (8) | ciphertext | tag (16)
+ *
+ * An endpoint seals with a key derived from the pre-shared key and its own
+ * id, so the counter alone keeps nonces unique, and any number of peers,
+ * such as a multicast group, can share one key file. The envelope is
+ * authenticated as additional data. Opening checks the tag and then drops
+ * replays with a sliding window over each peer's counters.
+ *
+ * AES-256-GCM is used where the CPU has AES and carry-less multiply
+ * instructions (AES-NI and PCLMULQDQ, or the ARMv8 equivalents), and
+ * ChaCha20-Poly1305 elsewhere; libcrypto supplies the vectorized code for
+ * both. An endpoint opens whichever suite its peers send.
+ */
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "swp.h"
+
+#define AEAD_KEY_SIZE 32
+#define AEAD_ENVELOPE_SIZE 17
+#define AEAD_TAG_SIZE 16
+#define AEAD_OVERHEAD (AEAD_ENVELOPE_SIZE + AEAD_TAG_SIZE)
+
+typedef struct Aead Aead;
+
+// Reads a key file holding 32 raw bytes or 64 hex digits. Returns 0, or -1
+// after printing why.
+int aead_load_key(const char *path, unsigned char key[AEAD_KEY_SIZE]);
+
+// SwpCipherAuto picks by CPU as above.
+Aead *aead_new(const unsigned char key[AEAD_KEY_SIZE], enum SwpCipher cipher);
+
+enum SwpCipher aead_cipher(Aead *aead);
+
+const char *aead_cipher_name(enum SwpCipher cipher);
+
+// Seals the len bytes of plaintext at buf + AEAD_ENVELOPE_SIZE in place,
+// writing the envelope in front and the tag behind. Returns the length of
+// the datagram, or -1.
+ssize_t aead_seal(Aead *aead, unsigned char *buf, size_t len);
+
+// Opens the datagram of len bytes in buf in place. Returns the length of
+// the plaintext, which starts at buf + AEAD_ENVELOPE_SIZE, or -1 if the
+// datagram is forged, corrupted or a replay.
+ssize_t aead_open(Aead *aead, unsigned char *buf, size_t len);
+
+// Datagrams aead_open() has turned away.
+uint64_t aead_rejected(Aead *aead);
+
+void aead_free(Aead *aead);
+
+#endif
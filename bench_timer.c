@@ -0,0 +1,128 @@
+/*
+ * Microbenchmark for the retransmission timer wheel: arm, cancel and expire
+ * costs at window sizes up to the largest the protocol allows, next to a
+ * linear scan of per-slot deadlines for comparison.
+ *
+ * Usage: bench_timer [rounds]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "timer_wheel.h"
+
+#define TICK_US 250
+#define BUCKETS 1024
+#define RTO_US 5000
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Emulates a sender with `slots` packets in flight for `rounds` RTOs: every
+// packet is armed, most are cancelled by acks, and the rest expire.
+static void bench_wheel(int slots, int rounds) {
+    TimerNode *nodes = calloc(slots, sizeof(TimerNode));
+    TimerWheel wheel;
+    uint64_t now = 0;
+    timer_wheel_init(&wheel, BUCKETS, TICK_US, now);
+
+    uint64_t arm_ns = 0, cancel_ns = 0, expire_ns = 0;
+    uint64_t arms = 0, cancels = 0, expired = 0;
+    int idx, round;
+    for (idx = 0; idx < slots; idx++) {
+        timer_node_init(&nodes[idx]);
+    }
+
+    for (round = 0; round < rounds; round++) {
+        // Packets go out spread over one RTO.
+        uint64_t start = clock_ns();
+        for (idx = 0; idx < slots; idx++) {
+            timer_wheel_arm(&wheel, &nodes[idx], now + RTO_US + (uint64_t)idx * RTO_US / slots);
+        }
+        arm_ns += clock_ns() - start;
+        arms += slots;
+
+        // Acks arrive for all but one packet in 64.
+        start = clock_ns();
+        for (idx = 0; idx < slots; idx++) {
+            if (idx % 64 != 0) {
+                timer_wheel_cancel(&wheel, &nodes[idx]);
+                cancels++;
+            }
+        }
+        cancel_ns += clock_ns() - start;
+
+        // The clock runs on, tick by tick, until the losses time out.
+        start = clock_ns();
+        uint64_t end = now + 2 * RTO_US;
+        for (; now < end; now += TICK_US) {
+            TimerNode *node = timer_wheel_expire(&wheel, now);
+            while (node != NULL) {
+                expired++;
+                node = node->next;
+            }
+        }
+        expire_ns += clock_ns() - start;
+    }
+
+    printf("wheel  %6d slots: arm %5.1f ns  cancel %5.1f ns  expire %6.1f ns/timer  "
+            "%6.1f ns per packet sent  (%llu fired)\n",
+            slots, (double)arm_ns / arms, (double)cancel_ns / cancels,
+            expired ? (double)expire_ns / expired : 0.0,
+            (double)(arm_ns + cancel_ns + expire_ns) / arms,
+            (unsigned long long)expired);
+
+    timer_wheel_free(&wheel);
+    free(nodes);
+}
+
+// The same workload with a deadline per slot and a full scan every tick.
+static void bench_scan(int slots, int rounds) {
+    uint64_t *deadlines = calloc(slots, sizeof(uint64_t));
+    uint64_t now = 0, expired = 0;
+    int idx, round;
+
+    uint64_t start = clock_ns();
+    for (round = 0; round < rounds; round++) {
+        for (idx = 0; idx < slots; idx++) {
+            deadlines[idx] = now + RTO_US + (uint64_t)idx * RTO_US / slots;
+        }
+        for (idx = 0; idx < slots; idx++) {
+            if (idx % 64 != 0) {
+                deadlines[idx] = 0;
+            }
+        }
+        uint64_t end = now + 2 * RTO_US;
+        for (; now < end; now += TICK_US) {
+            for (idx = 0; idx < slots; idx++) {
+                if (deadlines[idx] != 0 && deadlines[idx] <= now) {
+                    deadlines[idx] = 0;
+                    expired++;
+                }
+            }
+        }
+    }
+    uint64_t total_ns = clock_ns() - start;
+
+    printf("scan   %6d slots: %61.1f ns per packet sent  (%llu fired)\n",
+            slots, (double)total_ns / ((uint64_t)slots * rounds),
+            (unsigned long long)expired);
+    free(deadlines);
+}
+
+int main(int argc, char **argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 200;
+    int sizes[] = { 60, 1000, 4000, 16383 };
+    size_t idx;
+
+    for (idx = 0; idx < sizeof(sizes) / sizeof(sizes[0]); idx++) {
+        bench_wheel(sizes[idx], rounds);
+        bench_scan(sizes[idx], rounds);
+    }
+    return 0;
+}
@@ -0,0 +1,888 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include "dedup.h"
+
+#define DEDUP_MAGIC 0x50554444      // "DDUP"
+#define DEDUP_BUF_SIZE (DEDUP_BATCH_BYTES + DEDUP_MAX_CHUNK)
+
+// Cut where the top 13 bits of the gear hash are clear: chunks average
+// 8KB past the minimum.
+#define DEDUP_CUT_MASK 0xfff8000000000000ULL
+
+typedef struct DedupBatchHeader {
+    uint32_t magic;
+    uint32_t id;
+    uint32_t count;
+} DedupBatchHeader;
+
+typedef struct DedupChunkRef {
+    unsigned char hash[DEDUP_HASH_SIZE];
+    uint32_t len;
+} DedupChunkRef;
+
+/*
+ * Chunking
+ */
+
+static uint64_t gear[256];
+static bool gear_ready = false;
+
+// The table is fixed, so the same data always cuts the same way.
+static void init_gear(void) {
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    int idx;
+    for (idx = 0; idx < 256; idx++) {
+        // splitmix64
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[idx] = z ^ (z >> 31);
+    }
+    gear_ready = true;
+}
+
+// Length of the chunk at the start of data, or 0 if its end is not in
+// sight yet.
+static size_t cut_point(const unsigned char *data, size_t len, bool eof) {
+    size_t limit = len < DEDUP_MAX_CHUNK ? len : DEDUP_MAX_CHUNK;
+    if (limit <= DEDUP_MIN_CHUNK) {
+        return eof ? len : 0;
+    }
+
+    uint64_t fp = 0;
+    size_t idx;
+    for (idx = DEDUP_MIN_CHUNK; idx < limit; idx++) {
+        fp = (fp << 1) + gear[data[idx]];
+        if ((fp & DEDUP_CUT_MASK) == 0) {
+            return idx + 1;
+        }
+    }
+    if (limit == DEDUP_MAX_CHUNK) {
+        return DEDUP_MAX_CHUNK;
+    }
+    return eof ? len : 0;
+}
+
+/*
+ * Chunk store
+ */
+
+typedef struct ChunkEntry {
+    unsigned char hash[DEDUP_HASH_SIZE];
+    uint32_t len;
+    struct ChunkEntry *prev;    // LRU list, most recently used first.
+    struct ChunkEntry *next;
+    struct ChunkEntry *chain;   // Hash bucket.
+} ChunkEntry;
+
+struct ChunkStore {
+    char *dir;
+    ChunkEntry **buckets;
+    size_t mask;
+    size_t count;
+    ChunkEntry lru;             // List head.
+    uint64_t bytes;
+    uint64_t max_bytes;
+    uint64_t evictions;
+    bool warned;
+};
+
+static void to_hex(const unsigned char *hash, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    int idx;
+    for (idx = 0; idx < DEDUP_HASH_SIZE; idx++) {
+        hex[2 * idx] = digits[hash[idx] >> 4];
+        hex[2 * idx + 1] = digits[hash[idx] & 0xf];
+    }
+    hex[2 * DEDUP_HASH_SIZE] = '\0';
+}
+
+static bool from_hex(const char *hex, unsigned char *hash) {
+    int idx;
+    if (strlen(hex) != 2 * DEDUP_HASH_SIZE) {
+        return false;
+    }
+    for (idx = 0; idx < 2 * DEDUP_HASH_SIZE; idx++) {
+        char c = hex[idx];
+        int value = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (value < 0) {
+            return false;
+        }
+        if (idx % 2 == 0) {
+            hash[idx / 2] = value << 4;
+        } else {
+            hash[idx / 2] |= value;
+        }
+    }
+    return true;
+}
+
+// Chunks live in 256 subdirectories named by the first byte of the hash.
+static void chunk_path(ChunkStore *store, const unsigned char *hash, char *path) {
+    char hex[2 * DEDUP_HASH_SIZE + 1];
+    to_hex(hash, hex);
+    snprintf(path, PATH_MAX, "%s/%.2s/%s", store->dir, hex, hex);
+}
+
+static size_t bucket_of(ChunkStore *store, const unsigned char *hash) {
+    uint64_t key;
+    memcpy(&key, hash, sizeof(key));
+    return key & store->mask;
+}
+
+static void lru_unlink(ChunkEntry *entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+static void lru_push_front(ChunkStore *store, ChunkEntry *entry) {
+    entry->next = store->lru.next;
+    entry->prev = &(store->lru);
+    store->lru.next->prev = entry;
+    store->lru.next = entry;
+}
+
+static ChunkEntry *store_find(ChunkStore *store, const unsigned char *hash) {
+    ChunkEntry *entry = store->buckets[bucket_of(store, hash)];
+    while (entry != NULL && memcmp(entry->hash, hash, DEDUP_HASH_SIZE) != 0) {
+        entry = entry->chain;
+    }
+    return entry;
+}
+
+static int store_grow(ChunkStore *store) {
+    size_t size = 2 * (store->mask + 1);
+    ChunkEntry **buckets = calloc(size, sizeof(ChunkEntry *));
+    if (buckets == NULL) {
+        return -1;
+    }
+    size_t idx;
+    for (idx = 0; idx <= store->mask; idx++) {
+        ChunkEntry *entry = store->buckets[idx];
+        while (entry != NULL) {
+            ChunkEntry *chain = entry->chain;
+            uint64_t key;
+            memcpy(&key, entry->hash, sizeof(key));
+            entry->chain = buckets[key & (size - 1)];
+            buckets[key & (size - 1)] = entry;
+            entry = chain;
+        }
+    }
+    free(store->buckets);
+    store->buckets = buckets;
+    store->mask = size - 1;
+    return 0;
+}
+
+// Indexes a chunk as the most recently used.
+static ChunkEntry *store_add(ChunkStore *store, const unsigned char *hash, uint32_t len) {
+    if (store->count > store->mask && store_grow(store) < 0) {
+        return NULL;
+    }
+    ChunkEntry *entry = malloc(sizeof(*entry));
+    if (entry == NULL) {
+        return NULL;
+    }
+    memcpy(entry->hash, hash, DEDUP_HASH_SIZE);
+    entry->len = len;
+    size_t bucket = bucket_of(store, hash);
+    entry->chain = store->buckets[bucket];
+    store->buckets[bucket] = entry;
+    lru_push_front(store, entry);
+    store->count++;
+    store->bytes += len;
+    return entry;
+}
+
+static void store_remove(ChunkStore *store, ChunkEntry *entry) {
+    ChunkEntry **link = &(store->buckets[bucket_of(store, entry->hash)]);
+    while (*link != entry) {
+        link = &((*link)->chain);
+    }
+    *link = entry->chain;
+    lru_unlink(entry);
+    store->count--;
+    store->bytes -= entry->len;
+    free(entry);
+}
+
+// Evicts from the cold end until the store fits.
+static void store_trim(ChunkStore *store) {
+    char path[PATH_MAX];
+    while (store->bytes > store->max_bytes && store->lru.prev != &(store->lru)) {
+        ChunkEntry *entry = store->lru.prev;
+        chunk_path(store, entry->hash, path);
+        unlink(path);
+        store_remove(store, entry);
+        store->evictions++;
+    }
+}
+
+typedef struct ChunkFile {
+    unsigned char hash[DEDUP_HASH_SIZE];
+    uint32_t len;
+    struct timespec mtime;
+} ChunkFile;
+
+static int by_mtime(const void *lhs, const void *rhs) {
+    const ChunkFile *a = lhs, *b = rhs;
+    if (a->mtime.tv_sec != b->mtime.tv_sec) {
+        return a->mtime.tv_sec < b->mtime.tv_sec ? -1 : 1;
+    }
+    if (a->mtime.tv_nsec != b->mtime.tv_nsec) {
+        return a->mtime.tv_nsec < b->mtime.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+// Rebuilds the index from the chunk files, oldest first so the most
+// recently used end up at the front.
+static int store_load(ChunkStore *store) {
+    ChunkFile *files = NULL;
+    size_t nfiles = 0, max_files = 0;
+    char path[PATH_MAX];
+    int sub;
+
+    for (sub = 0; sub < 256; sub++) {
+        snprintf(path, sizeof(path), "%s/%02x", store->dir, sub);
+        DIR *dir = opendir(path);
+        if (dir == NULL) {
+            continue;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            struct stat st;
+            unsigned char hash[DEDUP_HASH_SIZE];
+            size_t name_len = strlen(entry->d_name);
+            if (name_len > 4 && strcmp(entry->d_name + name_len - 4, ".tmp") == 0) {
+                // Left over from an interrupted store.
+                unlinkat(dirfd(dir), entry->d_name, 0);
+                continue;
+            }
+            if (!from_hex(entry->d_name, hash)
+                    || fstatat(dirfd(dir), entry->d_name, &st, 0) < 0
+                    || !S_ISREG(st.st_mode) || st.st_size == 0
+                    || st.st_size > DEDUP_MAX_CHUNK) {
+                continue;
+            }
+            if (nfiles == max_files) {
+                max_files = max_files ? 2 * max_files : 1024;
+                ChunkFile *grown = realloc(files, max_files * sizeof(ChunkFile));
+                if (grown == NULL) {
+                    closedir(dir);
+                    free(files);
+                    return -1;
+                }
+                files = grown;
+            }
+            memcpy(files[nfiles].hash, hash, DEDUP_HASH_SIZE);
+            files[nfiles].len = st.st_size;
+            files[nfiles].mtime = st.st_mtim;
+            nfiles++;
+        }
+        closedir(dir);
+    }
+
+    // An empty store has no array to sort.
+    if (nfiles > 0) {
+        qsort(files, nfiles, sizeof(ChunkFile), by_mtime);
+    }
+    size_t idx;
+    for (idx = 0; idx < nfiles; idx++) {
+        if (store_find(store, files[idx].hash) == NULL
+                && store_add(store, files[idx].hash, files[idx].len) == NULL) {
+            free(files);
+            return -1;
+        }
+    }
+    free(files);
+    return 0;
+}
+
+ChunkStore *chunk_store_open(const char *dir, uint64_t max_bytes) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "chunk_store_open: Failed to create %s: %s\n", dir, strerror(errno));
+        return NULL;
+    }
+
+    ChunkStore *store = calloc(1, sizeof(*store));
+    if (store == NULL) {
+        return NULL;
+    }
+    // Absolute, so the store survives the caller changing directory.
+    store->dir = realpath(dir, NULL);
+    store->mask = 1023;
+    store->buckets = calloc(store->mask + 1, sizeof(ChunkEntry *));
+    store->lru.next = &(store->lru);
+    store->lru.prev = &(store->lru);
+    store->max_bytes = max_bytes;
+    if (store->dir == NULL || store->buckets == NULL || store_load(store) < 0) {
+        chunk_store_close(store);
+        return NULL;
+    }
+    store_trim(store);
+    return store;
+}
+
+void chunk_store_close(ChunkStore *store) {
+    if (store == NULL) {
+        return;
+    }
+    while (store->lru.next != &(store->lru)) {
+        store_remove(store, store->lru.next);
+    }
+    free(store->buckets);
+    free(store->dir);
+    free(store);
+}
+
+// Reads a stored chunk into buf. A chunk file that has gone missing or
+// changed size is forgotten, and the chunk is requested instead.
+static bool chunk_store_get(ChunkStore *store, const unsigned char *hash,
+        uint32_t len, unsigned char *buf) {
+    ChunkEntry *entry = store_find(store, hash);
+    if (entry == NULL || entry->len != len) {
+        return false;
+    }
+
+    char path[PATH_MAX];
+    chunk_path(store, hash, path);
+    int fd = open(path, O_RDONLY);
+    ssize_t read_len = -1;
+    if (fd >= 0) {
+        read_len = read(fd, buf, len);
+        close(fd);
+    }
+    if (read_len != len) {
+        store_remove(store, entry);
+        return false;
+    }
+
+    // The modification time records recency across restarts.
+    lru_unlink(entry);
+    lru_push_front(store, entry);
+    utimensat(AT_FDCWD, path, NULL, 0);
+    return true;
+}
+
+// Adds a chunk. Failing to store one only costs a future hit, so errors
+// are reported once and otherwise ignored.
+static void chunk_store_put(ChunkStore *store, const unsigned char *hash,
+        const unsigned char *data, uint32_t len) {
+    if (store_find(store, hash) != NULL) {
+        return;
+    }
+
+    char path[PATH_MAX], tmp_path[PATH_MAX + 4];
+    chunk_path(store, hash, path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    // Create the subdirectory on first use.
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    mkdir(path, 0755);
+    *slash = '/';
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool stored = fd >= 0 && write(fd, data, len) == len;
+    if (fd >= 0 && close(fd) < 0) {
+        stored = false;
+    }
+    if (stored && rename(tmp_path, path) < 0) {
+        stored = false;
+    }
+    if (!stored) {
+        if (!store->warned) {
+            fprintf(stderr, "chunk_store_put: Failed to store %s: %s\n", path, strerror(errno));
+            store->warned = true;
+        }
+        unlink(tmp_path);
+        return;
+    }
+
+    if (store_add(store, hash, len) == NULL) {
+        unlink(path);
+        return;
+    }
+    store_trim(store);
+}
+
+/*
+ * Sender
+ */
+
+enum DedupReadState {
+    DedupFill,          // Reading and cutting the next batch.
+    DedupAnnounce,      // Handing out its table.
+    DedupWait,          // Waiting for the receiver's bitmap.
+    DedupSend           // Handing out the chunks it asked for.
+};
+
+struct DedupReader {
+    SwpReadFn read_fn;
+    void *read_ctx;
+    DedupAwaitFn await_fn;
+    void *await_ctx;
+    enum DedupReadState state;
+
+    unsigned char *buf;
+    size_t data_len;
+    size_t scan_pos;        // Bytes cut into chunks of the current batch.
+    bool eof;
+
+    uint32_t id;
+    int count;
+    size_t batch_bytes;
+    size_t offsets[DEDUP_BATCH_CHUNKS];
+    uint32_t lens[DEDUP_BATCH_CHUNKS];
+    unsigned char announce[sizeof(DedupBatchHeader)
+        + DEDUP_BATCH_CHUNKS * sizeof(DedupChunkRef)];
+    size_t announce_len;
+    size_t announce_pos;
+    unsigned char need[DEDUP_BATCH_CHUNKS / 8];
+    int send_idx;
+    size_t send_pos;
+
+    DedupStats stats;
+};
+
+DedupReader *dedup_reader_new(SwpReadFn read_fn, void *read_ctx,
+        DedupAwaitFn await_fn, void *await_ctx) {
+    if (!gear_ready) {
+        init_gear();
+    }
+    DedupReader *reader = calloc(1, sizeof(*reader));
+    if (reader == NULL) {
+        return NULL;
+    }
+    reader->buf = malloc(DEDUP_BUF_SIZE);
+    if (reader->buf == NULL) {
+        free(reader);
+        return NULL;
+    }
+    reader->read_fn = read_fn;
+    reader->read_ctx = read_ctx;
+    reader->await_fn = await_fn;
+    reader->await_ctx = await_ctx;
+    reader->state = DedupFill;
+    return reader;
+}
+
+// Cuts chunks until the batch is full or the source runs dry. Returns 1
+// when a batch is ready, 0 at the end of the stream, or -1 with errno set.
+static int fill_batch(DedupReader *reader) {
+    while (true) {
+        while (reader->count < DEDUP_BATCH_CHUNKS && reader->batch_bytes < DEDUP_BATCH_BYTES) {
+            unsigned char *data = reader->buf + reader->scan_pos;
+            size_t cut = cut_point(data, reader->data_len - reader->scan_pos, reader->eof);
+            if (cut == 0) {
+                break;
+            }
+            DedupChunkRef *ref = (DedupChunkRef *)(reader->announce
+                    + sizeof(DedupBatchHeader)) + reader->count;
+            SHA256(data, cut, ref->hash);
+            ref->len = cut;
+            reader->offsets[reader->count] = reader->scan_pos;
+            reader->lens[reader->count] = cut;
+            reader->count++;
+            reader->scan_pos += cut;
+            reader->batch_bytes += cut;
+        }
+
+        if (reader->count == DEDUP_BATCH_CHUNKS || reader->batch_bytes >= DEDUP_BATCH_BYTES
+                || (reader->eof && reader->scan_pos == reader->data_len)) {
+            return reader->count > 0;
+        }
+
+        ssize_t read = reader->read_fn(reader->read_ctx, reader->buf + reader->data_len,
+                DEDUP_BUF_SIZE - reader->data_len);
+        if (read < 0) {
+            return -1;
+        } else if (read == 0) {
+            reader->eof = true;
+        }
+        reader->data_len += read;
+    }
+}
+
+ssize_t dedup_reader_read(void *ctx, void *buf, size_t len) {
+    DedupReader *reader = ctx;
+    unsigned char *out = buf;
+    size_t filled = 0;
+
+    while (filled < len) {
+        if (reader->state == DedupFill) {
+            int ready = fill_batch(reader);
+            if (ready < 0) {
+                if (filled > 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return filled;
+                }
+                return -1;
+            } else if (ready == 0) {
+                break;
+            }
+            DedupBatchHeader head;
+            head.magic = DEDUP_MAGIC;
+            head.id = ++reader->id;
+            head.count = reader->count;
+            memcpy(reader->announce, &head, sizeof(head));
+            reader->announce_len = sizeof(head) + reader->count * sizeof(DedupChunkRef);
+            reader->announce_pos = 0;
+            reader->stats.chunks += reader->count;
+            reader->state = DedupAnnounce;
+        } else if (reader->state == DedupAnnounce) {
+            size_t n = reader->announce_len - reader->announce_pos;
+            if (n > len - filled) {
+                n = len - filled;
+            }
+            memcpy(out + filled, reader->announce + reader->announce_pos, n);
+            reader->announce_pos += n;
+            filled += n;
+            if (reader->announce_pos == reader->announce_len) {
+                reader->state = DedupWait;
+                reader->await_fn(reader->await_ctx, reader->id);
+            }
+        } else if (reader->state == DedupWait) {
+            // Let the table go out now rather than wait for a full packet.
+            if (filled > 0) {
+                return filled;
+            }
+            errno = EAGAIN;
+            return -1;
+        } else {
+            int idx = reader->send_idx;
+            if (idx < reader->count && !(reader->need[idx / 8] & (1 << (idx % 8)))) {
+                reader->stats.hits++;
+                reader->stats.saved += reader->lens[idx];
+                reader->send_idx++;
+                continue;
+            }
+            if (idx == reader->count) {
+                // Keep the uncut tail for the next batch.
+                memmove(reader->buf, reader->buf + reader->scan_pos,
+                        reader->data_len - reader->scan_pos);
+                reader->data_len -= reader->scan_pos;
+                reader->scan_pos = 0;
+                reader->count = 0;
+                reader->batch_bytes = 0;
+                reader->state = DedupFill;
+                continue;
+            }
+
+            size_t n = reader->lens[idx] - reader->send_pos;
+            if (n > len - filled) {
+                n = len - filled;
+            }
+            memcpy(out + filled, reader->buf + reader->offsets[idx] + reader->send_pos, n);
+            reader->send_pos += n;
+            filled += n;
+            if (reader->send_pos == reader->lens[idx]) {
+                reader->send_idx++;
+                reader->send_pos = 0;
+            }
+        }
+    }
+    return filled;
+}
+
+bool dedup_reader_need(DedupReader *reader, uint32_t id, const void *bitmap, size_t len) {
+    if (reader->state != DedupWait || id != reader->id
+            || len < (size_t)(reader->count + 7) / 8) {
+        return false;
+    }
+    memset(reader->need, 0, sizeof(reader->need));
+    memcpy(reader->need, bitmap, (reader->count + 7) / 8);
+    reader->send_idx = 0;
+    reader->send_pos = 0;
+    reader->state = DedupSend;
+    return true;
+}
+
+void dedup_reader_get_stats(DedupReader *reader, DedupStats *stats) {
+    *stats = reader->stats;
+}
+
+void dedup_reader_free(DedupReader *reader) {
+    if (reader == NULL) {
+        return;
+    }
+    free(reader->buf);
+    free(reader);
+}
+
+/*
+ * Receiver
+ */
+
+enum DedupWriteState {
+    DedupHead,
+    DedupTable,
+    DedupBody           // Receiving the chunks it asked for.
+};
+
+// Where a chunk of the current batch comes from, if not an earlier chunk
+// of the same batch.
+#define SOURCE_WIRE -1
+#define SOURCE_STORE -2
+
+struct DedupWriter {
+    ChunkStore *store;
+    SwpWriteFn write_fn;
+    void *write_ctx;
+    DedupNeedFn need_fn;
+    void *need_ctx;
+    enum DedupWriteState state;
+    size_t pos;             // Bytes of the header or table received.
+
+    DedupBatchHeader head;
+    DedupChunkRef refs[DEDUP_BATCH_CHUNKS];
+    size_t offsets[DEDUP_BATCH_CHUNKS];
+    int source[DEDUP_BATCH_CHUNKS];
+    unsigned char *batch;
+    int count;
+    int fill_idx;           // Chunk being received.
+    size_t fill_pos;
+    int emit_idx;           // Chunk being written out.
+    size_t emit_pos;
+
+    DedupStats stats;
+};
+
+DedupWriter *dedup_writer_new(ChunkStore *store, SwpWriteFn write_fn, void *write_ctx,
+        DedupNeedFn need_fn, void *need_ctx) {
+    DedupWriter *writer = calloc(1, sizeof(*writer));
+    if (writer == NULL) {
+        return NULL;
+    }
+    writer->batch = malloc(DEDUP_BUF_SIZE);
+    if (writer->batch == NULL) {
+        free(writer);
+        return NULL;
+    }
+    writer->store = store;
+    writer->write_fn = write_fn;
+    writer->write_ctx = write_ctx;
+    writer->need_fn = need_fn;
+    writer->need_ctx = need_ctx;
+    writer->state = DedupHead;
+    return writer;
+}
+
+static int bad_stream(const char *reason) {
+    fprintf(stderr, "dedup_writer_write: %s.\n", reason);
+    errno = EINVAL;
+    return -1;
+}
+
+static int next_wire(DedupWriter *writer, int from) {
+    while (from < writer->count && writer->source[from] != SOURCE_WIRE) {
+        from++;
+    }
+    return from;
+}
+
+// Finds each chunk in the batch or the store and asks for the rest.
+static int begin_batch(DedupWriter *writer) {
+    unsigned char need[DEDUP_BATCH_CHUNKS / 8];
+    size_t offset = 0;
+    int idx, prev;
+
+    memset(need, 0, sizeof(need));
+    for (idx = 0; idx < writer->count; idx++) {
+        DedupChunkRef *ref = &(writer->refs[idx]);
+        if (ref->len == 0 || ref->len > DEDUP_MAX_CHUNK
+                || offset + ref->len > DEDUP_BUF_SIZE) {
+            return bad_stream("Bad chunk length");
+        }
+        writer->offsets[idx] = offset;
+        offset += ref->len;
+
+        writer->source[idx] = SOURCE_WIRE;
+        for (prev = 0; prev < idx; prev++) {
+            if (writer->refs[prev].len == ref->len
+                    && memcmp(writer->refs[prev].hash, ref->hash, DEDUP_HASH_SIZE) == 0) {
+                writer->source[idx] = prev;
+                break;
+            }
+        }
+        if (writer->source[idx] == SOURCE_WIRE && writer->store != NULL
+                && chunk_store_get(writer->store, ref->hash, ref->len,
+                    writer->batch + writer->offsets[idx])) {
+            writer->source[idx] = SOURCE_STORE;
+        }
+
+        writer->stats.chunks++;
+        if (writer->source[idx] == SOURCE_WIRE) {
+            need[idx / 8] |= 1 << (idx % 8);
+        } else {
+            writer->stats.hits++;
+            writer->stats.saved += ref->len;
+        }
+    }
+
+    writer->need_fn(writer->need_ctx, writer->head.id, need, (writer->count + 7) / 8);
+    writer->fill_idx = next_wire(writer, 0);
+    writer->fill_pos = 0;
+    writer->emit_idx = 0;
+    writer->emit_pos = 0;
+    return 0;
+}
+
+// Writes out chunks in order as far as they are complete. Returns 0 once
+// caught up, or -1 with errno set.
+static int emit(DedupWriter *writer) {
+    while (writer->emit_idx < writer->count) {
+        int idx = writer->emit_idx;
+        if (writer->source[idx] == SOURCE_WIRE && idx >= writer->fill_idx) {
+            return 0;
+        }
+        unsigned char *data = writer->batch + writer->offsets[idx];
+        size_t len = writer->refs[idx].len;
+        if (writer->source[idx] >= 0 && writer->emit_pos == 0) {
+            memcpy(data, writer->batch + writer->offsets[writer->source[idx]], len);
+        }
+
+        while (writer->emit_pos < len) {
+            ssize_t written = writer->write_fn(writer->write_ctx,
+                    data + writer->emit_pos, len - writer->emit_pos);
+            if (written < 0) {
+                return -1;
+            } else if (written == 0) {
+                errno = EAGAIN;
+                return -1;
+            }
+            writer->emit_pos += written;
+        }
+        writer->emit_idx++;
+        writer->emit_pos = 0;
+    }
+    return 0;
+}
+
+static bool blocked(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+ssize_t dedup_writer_write(void *ctx, const void *buf, size_t len) {
+    DedupWriter *writer = ctx;
+    const unsigned char *in = buf;
+    size_t used = 0;
+
+    while (used < len) {
+        size_t n;
+        if (writer->state == DedupHead) {
+            // The previous batch has to be out before the next comes in.
+            if (writer->emit_idx < writer->count) {
+                if (emit(writer) < 0) {
+                    if (blocked()) {
+                        break;
+                    }
+                    return -1;
+                }
+            }
+            n = sizeof(writer->head) - writer->pos;
+            if (n > len - used) {
+                n = len - used;
+            }
+            memcpy((unsigned char *)&(writer->head) + writer->pos, in + used, n);
+            used += n;
+            writer->pos += n;
+            if (writer->pos == sizeof(writer->head)) {
+                if (writer->head.magic != DEDUP_MAGIC || writer->head.count == 0
+                        || writer->head.count > DEDUP_BATCH_CHUNKS) {
+                    return bad_stream("Bad batch header");
+                }
+                writer->count = writer->head.count;
+                writer->emit_idx = writer->count;
+                writer->state = DedupTable;
+                writer->pos = 0;
+            }
+        } else if (writer->state == DedupTable) {
+            n = writer->count * sizeof(DedupChunkRef) - writer->pos;
+            if (n > len - used) {
+                n = len - used;
+            }
+            memcpy((unsigned char *)writer->refs + writer->pos, in + used, n);
+            used += n;
+            writer->pos += n;
+            if (writer->pos == writer->count * sizeof(DedupChunkRef)) {
+                if (begin_batch(writer) < 0) {
+                    return -1;
+                }
+                writer->state = writer->fill_idx < writer->count ? DedupBody : DedupHead;
+                writer->pos = 0;
+                if (emit(writer) < 0 && !blocked()) {
+                    return -1;
+                }
+            }
+        } else {
+            DedupChunkRef *ref = &(writer->refs[writer->fill_idx]);
+            unsigned char *data = writer->batch + writer->offsets[writer->fill_idx];
+            n = ref->len - writer->fill_pos;
+            if (n > len - used) {
+                n = len - used;
+            }
+            memcpy(data + writer->fill_pos, in + used, n);
+            used += n;
+            writer->fill_pos += n;
+            if (writer->fill_pos == ref->len) {
+                unsigned char hash[DEDUP_HASH_SIZE];
+                SHA256(data, ref->len, hash);
+                if (memcmp(hash, ref->hash, DEDUP_HASH_SIZE) != 0) {
+                    return bad_stream("Chunk does not match its hash");
+                }
+                if (writer->store != NULL) {
+                    chunk_store_put(writer->store, ref->hash, data, ref->len);
+                }
+                writer->fill_idx = next_wire(writer, writer->fill_idx + 1);
+                writer->fill_pos = 0;
+                if (writer->fill_idx == writer->count) {
+                    writer->state = DedupHead;
+                }
+                if (emit(writer) < 0 && !blocked()) {
+                    return -1;
+                }
+            }
+        }
+    }
+
+    if (used == 0 && len > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return used;
+}
+
+int dedup_writer_flush(DedupWriter *writer) {
+    if (writer->state != DedupHead || writer->pos != 0) {
+        fprintf(stderr, "dedup_writer_flush: Stream ended mid-batch.\n");
+        errno = EINVAL;
+        return -1;
+    }
+    return emit(writer);
+}
+
+void dedup_writer_get_stats(DedupWriter *writer, DedupStats *stats) {
+    *stats = writer->stats;
+    stats->evictions = writer->store != NULL ? writer->store->evictions : 0;
+}
+
+void dedup_writer_free(DedupWriter *writer) {
+    if (writer == NULL) {
+        return;
+    }
+    free(writer->batch);
+    free(writer);
+}
@@ -0,0 +1,93 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+/*
+ * Chunk-level deduplication of a byte stream against a store on the
+ * receiver.
+ *
+ * The sender cuts its data into content-defined chunks (a gear rolling
+ * hash, so an insertion only moves the boundaries next to it) and sends
+ * them in batches. Each batch starts with a table of SHA-256 hashes and
+ * lengths. The receiver answers with a bitmap of the chunks it lacks, and
+ * only those follow on the wire. It then rebuilds the batch from its
+ * store, earlier chunks of the same batch and the wire, and stores what
+ * was new. The store is a directory of chunk files whose total size is
+ * bounded by evicting the least recently used chunk; recency survives
+ * restarts through the files' modification times.
+ */
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "swp.h"
+
+#define DEDUP_HASH_SIZE 32
+#define DEDUP_MIN_CHUNK (2 * 1024)
+#define DEDUP_MAX_CHUNK (64 * 1024)
+// A batch closes at this many bytes or chunks, whichever comes first.
+#define DEDUP_BATCH_BYTES (1024 * 1024)
+#define DEDUP_BATCH_CHUNKS 256
+
+typedef struct DedupStats {
+    uint64_t chunks;
+    uint64_t hits;          // Chunks that did not cross the wire.
+    uint64_t saved;         // Their bytes.
+    uint64_t evictions;     // Receiver: chunks dropped from the store.
+} DedupStats;
+
+typedef struct ChunkStore ChunkStore;
+
+typedef struct DedupReader DedupReader;
+
+typedef struct DedupWriter DedupWriter;
+
+// Called by the reader once a batch's table has been handed out: the
+// receiver's bitmap for batch id has to arrive before its chunks can go.
+typedef void (*DedupAwaitFn)(void *ctx, uint32_t id);
+
+// Called by the writer with the bitmap of chunks it needs from batch id.
+typedef void (*DedupNeedFn)(void *ctx, uint32_t id, const void *bitmap, size_t len);
+
+// Opens, or creates, the store in dir and trims it to max_bytes.
+ChunkStore *chunk_store_open(const char *dir, uint64_t max_bytes);
+
+void chunk_store_close(ChunkStore *store);
+
+DedupReader *dedup_reader_new(SwpReadFn read_fn, void *read_ctx,
+        DedupAwaitFn await_fn, void *await_ctx);
+
+// SwpReadFn over the deduplicated stream. Returns -1 with EAGAIN while
+// waiting on the source or on the receiver's bitmap.
+ssize_t dedup_reader_read(void *ctx, void *buf, size_t len);
+
+// Hands the reader the receiver's bitmap. Returns true if it was the one
+// being waited for.
+bool dedup_reader_need(DedupReader *reader, uint32_t id, const void *bitmap, size_t len);
+
+void dedup_reader_get_stats(DedupReader *reader, DedupStats *stats);
+
+void dedup_reader_free(DedupReader *reader);
+
+// Rebuilds the stream into write_fn. store may be NULL, in which case
+// every chunk is requested.
+DedupWriter *dedup_writer_new(ChunkStore *store, SwpWriteFn write_fn, void *write_ctx,
+        DedupNeedFn need_fn, void *need_ctx);
+
+// SwpWriteFn: consumes stream bytes. At most one batch of output is held
+// back while write_fn pushes back; beyond that this returns a short count,
+// or -1 with EAGAIN.
+ssize_t dedup_writer_write(void *ctx, const void *buf, size_t len);
+
+// Writes out whatever is held back. Returns 0 once the stream is complete,
+// or -1 with errno set: EAGAIN if write_fn pushed back, EINVAL if the
+// stream stopped mid-batch.
+int dedup_writer_flush(DedupWriter *writer);
+
+void dedup_writer_get_stats(DedupWriter *writer, DedupStats *stats);
+
+void dedup_writer_free(DedupWriter *writer);
+
+#endif
@@ -1,6 +1,11 @@
-#include <sys/types.h>
+#include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -8,66 +13,152 @@
 #include <string.h>
 #include <unistd.h>
 
-#include "reliable_file.h"
+#include "aead.h"
+#include "dedup.h"
+#include "swp.h"
+#include "tree.h"
+
+struct recv_options {
+    bool to_stdout; // Write the data to stdout instead of <filename>.recv.
+    int ack_every;  // Coalesce acks for in-order data, 0 for the default.
+    int ack_delay;  // Delayed-ack timer in microseconds, -1 for the default.
+    char *cache_dir;    // Chunk store for deduplicated transfers, or NULL.
+    int cache_mb;       // Its size limit.
+    char *group;        // Multicast group to join on the -p port, or NULL.
+    bool encrypt;       // Accept only datagrams sealed with key.
+    unsigned char key[AEAD_KEY_SIZE];
+};
+
+// Where the data goes: one file, or a tree rebuilt under <dirname>.recv/.
+struct recv_sink {
+    FILE *file;
+    TreeWriter *tree;
+    struct timeval start;
+    struct timeval last_write;
+};
 
 int open_connect(short port);
 
-int recv_swp(int sockfd, short port);
+int open_group(const char *group, short port);
+
+int recv_swp(int *sockfds, int nsockets, int group_fd, struct recv_options opts);
 
-int process_recv_data(void *data, size_t data_len, Packet *packet);
+int open_recv_file(void *ctx, const char *subdir, const char *filename);
 
-int write_swp_packet(Packet read, FILE *write);
+ssize_t write_swp_packet(void *ctx, const void *data, size_t len);
 
-void send_ack(int sockfd, void *send_buf, int ack_num, int offset,
-        struct sockaddr_in send_addr, socklen_t sender_len); 
+int skip_zeros(void *ctx, uint64_t len);
+
+int finish_recv_file(void *ctx);
 
 int main(int argc, char **argv) {
-    // Send error if aguments not formatted properly
-    if (argc != 3) {
-        fprintf(stderr, "Usage: recvfile -p <recv_port>\n");
-        exit(1);
-    }
+    char *usage_str = "recvfile -p <recv_port> [-p ...] [-c] [-a <ack_every>] [-d <ack_delay_us>] [-D <cache_dir> [-M <cache_mb>]] [-m <group>] [-k <keyfile>]";
 
-    short port;
+    // Each -p after the first is another port to take a striped transfer on.
+    short ports[SWP_MAX_PATHS];
+    int nports = 0;
+    struct recv_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.ack_delay = -1;
+    opts.cache_mb = 1024;
 
     // Process command line arguments
     int opt;
     bool abort_f = false;
-    while ((opt = getopt(argc, argv, "p:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:ca:d:D:M:m:k:")) != -1) {
         switch (opt) {
             case 'p':
-                port = atoi(optarg);
+                if (nports == SWP_MAX_PATHS) {
+                    fprintf(stderr, "At most %d ports.\n", SWP_MAX_PATHS);
+                    abort_f = true;
+                } else {
+                    ports[nports++] = atoi(optarg);
+                }
+                break;
+            case 'c':
+                opts.to_stdout = true;
+                break;
+            case 'a':
+                if ((opts.ack_every = atoi(optarg)) < 1) {
+                    fprintf(stderr, "Option -a requires a positive count.\n");
+                    abort_f = true;
+                }
+                break;
+            case 'd':
+                if ((opts.ack_delay = atoi(optarg)) < 0) {
+                    fprintf(stderr, "Option -d requires a delay in microseconds.\n");
+                    abort_f = true;
+                }
+                break;
+            case 'D':
+                opts.cache_dir = optarg;
+                break;
+            case 'M':
+                if ((opts.cache_mb = atoi(optarg)) < 1) {
+                    fprintf(stderr, "Option -M requires a size in megabytes.\n");
+                    abort_f = true;
+                }
+                break;
+            case 'm':
+                opts.group = optarg;
+                break;
+            case 'k':
+                if (aead_load_key(optarg, opts.key) < 0) {
+                    abort_f = true;
+                }
+                opts.encrypt = true;
                 break;
             case '?':
                 if (optopt == 'p') {
                     fprintf(stderr, "Option -p requires a port number.\n");
+                } else if (optopt == 'a' || optopt == 'd' || optopt == 'D'
+                        || optopt == 'M' || optopt == 'm' || optopt == 'k') {
+                    fprintf(stderr, "Option -%c requires an argument.\n", optopt);
                 }
                 else {
-                    fprintf(stderr, "Unknown flag %c.\nUsage: recvfile -p <recv_port>\n", opt);
+                    fprintf(stderr, "Unknown flag %c.\n", optopt);
                 }
             default:
                 abort_f = true;
         }
     }
 
-    if (abort_f) {
+    // Send error if aguments not formatted properly
+    if (nports > 1 && opts.group != NULL) {
+        fprintf(stderr, "Option -m takes a single -p.\n");
+        abort_f = true;
+    }
+    if (abort_f || nports == 0 || optind != argc) {
+        fprintf(stderr, "Usage: %s\n", usage_str);
         exit(1);
     }
 
-    int sockfd = open_connect(port);
-    if (sockfd < 0) {
-        fprintf(stderr, "Undable to bind socket.\n");
+    // A multicast receiver listens on the group's port and answers from a
+    // port of its own, so several can share a host.
+    int sockfds[SWP_MAX_PATHS];
+    for (int idx = 0; idx < nports; idx++) {
+        sockfds[idx] = open_connect(opts.group != NULL ? 0 : ports[idx]);
+        if (sockfds[idx] < 0) {
+            fprintf(stderr, "Undable to bind socket.\n");
+            exit(1);
+        }
+    }
+    int group_fd = -1;
+    if (opts.group != NULL && (group_fd = open_group(opts.group, ports[0])) < 0) {
+        fprintf(stderr, "Unable to join group %s.\n", opts.group);
+        close(sockfds[0]);
         exit(1);
     }
 
-    // Set five-second timeout on receiving.
-    struct timeval timeout;
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
-    recv_swp(sockfd, htons(port));
+    int status = recv_swp(sockfds, nports, group_fd, opts);
 
-    return 0;
+    for (int idx = 0; idx < nports; idx++) {
+        close(sockfds[idx]);
+    }
+    if (group_fd >= 0) {
+        close(group_fd);
+    }
+    return status == 0 ? 0 : 1;
 }
 
 int open_connect(short port) {
@@ -85,213 +176,242 @@ int open_connect(short port) {
     recv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     recv_addr.sin_port = htons(port);
 
-    bind(sockfd, (const struct sockaddr *) &recv_addr, sizeof(recv_addr));
+    // Room for a large sender window to land while we are busy writing.
+    int rcvbuf = 8 * 1024 * 1024;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    if (bind(sockfd, (const struct sockaddr *) &recv_addr, sizeof(recv_addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
 
     return sockfd;
 
 }
 
-int process_swp_packet(SlidingWindow *window, Packet packet, FILE *file) {
-    if (in_bounds(*window, packet.header.ack_num)) {
-        //printf("process_swp_packet: Processing SWP packet of ack_num %d\n", packet.header.ack_num);
-        //printf("process_swp_packet: Current minimum accepting ack number: %d\n", window->min_accept);
-        
-        PacketInfo *pack_info = get_packet_info(*window, packet.header.ack_num);
-        pack_info->terminal = false;
-        
-        if (packet.header.type == Terminal) {
-            //printf("process_swp_packet: Received terminal packet from sender.\n");
-            //printf("process_swp_packet: T packet = %d\n", packet.header.ack_num);
-            pack_info->terminal = true;
-        }
-
+int open_group(const char *group, short port) {
+    struct sockaddr_in group_addr;
+    struct ip_mreq mreq;
+    int sockfd;
 
-        else if (ftell(file) > packet.header.offset) {
-            printf("[recv data] %d (%zu) IGNORED\n", packet.header.offset, packet.header.length);
-            return decrement_mod(window->min_accept, TOT_WINDOWS);
-        }
+    memset(&group_addr, 0, sizeof(group_addr));
+    group_addr.sin_family = AF_INET;
+    group_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, group, &(group_addr.sin_addr)) != 1
+            || !IN_MULTICAST(ntohl(group_addr.sin_addr.s_addr))) {
+        fprintf(stderr, "%s is not a multicast group.\n", group);
+        return -1;
+    }
 
-        if (!pack_info->ack) {
-            pack_info->ack = true;
-        } else {
-            printf("[recv data] %d (%zu) IGNORED\n", packet.header.offset, packet.header.length);
-        }
-        
-        // Copy packet into PacketInfo struct.
-        memcpy(&(pack_info->packet), &packet, sizeof(packet));
-        
-
-        // Advance window, if ready.
-        if (packet.header.ack_num == window->min_accept) {
-            printf("[recv data] %d (%zu) ACCEPTED (in-order)\n", 
-                    pack_info->packet.header.offset, packet.header.length);
-            PacketInfo *check_pack_info = get_packet_info(*window, window->min_accept);
-            while (check_pack_info->ack == true) {
-                if (check_pack_info->terminal == true) {
-                    return check_pack_info->packet.header.ack_num;
-                }
-                printf("process_swp_packet: As it turns out, ack_num %d has been found already.\n",
-                        check_pack_info->packet.header.ack_num);
-                //printf("process_swp_packet: Packet length: %zu bytes.\n", check_pack_info->packet.header.length);
-                write_swp_packet(check_pack_info->packet, file);
-                shift_window(window);
-                printf("process_swp_packet: New minimum accepting: %d\n", window->min_accept);
-                check_pack_info = get_packet_info(*window, window->min_accept);
-            }
-        } else {
-            printf("[recv data] %d (%zu) ACCEPTED (out-of-order)\n", packet.header.offset,
-                    packet.header.length);
-        }
-        
-    } else {
-        printf("[recv data] %d (%zu) IGNORED\n", packet.header.offset, packet.header.length);
-        //fprintf(stderr, "Window not in bounds: acknum=%d.\n", packet.header.ack_num);
+    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+    // Other receivers on this host listen on the same port.
+    int reuse = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    int rcvbuf = 8 * 1024 * 1024;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    mreq.imr_multiaddr = group_addr.sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (bind(sockfd, (const struct sockaddr *)&group_addr, sizeof(group_addr)) < 0
+            || setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        close(sockfd);
+        return -1;
     }
-    // Send ack for packet sequence number "min - 1".
-    return decrement_mod(window->min_accept, TOT_WINDOWS);
+    return sockfd;
 }
 
-int recv_swp(int sockfd, short port) {
-    struct sockaddr_in sender_addr;
-    ssize_t read;
-    socklen_t sender_len;
-    SlidingWindow window;
-    bool subdir_opened, file_opened;
-    FILE *file;
+int open_recv_file(void *ctx, const char *subdir, const char *filename) {
+    struct recv_sink *sink = ctx;
+
+    printf("recv_swp: Attempting to change directory.\n");
+    if (chdir(subdir) != 0) {
+        fprintf(stderr, "Failed to change directory.\n");
+        return -1;
+    }
 
+    // A name ending in a slash is a directory tree.
+    size_t name_len = strlen(filename);
+    bool tree = name_len > 1 && filename[name_len - 1] == '/';
+    if (tree) {
+        name_len--;
+    }
 
-    create_sliding_window(&window);
-    sender_len = sizeof(sender_addr);
-
-    subdir_opened = false;
-    file_opened = false;
-    bool finish = false;
-    void *buf = calloc(1, PACKET_SIZE);
-    void *send_buf = calloc(1, PACKET_SIZE);
-    while (true) {
-        read = recvfrom(
-                sockfd, buf, PACKET_SIZE, 0,
-                (struct sockaddr *)&sender_addr, &sender_len);
-        if (read == -1) {
-            if (finish) {
-                break;
-            }
-            continue;
-        }
+    char write_filename[name_len + 6];
+    memcpy(write_filename, filename, name_len);
+    strcpy(write_filename + name_len, ".recv");
 
-        // Create packet from received data
-        Packet packet;
-        if (process_recv_data(buf, read, &packet) < 0) {
-            // TODO: This should not fail in the final result.
-            fprintf(stderr, "Failed to process packet.\n");
-            // free(buf);
-            break;
+    if (tree) {
+        printf("Directory to write to: %s\n", write_filename);
+        if (mkdir(write_filename, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Failed to create %s.\n", write_filename);
+            return -1;
         }
+        gettimeofday(&(sink->start), NULL);
+        sink->tree = tree_writer_new(write_filename);
+        return sink->tree != NULL ? 0 : -1;
+    }
+    printf("File to write to: %s\n", write_filename);
 
-        // Check packet for special cases
-        // Subdirectory
-        if (packet.header.type == FileSubdir) {
-            printf("recv_swp: Got a subdir packet.\n");
-            send_ack(sockfd, send_buf, -1, 0, sender_addr, sender_len);
-            if (subdir_opened) {
-                /* If the subdirectory has been gotten, ignore for now. */
-                continue;
-            }
-
-            subdir_opened = true;
+    sink->file = fopen(write_filename, "w");
+    if (sink->file == NULL) {
+        fprintf(stderr, "Failed to open %s.\n", write_filename);
+        return -1;
+    }
+    return 0;
+}
 
-            printf("recv_swp: Attempting to change directory.\n");
-            if (chdir(packet.data) != 0) {
-                //TODO: Fix this behavior? Fail fast
-                fprintf(stderr, "Failed to change directory.\n");
-                free(packet.data);
-                break;
-            }
-        }
+ssize_t write_swp_packet(void *ctx, const void *data, size_t len) {
+    struct recv_sink *sink = ctx;
+    if (sink->tree != NULL) {
+        gettimeofday(&(sink->last_write), NULL);
+        return tree_writer_write(sink->tree, data, len);
+    }
+    if (fwrite(data, 1, len, sink->file) != len) {
+        fprintf(stderr, "Failed to write to file.\n");
+        errno = EIO;
+        return -1;
+    }
+    return len;
+}
 
-        // Filename
-        else if (packet.header.type == Filename) {
-            if (file_opened) {
-                send_ack(sockfd, send_buf, -1, 0, sender_addr, sender_len);
-                continue;
-            } if (!subdir_opened) {
-                continue;
+// Seeks over a zero range so the file stays sparse; finish_recv_file sets
+// the final length in case the file ends in one. Trees are written out
+// instead.
+int skip_zeros(void *ctx, uint64_t len) {
+    struct recv_sink *sink = ctx;
+    if (sink->tree != NULL) {
+        static const unsigned char zeros[64 * 1024];
+        while (len > 0) {
+            size_t chunk = len < sizeof(zeros) ? len : sizeof(zeros);
+            if (tree_writer_write(sink->tree, zeros, chunk) < 0) {
+                return -1;
             }
-            char write_filename[get_data_len(packet) + 5];
-            strcpy(write_filename, (char *)packet.data);
-            strcat(write_filename, ".recv");
-            printf("File to write to: %s\n", write_filename);
-
-            file = fopen(write_filename, "w");
-            file_opened = true;
-            send_ack(sockfd, send_buf, -1, 0, sender_addr, sender_len);
+            len -= chunk;
         }
-      
-
-        // Otherwise, process packet using SWP.
-        else {
-            if (file_opened && subdir_opened) {
-                int status = process_swp_packet(&window, packet, file);
-
-                // If status = TOT_WINDOWS, we are done.
-                if (get_packet_info(window, status)->terminal == true) {
-                    Packet t_packet;
-                    send_terminal(sockfd, &t_packet, packet.header.ack_num, sender_addr, sender_len);
-                    printf("recv_swp: Sent terminal with acknum %d.\n", t_packet.header.ack_num);
-                    clear_packet(&t_packet);
-                    
-                    finish = true;
-                } else {
-                    // Send back ack.
-                    printf("recv_swp: Sending ack for sequence number %d\n", status);
-                    PacketInfo *new_pack_info = get_packet_info(window, status);
-                    printf("recv_swp: Packet has offset %d\n", new_pack_info->packet.header.offset);
-                    send_ack(sockfd, send_buf, status, 
-                            new_pack_info->packet.header.offset,
-                            sender_addr, sender_len);
-                }
-            } else {
-                // TODO: send error packet, followed by closing packet.
-                continue;
-            }
-        }
-
-        // Clear recv and send buffers
-        memset(buf, 0, PACKET_SIZE);
-        memset(send_buf, 0, PACKET_SIZE);
+        return 0;
     }
-    free(buf);
-    free(send_buf);
-    if (file != NULL) {
-        fclose(file);
+    if (fseeko(sink->file, len, SEEK_CUR) != 0) {
+        fprintf(stderr, "Failed to seek in file.\n");
+        return -1;
     }
     return 0;
 }
 
-void send_ack(int sockfd, void *send_buf, int ack_num, int offset,
-        struct sockaddr_in send_addr, socklen_t sender_len) {
-    Packet ack;
-    ack.header.length = sizeof(ack.header) + 1;
-    ack.header.offset = offset;
-    ack.header.type = Ack;
-    ack.header.ack_num = ack_num;
-    ack.data = calloc(1, 1);
-    
-    fill_send_buffer(send_buf, ack);
-    sendto(sockfd, send_buf, ack.header.length, 0,
-            (struct sockaddr*)&send_addr, sender_len);
-}
-
-int write_swp_packet(Packet packet, FILE* file) {
-    int written;
-    while (true) {
-        written = fwrite(packet.data, 1, get_data_len(packet), file);
-        if (written <= 0) {
-            continue;
-        }
-        printf("process_swp_packet: Wrote %d bytes to file.\n", written);
-        break;
+// Completes the output before the terminal is acked, so that a tree that
+// cannot be finished fails the transfer at both ends.
+int finish_recv_file(void *ctx) {
+    struct recv_sink *sink = ctx;
+    if (sink->tree != NULL) {
+        return tree_writer_finish(sink->tree);
+    }
+    if (fflush(sink->file) != 0
+            || ftruncate(fileno(sink->file), ftello(sink->file)) < 0) {
+        fprintf(stderr, "Failed to set the file length.\n");
+        return -1;
     }
     return 0;
 }
 
+int recv_swp(int *sockfds, int nsockets, int group_fd, struct recv_options opts) {
+    struct recv_sink sink;
+    memset(&sink, 0, sizeof(sink));
+
+    ChunkStore *store = NULL;
+    if (opts.cache_dir != NULL && (store = chunk_store_open(opts.cache_dir,
+                    (uint64_t)opts.cache_mb * 1024 * 1024)) == NULL) {
+        return -1;
+    }
+
+    SwpSession *session = swp_receiver_new(sockfds[0]);
+    if (session == NULL) {
+        chunk_store_close(store);
+        return -1;
+    }
+    swp_receiver_set_chunk_store(session, store);
+    if (opts.encrypt && swp_session_set_key(session, opts.key, SwpCipherAuto) < 0) {
+        fprintf(stderr, "Failed to set up encryption.\n");
+        swp_session_free(session);
+        chunk_store_close(store);
+        return -1;
+    }
+    if (group_fd >= 0) {
+        swp_receiver_set_group(session, group_fd);
+    }
+    for (int idx = 1; idx < nsockets; idx++) {
+        swp_receiver_add_socket(session, sockfds[idx]);
+    }
+    if (opts.to_stdout) {
+        // stdout carries the data, so the trace moves to stderr. A reader
+        // that falls behind blocks the window rather than this process.
+        fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) | O_NONBLOCK);
+        swp_receiver_set_fd_sink(session, STDOUT_FILENO);
+        swp_session_set_log(session, stderr);
+    } else {
+        swp_receiver_set_sink(session, open_recv_file, write_swp_packet, &sink);
+        swp_receiver_set_skip(session, skip_zeros);
+        swp_receiver_set_finish(session, finish_recv_file);
+        swp_session_set_log(session, stdout);
+    }
+    swp_receiver_set_ack_policy(session, opts.ack_every, opts.ack_delay);
+
+    int status = swp_session_run(session);
+
+    SwpStats stats;
+    swp_session_get_stats(session, &stats);
+    fprintf(opts.to_stdout ? stderr : stdout,
+            "recv_swp: %llu data packets, %llu acks (%.2f acks per packet).\n",
+            (unsigned long long)stats.data_received,
+            (unsigned long long)stats.acks_sent,
+            stats.data_received ? (double)stats.acks_sent / stats.data_received : 0.0);
+    for (int idx = 0; nsockets > 1 && idx < nsockets; idx++) {
+        SwpPathStats path_stats;
+        swp_session_path_stats(session, idx, &path_stats);
+        fprintf(opts.to_stdout ? stderr : stdout,
+                "recv_swp: Socket %d: %llu data packets.\n", idx,
+                (unsigned long long)path_stats.data_received);
+    }
+    if (group_fd >= 0) {
+        fprintf(opts.to_stdout ? stderr : stdout, "recv_swp: %llu NAKs.\n",
+                (unsigned long long)stats.naks);
+    }
+    if (opts.encrypt) {
+        fprintf(opts.to_stdout ? stderr : stdout,
+                "recv_swp: Sealed with %s; %llu datagrams rejected.\n",
+                swp_session_cipher(session), (unsigned long long)stats.auth_failures);
+    }
+    if (stats.dedup_chunks > 0) {
+        fprintf(opts.to_stdout ? stderr : stdout,
+                "recv_swp: %llu of %llu chunks (%.1f%%) from the cache, %llu bytes; "
+                "%llu evicted.\n",
+                (unsigned long long)stats.dedup_hits,
+                (unsigned long long)stats.dedup_chunks,
+                100.0 * stats.dedup_hits / stats.dedup_chunks,
+                (unsigned long long)stats.dedup_bytes,
+                (unsigned long long)stats.cache_evictions);
+    }
+    swp_session_free(session);
+    chunk_store_close(store);
+
+    if (sink.file != NULL) {
+        fclose(sink.file);
+    }
+    if (sink.tree != NULL) {
+        TreeStats tree_stats;
+        tree_writer_get_stats(sink.tree, &tree_stats);
+        // Up to the last write, not the end of the linger.
+        double secs = (sink.last_write.tv_sec - sink.start.tv_sec)
+            + (sink.last_write.tv_usec - sink.start.tv_usec) / 1e6;
+        printf("recv_swp: %llu files, %llu directories, %llu links, %llu bytes "
+                "in %.3f s (%.0f files/s).\n",
+                (unsigned long long)tree_stats.files,
+                (unsigned long long)tree_stats.dirs,
+                (unsigned long long)tree_stats.links,
+                (unsigned long long)tree_stats.bytes,
+                secs, secs > 0 ? tree_stats.files / secs : 0.0);
+        tree_writer_free(sink.tree);
+    }
+    return status == SWP_DONE ? 0 : -1;
+}
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reliable_file.h"
+
+int modulo(int n, int mod) {
+    while (n > mod) {
+        n -= mod;
+    }
+    while (n < 0) {
+        n += mod;
+    }
+    if (n == mod) {
+        return 0;
+    }
+    return n;
+}
+
+int increment_mod(int n, int mod) {
+    n ++;
+    return modulo(n, mod);
+}
+
+int decrement_mod(int n, int mod) {
+    n --;
+    return modulo(n, mod);
+}
+
+bool in_range(int n, int lo, int hi, int mod) {
+    if (n < 0 || n >= mod) {
+        return false;
+    }
+    if (lo <= hi) {
+        return n >= lo && n <= hi;
+    }
+    return n >= lo || n <= hi;
+}
+
+void clear_packet(Packet *packet) {
+    free(packet->data);
+    memset(packet, 0, sizeof(*packet));
+}
+
+size_t get_data_len(Packet packet) {
+    return packet.header.length - sizeof(packet.header);
+}
+
+PacketInfo* get_packet_info(
+        SlidingWindow window, int index) {
+    // Bounds checking
+    if (index < 0 || index >= window.total) {
+        return NULL;
+    }
+
+    return (PacketInfo *)(window.packets + index);
+}
+
+int fill_packet_info(PacketInfo *packet_info, bool terminal) {
+    packet_info->terminal = terminal;
+    packet_info->ready = true;
+    packet_info->ack = false;
+    return 0;
+}
+
+int clear_packet_info(PacketInfo *packet_info) {
+    // The data buffer belongs to the window, so only the header is reset.
+    memset(&(packet_info->packet.header), 0, sizeof(packet_info->packet.header));
+    packet_info->ready = false;
+    packet_info->ack = false;
+    packet_info->terminal = false;
+    return 0;
+}
+
+int create_sliding_window(SlidingWindow *window, int size) {
+    memset(window, 0, sizeof(*window));
+    PacketInfo *packet_info_ptr;
+    packet_info_ptr = calloc(2*size, sizeof(PacketInfo));
+    if (packet_info_ptr == NULL) {
+        return -1;
+    }
+
+    window->packets = packet_info_ptr;
+    window->size = size;
+    window->total = 2*size;
+    int idx;
+    for (idx = 0; idx < window->total; idx++) {
+        PacketInfo *curr_pack;
+        if ((curr_pack = get_packet_info(*window, idx)) != NULL) {
+            curr_pack->ready = false;
+            curr_pack->ack = false;
+            timer_node_init(&(curr_pack->timer));
+            // Every slot owns one datagram-sized buffer for its lifetime.
+            curr_pack->packet.data = calloc(1, PACKET_SIZE);
+            if (curr_pack->packet.data == NULL) {
+                free_sliding_window(window);
+                return -1;
+            }
+        }
+    }
+
+    window->min_accept = 0;
+    window->max_accept = size - 1;
+    window->timeout_set = false;
+    return 0;
+}
+
+void free_sliding_window(SlidingWindow *window) {
+    if (window->packets == NULL) {
+        return;
+    }
+    int idx;
+    for (idx = 0; idx < window->total; idx++) {
+        clear_packet(&(get_packet_info(*window, idx)->packet));
+    }
+    free(window->packets);
+    window->packets = NULL;
+}
+
+void shift_window(SlidingWindow *window) {
+    window->min_accept = increment_mod(window->min_accept, window->total);
+    window->max_accept = increment_mod(window->max_accept, window->total);
+    fill_packet_info(get_packet_info(*window, window->max_accept), false);
+}
+
+int process_recv_data(void *data, size_t data_len, Packet *packet, Aead *aead) {
+
+    // Forgeries and replays go without a word: printing each would hand
+    // whoever sends them a way to flood the log.
+    if (aead != NULL) {
+        ssize_t text_len = aead_open(aead, data, data_len);
+        if (text_len < 0) {
+            return -1;
+        }
+        data = (unsigned char *)data + AEAD_ENVELOPE_SIZE;
+        data_len = text_len;
+    }
+
+    size_t head_len = sizeof(packet->header);
+    if (data_len <= head_len) {
+        fprintf(stderr, "process_recv_data: Failed to process data.\n");
+        return -1;
+    }
+
+    // Fill in Packet header and data
+    memcpy(&(packet->header), data, head_len);
+    if (packet->header.length != data_len) {
+        fprintf(stderr, "process_recv_data: Length mismatch.\n");
+        return -1;
+    }
+    // Window slots hold a packet's payload and no more.
+    if (packet->header.length > PACKET_SIZE) {
+        fprintf(stderr, "process_recv_data: Packet too long.\n");
+        return -1;
+    }
+
+    // Point at the payload in place rather than copying it out.
+    packet->data = (unsigned char *)data + head_len;
+
+    return 0;
+}
+
+ssize_t fill_send_buffer(void *buf, Packet packet, Aead *aead) {
+    unsigned char *ptr = buf;
+    if (aead != NULL) {
+        ptr += AEAD_ENVELOPE_SIZE;
+    }
+
+    // Copy header
+    memcpy(ptr, &(packet.header), sizeof(packet.header));
+    ptr += sizeof(packet.header);
+
+    // Copy data
+    memcpy(ptr, packet.data, get_data_len(packet));
+
+    if (aead != NULL) {
+        return aead_seal(aead, buf, packet.header.length);
+    }
+    return packet.header.length;
+}
+
+bool in_bounds(SlidingWindow window, int16_t ack_num) {
+    if (ack_num < 0 || ack_num >= window.total) {
+        return false;
+    }
+    if (window.min_accept < window.max_accept) {
+        if (ack_num >= window.min_accept && ack_num <= window.max_accept) {
+            return true;
+        }
+        return false;
+    } else {
+        if (!(ack_num < window.min_accept && ack_num > window.max_accept)) {
+            return true;
+        }
+        return false;
+    }
+}
@@ -1,8 +1,10 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -11,7 +13,9 @@
 #include <time.h>
 #include <unistd.h>
 
-#include "reliable_file.h"
+#include "aead.h"
+#include "swp.h"
+#include "tree.h"
 
 struct recv_dest {
     char *hostname;
@@ -23,52 +27,69 @@ struct file_path {
     char *filename;
 };
 
-int open_send(char *hostname, short port, struct sockaddr_in *recv_addr); 
+struct send_options {
+    bool stream;    // Read the data from stdin instead of the named file.
+    int dupacks;    // Fast retransmit threshold, -1 for the default.
+    int window;     // Packets in flight at most, 0 for the default.
+    bool tree;      // Send the named directory and everything under it.
+    bool dedup;     // Send only chunks the receiver does not have.
+    int receivers;  // Multicast to this many receivers, 0 for unicast.
+    enum SwpSlowPolicy slow_policy;
+    bool encrypt;   // Seal every datagram with key.
+    unsigned char key[AEAD_KEY_SIZE];
+};
+
+int open_send(char *hostname, short port, char *local, struct sockaddr_in *recv_addr); 
 
 int parse_dir(char *optarg, struct file_path *path);
 
 int parse_receiver(char *optarg, struct recv_dest *dest);
 
-int send_swp(int sockfd, struct file_path path,
-        struct sockaddr_in recv_addr, socklen_t recv_addr_len);
-
-int send_metadata(int sockfd, enum PacketType type, char *data,
-        struct sockaddr_in recv_addr, socklen_t recv_addr_len);
+int send_swp(int *sockfds, struct sockaddr_in *recv_addrs, int npaths,
+        struct file_path path, struct send_options opts);
 
 int main(int argc, char **argv) {
-    char *usage_str = "sendfile -r <recv_host>:<recv_port> -f <subdir>/<filename>";
-
-    // Send error if aguments not formatted properly
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s\n", usage_str);
-        exit(1);
-    }
+    char *usage_str = "sendfile -r <recv_host>:<recv_port> [-r ...] [-b <local_addr> ...] -f <subdir>/<filename> [-s | -R] [-t <dupacks>] [-w <window>] [-D | -m <receivers> [-S wait|drop]] [-k <keyfile>]";
 
-    // Create structs for the command line args.
-    struct recv_dest dest; 
+    // Create structs for the command line args. Each -r, and each -b, is
+    // one more path to stripe the transfer over.
+    struct recv_dest dests[SWP_MAX_PATHS];
+    char *locals[SWP_MAX_PATHS];
+    int ndests = 0, nlocals = 0;
     struct file_path file;
+    struct send_options opts;
 
-    memset(&dest, 0, sizeof(dest));
+    memset(dests, 0, sizeof(dests));
     memset(&file, 0, sizeof(file));
+    memset(&opts, 0, sizeof(opts));
+    opts.dupacks = -1;
 
     // Set boolean flags for if certain coptions have been seen
-    bool r_option, f_option, abort_f = false;
+    bool f_option = false, abort_f = false;
 
     // Process command line arguments
     int opt;
-    while ((opt = getopt(argc, argv, "r:f:")) != -1) {
+    while ((opt = getopt(argc, argv, "r:b:f:sRt:w:Dm:S:k:")) != -1) {
         switch (opt) {
-            case 'r': // Get -r option.
+            case 'r': // Get -r option, once per receiver address.
 
-                if (r_option) {
-                    // Fail if -r option shows twice
-                    fprintf(stderr, "Option -r already shown.\n");
+                if (ndests == SWP_MAX_PATHS) {
+                    fprintf(stderr, "At most %d paths.\n", SWP_MAX_PATHS);
                     abort_f = true;
-                } else if (parse_receiver(optarg, &dest) < 0) {
+                } else if (parse_receiver(optarg, &dests[ndests]) < 0) {
                     // Fail if the option argument is malformed.
                     abort_f = true;
+                } else {
+                    ndests++;
+                }
+                break;
+            case 'b': // Local address to send from, once per path.
+                if (nlocals == SWP_MAX_PATHS) {
+                    fprintf(stderr, "At most %d paths.\n", SWP_MAX_PATHS);
+                    abort_f = true;
+                } else {
+                    locals[nlocals++] = optarg;
                 }
-                r_option = true;
                 break;
             case 'f': // Get -f option
 
@@ -82,234 +103,266 @@ int main(int argc, char **argv) {
                 }
                 f_option = true;
                 break;
+            case 's': // Stream stdin under the -f name.
+                opts.stream = true;
+                break;
+            case 'R': // Send a directory tree.
+                opts.tree = true;
+                break;
+            case 'D': // Deduplicate against the receiver's chunk store.
+                opts.dedup = true;
+                break;
+            case 'm': // Multicast to -r, a group address.
+                if ((opts.receivers = atoi(optarg)) < 1) {
+                    fprintf(stderr, "Option -m requires a number of receivers.\n");
+                    abort_f = true;
+                }
+                break;
+            case 'S': // What to do about a receiver that falls behind.
+                if (strcmp(optarg, "wait") == 0) {
+                    opts.slow_policy = SwpSlowWait;
+                } else if (strcmp(optarg, "drop") == 0) {
+                    opts.slow_policy = SwpSlowDrop;
+                } else {
+                    fprintf(stderr, "Option -S takes wait or drop.\n");
+                    abort_f = true;
+                }
+                break;
+            case 'k': // Pre-shared key. Read now, before -f changes directory.
+                if (aead_load_key(optarg, opts.key) < 0) {
+                    abort_f = true;
+                }
+                opts.encrypt = true;
+                break;
+            case 't': // Duplicate acks before a fast retransmit.
+                if ((opts.dupacks = atoi(optarg)) < 0) {
+                    fprintf(stderr, "Option -t requires a non-negative count.\n");
+                    abort_f = true;
+                }
+                break;
+            case 'w': // Window size in packets.
+                if ((opts.window = atoi(optarg)) < 1) {
+                    fprintf(stderr, "Option -w requires a positive size.\n");
+                    abort_f = true;
+                }
+                break;
             case '?':
-                if (optopt == 'r' || optopt == 'f') {
-                    fprintf(stderr, "Option -%c requires a port number.\n", optopt);
+                if (optopt == 'r' || optopt == 'b' || optopt == 'f'
+                        || optopt == 't' || optopt == 'w' || optopt == 'm'
+                        || optopt == 'S' || optopt == 'k') {
+                    fprintf(stderr, "Option -%c requires an argument.\n", optopt);
                 } else {
-                    fprintf(stderr, "Unknown flag %c.\nUsage: recvfile -p <recv_port>\n", opt);
+                    fprintf(stderr, "Unknown flag %c.\n", optopt);
                 }
             default:
                 abort_f = true;
         }
     }
 
-    if (abort_f) {
-        exit(1);
+    // Send error if aguments not formatted properly
+    if (opts.stream && opts.tree) {
+        fprintf(stderr, "Options -s and -R cannot be combined.\n");
+        abort_f = true;
     }
-
-    int sockfd;
-    struct sockaddr_in recv_addr;
-    if ((sockfd = open_send(dest.hostname, dest.port, &recv_addr)) < 0) {
-        fprintf(stderr, "Failed to open send.\n");
+    if (opts.dedup && opts.receivers > 0) {
+        fprintf(stderr, "Options -D and -m cannot be combined.\n");
+        abort_f = true;
+    }
+    // A single -r is reached from every -b, and a single -b sends to every
+    // -r; otherwise they pair up in order.
+    int npaths = ndests > nlocals ? ndests : nlocals;
+    if (ndests > 1 && nlocals > 1 && ndests != nlocals) {
+        fprintf(stderr, "Options -r and -b must pair up, or one of them be given once.\n");
+        abort_f = true;
+    }
+    if (npaths > 1 && opts.receivers > 0) {
+        fprintf(stderr, "Multicast takes a single -r and -b.\n");
+        abort_f = true;
+    }
+    if (abort_f || ndests == 0 || !f_option || optind != argc) {
+        fprintf(stderr, "Usage: %s\n", usage_str);
         exit(1);
     }
 
-    // Start program
-    int recv_addr_len = sizeof(recv_addr);
-    send_swp(sockfd, file, recv_addr, recv_addr_len);
-
-    // Close socket before return.
-    close(sockfd);
-    return 0;
-}
-
-int send_packet(int sockfd, PacketInfo *pack_info, void *send_buf,
-        struct sockaddr_in recv_addr, socklen_t recv_len) {
-    fill_send_buffer(send_buf, pack_info->packet);
-    
-    printf("[send data] %zu (%d) %d\n", pack_info->packet.header.length, 
-            pack_info->packet.header.offset, pack_info->packet.header.ack_num);
-
-    int sent;
-    while((sent = sendto(sockfd, send_buf, pack_info->packet.header.length,
-                    0, (struct sockaddr *)&(recv_addr), recv_len)) == -1) {
-        continue;
+    int sockfds[SWP_MAX_PATHS];
+    struct sockaddr_in recv_addrs[SWP_MAX_PATHS];
+    for (int idx = 0; idx < npaths; idx++) {
+        struct recv_dest *dest = &dests[ndests > 1 ? idx : 0];
+        char *local = nlocals == 0 ? NULL : locals[nlocals > 1 ? idx : 0];
+        if ((sockfds[idx] = open_send(dest->hostname, dest->port, local,
+                        &recv_addrs[idx])) < 0) {
+            fprintf(stderr, "Failed to open send.\n");
+            exit(1);
+        }
     }
-    return sent;
-}
 
-int craft_packet(void *data, enum PacketType type, int16_t ack_num, FILE *file, Packet *packet) {
-    Header *head = &(packet->header);
-    head->offset = ftell(file);
+    // Start program
+    int status = send_swp(sockfds, recv_addrs, npaths, file, opts);
 
-    // Read in data
-    //printf("craft_packet: Reading in data.\n");
-    int read = fread(data, 1, PACKET_SIZE - sizeof(*head), file);
-    if (read == -1) {
-        return -1;
+    // Close sockets before return.
+    for (int idx = 0; idx < npaths; idx++) {
+        close(sockfds[idx]);
     }
-    //printf("craft_packet: Read %d bytes of data.\n", read);
-
-    //printf("craft_packet: Assigning header fields.\n");
-    // Assign header fields
-    head->length = sizeof(*head) + read;
-    head->type = type;
-    head->ack_num = ack_num;
-
-    // Add data
-    //printf("craft_packet: setting data pointer\n");
-    packet->data = data;
-
-    return read;
+    return status == 0 ? 0 : 1;
 }
 
-int send_swp(int sockfd, struct file_path path, 
-        struct sockaddr_in recv_addr, socklen_t recv_addr_len) {
-    FILE *file;
-
-    // Attempt to change working directory to subdir
-    if (chdir(path.subdir) != 0) {
-        fprintf(stderr, "Failed to open directory.\n");
-        return -1;
-    }
-    // Open the file to be sent
-    file = fopen(path.filename, "r");
-    if (file == NULL) {
-        fprintf(stderr, "File does not exist.\n");
-        return -1;
-    }
-
-    // Create sliding window
-    SlidingWindow window;
-    create_sliding_window(&window);
-
-    // Create initial messages sending the subdir and name of the file
-    send_metadata(sockfd, FileSubdir, path.subdir, recv_addr, recv_addr_len);
-    send_metadata(sockfd, Filename, path.filename, recv_addr, recv_addr_len);
-    printf("send_swp: Metadata received and acknowledged.\n");
-
-    void *buf = calloc(1, PACKET_SIZE + 1);
-    void *recv_buf = calloc(1, PACKET_SIZE);
-
-    // Create timeval struct for retransmission time.
-    struct timeval timeout_elapse;
-    timerclear(&timeout_elapse);
-    timeout_elapse.tv_usec = TIMEOUT_US;
-
-    int curr_acknum = -1;
-    bool ready = true;
-    bool final = false;
-    bool done = false;
-    while (true) {
-        // Check for min_accept packet.
-        if (!ready || final) {
-            // Get time now.
-            struct timeval timenow;
-            gettimeofday(&timenow, NULL);
-            // Set timout if not set
-            if (!window.timeout_set) {
-                timeradd(&timenow, &timeout_elapse, &(window.timeout));
-                window.timeout_set = true;
-            }
-            // If timeout is set, check for if RTT has been met.
-            else if (timercmp(&timenow, &(window.timeout), >=)) {
-                //printf("send_swp: Timeout hit. Will resend packet %d\n", window.min_accept);
-                send_packet(sockfd, get_packet_info(window, window.min_accept),
-                        buf, recv_addr, recv_addr_len);
-                window.timeout_set = false;
-                timerclear(&(window.timeout));
-            }
-            ssize_t get_data = recvfrom(sockfd, recv_buf, PACKET_SIZE,
-                    MSG_DONTWAIT, (struct sockaddr *)&recv_addr, &recv_addr_len);
-            Packet ack;
-            int processed_data;
-            if (get_data != -1) {
-                processed_data = process_recv_data(recv_buf, get_data, &ack);
-            } else {
-                continue;
-            }
-
-            if (processed_data == 0) {
-                // Check if ack packet received.
-                //printf("send_swp: Received packet with ack_num %d\n", ack.header.ack_num);
-                int ack_num = ack.header.ack_num;
-                PacketInfo *pack_info = get_packet_info(window, ack.header.ack_num);
-                if (pack_info == NULL) {
-                    continue;
-                }
-                if (in_bounds(window, ack_num)) {
-                    // Verify the validity of the ack packet; could be a packet
-                    // from a previous sliding window cycle that was
-                    // duplicated, reordered or delayed.
-                    if (ack.header.offset != pack_info->packet.header.offset) {
-                        printf("Received ack for acknum %d\n", ack.header.ack_num);
-                        printf("Sequence number mismatch: expected %d, but received %d.\n",
-                                pack_info->packet.header.offset, ack.header.offset);
-                        continue;
-                    }
-                    pack_info->ack = true;
-                } else { // Ignore packet because it was out of range.
-                    continue;
-                }
-            } else {
-                fprintf(stderr, "Failed to process acknowledgement data\n");
-            }
-            // Here, we need to shift the window until we reach a packet that
-            // has not been acknowledged.
-            while (window.min_accept != increment_mod(ack.header.ack_num, TOT_WINDOWS)) {
-                PacketInfo *check_pack_info = get_packet_info(window, window.min_accept);
-                if (check_pack_info->terminal == true) {
-                    done = true;
-                    break;
-                }
-                shift_window(&window);
-            }
-            if (done) {
-                break;
-            }
-
-            // Clear timeout and set ready to true to begin sending again
-            window.timeout_set = false;
-            timerclear(&(window.timeout));
-            ready = true;
-        } 
-
-        if (final) {
-            continue;
+int send_swp(int *sockfds, struct sockaddr_in *recv_addrs, int npaths,
+        struct file_path path, struct send_options opts) {
+    FILE *file = NULL;
+    TreeReader *tree = NULL;
+    SwpSession *session = NULL;
+    int status = SWP_ERROR;
+    char *filename = path.filename;
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    if (opts.tree) {
+        if (chdir(path.subdir) != 0) {
+            fprintf(stderr, "Failed to open directory.\n");
+            goto out;
         }
-
-        curr_acknum = increment_mod(curr_acknum, TOT_WINDOWS);
-        //printf("send_swp: Current ack num: %d\n", curr_acknum);
-
-        // Set ready flag to false if we hit max_accept
-        if (curr_acknum == window.max_accept) {
-            printf("We have hit the maximum ack number.\n");
-            ready = false;
+        if ((tree = tree_reader_new(path.filename)) == NULL) {
+            goto out;
         }
-
-        PacketInfo *curr_pack_info = get_packet_info(window, curr_acknum);
-
-        // If end of file, send terminal packet.
-        if (feof(file)) {
-            printf("send_swp: End of file...\n");
-            final = true;
-            ready = false;
-            curr_pack_info->terminal = true;
-            send_terminal(sockfd, &(curr_pack_info->packet), curr_acknum, recv_addr, recv_addr_len);
-            //printf("send_swp: Sent terminal message with acknum %d.\n", curr_acknum);
-            continue;
+        // A trailing slash tells the receiver to expect a tree.
+        filename = calloc(1, strlen(path.filename) + 2);
+        strcpy(filename, path.filename);
+        strcat(filename, "/");
+    } else if (!opts.stream) {
+        // Attempt to change working directory to subdir
+        if (chdir(path.subdir) != 0) {
+            fprintf(stderr, "Failed to open directory.\n");
+            goto out;
+        }
+        // Open the file to be sent
+        file = fopen(path.filename, "r");
+        if (file == NULL) {
+            fprintf(stderr, "File does not exist.\n");
+            goto out;
         }
-
-        size_t packet_data_len = PACKET_SIZE - sizeof(curr_pack_info->packet.header);
-        void *packet_data = calloc(1, packet_data_len);
-
-        // Construct and send the packet
-        craft_packet(packet_data, Data, curr_acknum, file, &(curr_pack_info->packet));
-        send_packet(sockfd, curr_pack_info, buf, recv_addr, recv_addr_len);
-
-        //printf("send_swp: Sent packet with ack num %d\n", curr_pack_info->packet.header.ack_num);
     }
 
-    free(buf);
+    // Create the session; it sends the subdir and name of the file first.
+    session = swp_sender_new(sockfds[0], &recv_addrs[0], path.subdir, filename);
+    if (filename != path.filename) {
+        free(filename);
+    }
+    if (session == NULL) {
+        goto out;
+    }
+    struct stat st;
+    int source_status = 0;
+    if (tree != NULL) {
+        swp_sender_set_reader(session, tree_reader_read, tree);
+    } else if (opts.stream && (fstat(STDIN_FILENO, &st) < 0 || !S_ISREG(st.st_mode))) {
+        // Non-blocking, so acks keep flowing while the producer is quiet.
+        fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+        swp_sender_set_fd_reader(session, STDIN_FILENO);
+    } else {
+        // Regular files, redirected stdin included, skip holes and zeros.
+        source_status = swp_sender_set_file(session,
+                file != NULL ? fileno(file) : STDIN_FILENO);
+    }
+    if (source_status < 0) {
+        fprintf(stderr, "Failed to read file.\n");
+        goto out;
+    }
+    if (opts.window > 0 && swp_sender_set_window(session, opts.window) < 0) {
+        fprintf(stderr, "Window must be between 1 and 16383 packets.\n");
+        goto out;
+    }
+    if (opts.dupacks >= 0) {
+        swp_sender_set_dupack_threshold(session, opts.dupacks);
+    }
+    for (int idx = 1; idx < npaths; idx++) {
+        swp_sender_add_path(session, sockfds[idx], &recv_addrs[idx]);
+    }
+    if (opts.receivers > 0
+            && swp_sender_set_multicast(session, opts.receivers, opts.slow_policy) < 0) {
+        fprintf(stderr, "Multicast takes between 1 and 1024 receivers.\n");
+        goto out;
+    }
+    if (opts.encrypt && swp_session_set_key(session, opts.key, SwpCipherAuto) < 0) {
+        fprintf(stderr, "Failed to set up encryption.\n");
+        goto out;
+    }
+    if (opts.dedup && swp_sender_set_dedup(session) < 0) {
+        fprintf(stderr, "Failed to set up deduplication.\n");
+        goto out;
+    }
+    swp_session_set_log(session, stdout);
+
+    status = swp_session_run(session);
+
+    SwpStats stats;
+    swp_session_get_stats(session, &stats);
+    printf("send_swp: %llu data packets (%llu retransmitted, %llu fast), %llu acks.\n",
+            (unsigned long long)stats.data_sent,
+            (unsigned long long)stats.retransmits,
+            (unsigned long long)stats.fast_retransmits,
+            (unsigned long long)stats.acks_received);
+    if (stats.zero_bytes > 0) {
+        printf("send_swp: %llu of %llu bytes sent as zero ranges.\n",
+                (unsigned long long)stats.zero_bytes,
+                (unsigned long long)stats.bytes);
+    }
+    if (opts.receivers > 0) {
+        printf("send_swp: %d receivers, %llu dropped; %llu NAKs.\n", opts.receivers,
+                (unsigned long long)stats.receivers_dropped,
+                (unsigned long long)stats.naks);
+    }
+    for (int idx = 0; npaths > 1 && idx < npaths; idx++) {
+        SwpPathStats path_stats;
+        swp_session_path_stats(session, idx, &path_stats);
+        printf("send_swp: Path %d to %s:%d: %llu packets (%llu retransmitted), "
+                "%llu acked, window %d, rtt %.2f ms.\n", idx,
+                inet_ntoa(recv_addrs[idx].sin_addr), ntohs(recv_addrs[idx].sin_port),
+                (unsigned long long)path_stats.data_sent,
+                (unsigned long long)path_stats.retransmits,
+                (unsigned long long)path_stats.delivered,
+                path_stats.cwnd, path_stats.srtt_us / 1e3);
+    }
+    if (opts.encrypt) {
+        printf("send_swp: Sealed with %s; %llu datagrams rejected.\n",
+                swp_session_cipher(session), (unsigned long long)stats.auth_failures);
+    }
+    if (stats.dedup_chunks > 0) {
+        printf("send_swp: %llu of %llu chunks (%.1f%%) already at the receiver, "
+                "%llu bytes not sent.\n",
+                (unsigned long long)stats.dedup_hits,
+                (unsigned long long)stats.dedup_chunks,
+                100.0 * stats.dedup_hits / stats.dedup_chunks,
+                (unsigned long long)stats.dedup_bytes);
+    }
 
-    printf("Closing file...\n");
-    fclose(file);
-    printf("Successfully closed file.\n");
-    return 0;
+    if (tree != NULL) {
+        TreeStats tree_stats;
+        tree_reader_get_stats(tree, &tree_stats);
+        gettimeofday(&end, NULL);
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+        printf("send_swp: %llu files, %llu directories, %llu links, %llu bytes "
+                "in %.3f s (%.0f files/s).\n",
+                (unsigned long long)tree_stats.files,
+                (unsigned long long)tree_stats.dirs,
+                (unsigned long long)tree_stats.links,
+                (unsigned long long)tree_stats.bytes,
+                secs, secs > 0 ? tree_stats.files / secs : 0.0);
+    }
 
+out:
+    swp_session_free(session);
+    tree_reader_free(tree);
+    if (file != NULL) {
+        printf("Closing file...\n");
+        fclose(file);
+        printf("Successfully closed file.\n");
+    }
+    return status == SWP_DONE ? 0 : -1;
 }
 
-int open_send(char *hostname, short port, struct sockaddr_in *recv_addr) {
+// Opens a socket to hostname:port, bound to the local address if one is
+// given so that its datagrams leave through that interface.
+int open_send(char *hostname, short port, char *local, struct sockaddr_in *recv_addr) {
     struct addrinfo *ai;
     int sockfd;
 
@@ -334,6 +387,22 @@ int open_send(char *hostname, short port, struct sockaddr_in *recv_addr) {
     memset(recv_addr, 0, sizeof(*recv_addr));
     memcpy(recv_addr, ai->ai_addr, sizeof(*recv_addr));
     recv_addr->sin_port = htons(port);
+    freeaddrinfo(ai);
+
+    if (local != NULL) {
+        if ((code = getaddrinfo(local, NULL, &hints, &ai)) != 0) {
+            fprintf(stderr, "%s: %s\n", local, gai_strerror(code));
+            close(sockfd);
+            return -1;
+        }
+        code = bind(sockfd, ai->ai_addr, ai->ai_addrlen);
+        freeaddrinfo(ai);
+        if (code < 0) {
+            perror(local);
+            close(sockfd);
+            return -1;
+        }
+    }
 
     // connect(sockfd, (const struct sockaddr *) &recv_addr, sizeof(recv_addr));
 
@@ -366,7 +435,7 @@ int parse_receiver(char *optarg, struct recv_dest* dest) {
 }
 
 int parse_dir(char *optarg, struct file_path* file) {
-    char *last_slash;
+    char *last_slash = NULL;
     char *slash = optarg;
 
     // Get location of final slash in string.
@@ -394,77 +463,3 @@ int parse_dir(char *optarg, struct file_path* file) {
 
     return 0;
 }
-
-int send_metadata(int sockfd, enum PacketType type, char *data,
-        struct sockaddr_in recv_addr, socklen_t recv_addr_len) {
-    Packet packet;
-    int data_len = strlen(data) + 1;
-
-    // Fill header length field.
-    packet.header.length = sizeof(packet.header) + data_len;
-    void *buf = calloc(1, packet.header.length);
-    void *recv_buf = calloc(1, PACKET_SIZE);
-
-    // Fill in header data
-    packet.header.offset = 0;
-    packet.header.type = type;
-    packet.header.ack_num = 0;
-
-    // Fill in packet data
-    void *packet_data;
-    packet_data = calloc(1, data_len);
-    memcpy(packet_data, data, data_len);
-
-    packet.data = packet_data;
-    fill_send_buffer(buf, packet);
-
-    // Set elapsed timeout value.
-    struct timeval timeout_elapse;
-    timerclear(&timeout_elapse);
-    timeout_elapse.tv_usec = TIMEOUT_US;
-
-    int bytes, code;
-    struct timeval timenow;
-    struct timeval timeout;
-    bool timeout_set = false;
-    // Send data
-    while (true) {
-        struct sockaddr r_addr;
-        socklen_t r_addr_len;
-
-        // Set current time
-        gettimeofday(&timenow, 0);
-        if(!timeout_set) {
-            timeradd(&timenow, &timeout_elapse, &timeout);
-            timeout_set = true;
-        } else if (timercmp(&timenow, &timeout, <)) { // Attempt a receive.
-            bytes = recvfrom(sockfd, recv_buf, PACKET_SIZE, MSG_DONTWAIT,
-                    (struct sockaddr*)&r_addr, &r_addr_len);
-            if (bytes == -1) {
-                continue;
-            }
-
-            Packet recv_packet;
-            code = process_recv_data(recv_buf, bytes, &recv_packet);
-            break;
-        } else {
-            timeout_set = false;
-        }
-        // Perform send or resend.
-        while(sendto(sockfd, buf, packet.header.length, 0,
-                    (struct sockaddr*)&recv_addr, recv_addr_len) == -1) {
-            continue;
-        }
-        printf("send_metadata: Sent data to receiver.\n");
-
-    }
-    free(recv_buf);
-    free(buf);
-    if (code == -1) {
-        fprintf(stderr, "Unable to process acknowledgement of data.\n");
-        return -1;
-    }
-    return 0;
-}
-
-
@@ -0,0 +1,192 @@
+// SEEK_DATA and SEEK_HOLE
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sparse.h"
+
+// Read-ahead for scanning allocated blocks.
+#define SPARSE_BUF_SIZE (256 * 1024)
+
+// Compared against in page-sized steps; memcmp is vectorized in libc.
+#define ZERO_PAGE_SIZE 4096
+static const unsigned char zero_page[ZERO_PAGE_SIZE];
+
+struct SparseReader {
+    int fd;
+    off_t size;             // At open; a file that shrinks ends early.
+    off_t pos;              // Next offset to hand out.
+    off_t data_end;         // End of the data region holding pos.
+    unsigned char *buf;     // Holds [buf_off, buf_off + buf_len).
+    off_t buf_off;
+    size_t buf_len;
+};
+
+size_t zero_prefix(const void *buf, size_t len) {
+    const unsigned char *ptr = buf;
+    size_t pos = 0;
+
+    while (len - pos >= ZERO_PAGE_SIZE && memcmp(ptr + pos, zero_page, ZERO_PAGE_SIZE) == 0) {
+        pos += ZERO_PAGE_SIZE;
+    }
+    // Narrow down within the last page a word at a time.
+    while (len - pos >= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, ptr + pos, sizeof(word));
+        if (word != 0) {
+            break;
+        }
+        pos += sizeof(word);
+    }
+    while (pos < len && ptr[pos] == 0) {
+        pos++;
+    }
+    return pos;
+}
+
+SparseReader *sparse_reader_new(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("sparse_reader_new");
+        return NULL;
+    }
+
+    SparseReader *reader = calloc(1, sizeof(*reader));
+    if (reader == NULL) {
+        return NULL;
+    }
+    reader->buf = malloc(SPARSE_BUF_SIZE);
+    if (reader->buf == NULL) {
+        free(reader);
+        return NULL;
+    }
+    reader->fd = fd;
+    reader->size = st.st_size;
+    reader->pos = 0;
+    reader->data_end = 0;
+    return reader;
+}
+
+// Finds the data region at or after pos. Returns the hole in front of it,
+// which may be empty. Filesystems without SEEK_DATA look like one region.
+static off_t skip_hole(SparseReader *reader) {
+    off_t data = lseek(reader->fd, reader->pos, SEEK_DATA);
+    if (data < 0) {
+        if (errno != ENXIO) {
+            reader->data_end = reader->size;
+            return 0;
+        }
+        // Nothing but hole up to the end of the file.
+        data = reader->size;
+    }
+    if (data > reader->size) {
+        data = reader->size;
+    }
+
+    off_t hole = data < reader->size ? lseek(reader->fd, data, SEEK_HOLE) : reader->size;
+    if (hole < 0 || hole > reader->size) {
+        hole = reader->size;
+    }
+    reader->data_end = hole;
+    return data - reader->pos;
+}
+
+// Makes sure at least min bytes at pos are buffered, or all that is left of
+// the data region. Returns the number of bytes available.
+static ssize_t fill(SparseReader *reader, size_t min) {
+    off_t avail = reader->buf_off + (off_t)reader->buf_len - reader->pos;
+    off_t left = reader->data_end - reader->pos;
+    if (reader->pos >= reader->buf_off && avail >= (off_t)min) {
+        return avail;
+    }
+    if (reader->pos >= reader->buf_off && avail >= left && avail > 0) {
+        return avail;
+    }
+
+    size_t want = left < SPARSE_BUF_SIZE ? left : SPARSE_BUF_SIZE;
+    ssize_t read;
+    while ((read = pread(reader->fd, reader->buf, want, reader->pos)) < 0 && errno == EINTR) {
+        continue;
+    }
+    if (read < 0) {
+        perror("sparse_reader_read: Failed to read file");
+        return -1;
+    }
+    reader->buf_off = reader->pos;
+    reader->buf_len = read;
+    if (read == 0) {
+        // The file shrank since we measured it.
+        reader->size = reader->pos;
+        reader->data_end = reader->pos;
+    }
+    return read;
+}
+
+ssize_t sparse_reader_read(SparseReader *reader, void *buf, size_t len,
+        uint64_t *zeros) {
+    *zeros = 0;
+    if (reader->pos >= reader->size) {
+        return 0;
+    }
+
+    if (reader->pos >= reader->data_end) {
+        off_t hole = skip_hole(reader);
+        if (hole > 0) {
+            reader->pos += hole;
+            *zeros = hole;
+            return 0;
+        }
+        if (reader->pos >= reader->size) {
+            return 0;
+        }
+    }
+
+    ssize_t avail = fill(reader, len);
+    if (avail <= 0) {
+        return avail;
+    }
+    unsigned char *ptr = reader->buf + (reader->pos - reader->buf_off);
+    size_t run = zero_prefix(ptr, avail);
+
+    // Zeros are only worth a record if they replace at least a packet.
+    if (run >= len) {
+        uint64_t total = 0;
+        while (true) {
+            total += run;
+            reader->pos += run;
+            if (run < (size_t)avail || reader->pos >= reader->data_end) {
+                break;
+            }
+            if ((avail = fill(reader, len)) <= 0) {
+                break;
+            }
+            ptr = reader->buf + (reader->pos - reader->buf_off);
+            run = zero_prefix(ptr, avail);
+        }
+        if (avail < 0) {
+            return -1;
+        }
+        *zeros = total;
+        return 0;
+    }
+
+    size_t n = len < (size_t)avail ? len : (size_t)avail;
+    memcpy(buf, ptr, n);
+    reader->pos += n;
+    return n;
+}
+
+void sparse_reader_free(SparseReader *reader) {
+    if (reader == NULL) {
+        return;
+    }
+    free(reader->buf);
+    free(reader);
+}
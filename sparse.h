@@ -0,0 +1,32 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Reads a regular file as data interleaved with runs of zeros. Holes are
+ * found with SEEK_DATA/SEEK_HOLE and never read; allocated blocks are read
+ * ahead and scanned, so runs of zero bytes cost a scan but no transfer.
+ */
+
+typedef struct SparseReader SparseReader;
+
+SparseReader *sparse_reader_new(int fd);
+
+// Returns up to len bytes of data at the current offset. If the file
+// instead continues with at least len zero bytes, returns 0 and sets *zeros
+// to the length of the run, which has been skipped. Returns 0 with *zeros
+// 0 at end of file, or -1 on error.
+ssize_t sparse_reader_read(SparseReader *reader, void *buf, size_t len,
+        uint64_t *zeros);
+
+void sparse_reader_free(SparseReader *reader);
+
+// Length of the run of zero bytes at the start of buf.
+size_t zero_prefix(const void *buf, size_t len);
+
+#endif
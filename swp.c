@@ -0,0 +1,2553 @@
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dedup.h"
+#include "reliable_file.h"
+#include "sparse.h"
+#include "swp.h"
+
+// How long a finished receiver keeps answering retransmitted terminals.
+// The sender resends the terminal at least four times as often, so one lost
+// echo cannot leave it retrying after the receiver has gone.
+#define LINGER_US 1000000
+#define TERMINAL_RTO_MAX_US (LINGER_US / 4)
+
+// Default ack coalescing: ack every second in-order packet, or after 1ms,
+// well inside the sender's retransmission timeout.
+#define ACK_EVERY 2
+#define ACK_DELAY_US 1000
+
+// Duplicate acks that trigger a fast retransmit.
+#define DUPACK_THRESHOLD 3
+
+// The retransmission timeout starts at a second (RFC 6298) until the
+// handshake or the first packet times the round trip. It then follows the
+// measured round trip, never dropping below TIMEOUT_US, and backs off to
+// at most a minute.
+#define INITIAL_RTO_US 1000000
+#define MAX_RTO_US 60000000
+
+// Zero-window probes start at the retransmission timeout and back off to
+// 64 times that while the receiver stays full.
+#define PERSIST_BACKOFF_MAX 6
+
+// Multicast: a receiver waits a random part of three repair round trips
+// (at least NAK_BACKOFF_US) before NAKing a hole, so that one receiver's
+// NAK and the repair it draws spare the others theirs, and NAKs again every
+// two round trips (at least NAK_RETRY_US) until it is filled. A packet
+// NAKed within REPAIR_HOLDOFF_US of its last repair was lost after it, and
+// goes by unicast.
+#define NAK_BACKOFF_US 2000
+#define NAK_RETRY_US 20000
+#define REPAIR_HOLDOFF_US 5000
+#define MAX_RECEIVERS 1024
+
+// Receivers silent this long are dropped. Under SwpSlowDrop, so are those
+// that have kept the window shut for SLOW_DROP_US.
+#define MEMBER_TIMEOUT_US 5000000
+#define SLOW_DROP_US 1000000
+
+// Retransmission timer wheel: 250us ticks, 256ms per revolution.
+#define TIMER_TICK_US 250
+#define TIMER_BUCKETS 1024
+
+enum SwpRole {
+    SwpSender,
+    SwpReceiver
+};
+
+enum SwpState {
+    SwpSubdir,      // Sender: waiting for the subdirectory to be acked.
+    SwpFilename,    // Sender: waiting for the file name to be acked.
+    SwpData,
+    SwpFinal,       // Sender: terminal sent, waiting for it to be acked.
+    SwpLinger,      // Receiver: terminal received, answering retransmits.
+    SwpDone,
+    SwpFailed
+};
+
+// A receiver of a multicast sender. Its state follows the session's through
+// the handshake, then becomes SwpDone once it has everything, or SwpFailed
+// if it was dropped.
+typedef struct SwpMember {
+    struct sockaddr_in addr;
+    enum SwpState state;
+    int ack;                // Last sequence it received in order.
+    int rwnd;
+    uint64_t heard_at;
+} SwpMember;
+
+// A socket and, for a sender, the receiver address it leads to, with the
+// path's own round-trip estimate. Path 0 is the session's socket and peer.
+// The congestion window here is only used with more than one path; a
+// single path keeps the session's, with NewReno recovery.
+typedef struct SwpPath {
+    int sockfd;
+    struct sockaddr_in addr;
+    uint64_t srtt;          // Smoothed round trip (us), 0 before the first sample.
+    uint64_t rttvar;
+    uint64_t rto;
+    bool backoff;           // Timed out, and not heard from since.
+    int cwnd;
+    int cwnd_acked;
+    int ssthresh;
+    int inflight;           // Packets last sent on it and not yet acked.
+    PacketInfo *oldest;     // Those packets in the order they were sent.
+    PacketInfo *newest;
+    uint64_t serial;        // Transmissions on it so far.
+    uint64_t acked_serial;  // Latest of them that has been acked.
+    uint64_t reduced_at;    // When the window was last cut.
+    SwpPathStats stats;
+} SwpPath;
+
+struct SwpSession {
+    enum SwpRole role;
+    enum SwpState state;
+    int sockfd;
+    struct sockaddr_in peer;
+    int peer_fd;            // Socket the peer is answered through.
+    SwpPath paths[SWP_MAX_PATHS];
+    int npaths;
+    FILE *log;
+    SwpTransport transport; // Replaces the socket and clock if send is set.
+    Aead *aead;             // Seals and opens every datagram, if set.
+    bool started;           // A datagram has been sent or taken in.
+
+    SlidingWindow window;
+    struct timeval timeout_elapse;
+    unsigned char *send_buf;
+    unsigned char *recv_buf;
+    SwpStats stats;
+
+    // Sender
+    char *subdir;
+    char *filename;
+    const unsigned char *mem;
+    size_t mem_len;
+    size_t mem_pos;
+    SwpReadFn read_fn;
+    void *read_ctx;
+    int input_fd;
+    SparseReader *sparse;
+    DedupReader *dedup;
+    uint64_t pending_zeros; // Zero range still to be handed to the dedup reader.
+    bool awaiting;          // Waiting for the bitmap of batch await_id.
+    uint32_t await_id;
+    uint64_t query_deadline;
+    uint64_t query_interval;
+    bool read_blocked;
+    int curr_acknum;
+    int64_t offset;
+    int cwnd;               // Congestion window, in packets.
+    int cwnd_acked;         // Acked packets toward the next additive increase.
+    int ssthresh;
+    int dupacks;
+    int dupack_threshold;
+    bool in_recovery;
+    int recover;            // Highest sequence sent when recovery began.
+    int lost;               // Packets timed out and not yet resent.
+    uint64_t meta_sent_at;  // First send of the metadata, 0 once resent.
+    int rwnd;               // Receiver's advertised window, in packets.
+    int persist_backoff;
+    TimerWheel timers;      // Per-packet retransmission deadlines.
+    SwpMember *members;     // Multicast only.
+    int receivers;          // Expected to join.
+    int nmembers;
+    enum SwpSlowPolicy slow_policy;
+    uint64_t stall_since;   // When the window last shut, 0 while open.
+
+    // Receiver
+    SwpOpenFn open_fn;
+    SwpWriteFn write_fn;
+    SwpSkipFn skip_fn;
+    SwpFinishFn finish_fn;
+    bool sink_finished;     // finish_fn has run.
+    void *sink_ctx;
+    ChunkStore *chunk_store;
+    DedupWriter *dedup_writer;
+    unsigned char need[DEDUP_BATCH_CHUNKS / 8];
+    size_t need_len;        // Latest bitmap sent, kept for a ChunkQuery.
+    uint32_t need_id;
+    int group_fd;
+    bool multicast;
+    int head;               // Multicast: next sequence the sender will send.
+    bool nak_pending;
+    uint64_t nak_deadline;
+    uint64_t *nak_due;      // Per sequence: when a missing packet is NAKed.
+    uint64_t *nak_time;     // Per sequence: its NAK, UINT64_MAX after several.
+    unsigned int nak_seed;
+    uint64_t repair_rtt;    // Smoothed time from a NAK to its repair (us).
+    int output_fd;
+    bool write_blocked;
+    size_t deliver_pos;
+    bool subdir_opened;
+    bool file_opened;
+    int64_t written;
+    int buffered;           // Slots holding data not yet delivered.
+    int recv_next;          // First sequence not yet received in order.
+    int last_rwnd;          // Window in the latest ack.
+    int ack_every;
+    struct timeval ack_delay;
+    int unacked;            // In-order packets since the last ack.
+    struct timeval ack_deadline;
+    bool ack_pending;
+    struct timeval linger;
+};
+
+static SwpSession *session_new(enum SwpRole role, int sockfd) {
+    SwpSession *session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        return NULL;
+    }
+
+    session->role = role;
+    session->sockfd = sockfd;
+    session->peer_fd = sockfd;
+    session->paths[0].sockfd = sockfd;
+    session->npaths = 1;
+    session->input_fd = -1;
+    session->output_fd = -1;
+    session->group_fd = -1;
+
+    int window_status = create_sliding_window(&(session->window), WINDOW_SIZE);
+    timerclear(&(session->timeout_elapse));
+    session->timeout_elapse.tv_usec = TIMEOUT_US;
+
+    session->send_buf = calloc(1, DATAGRAM_SIZE);
+    session->recv_buf = calloc(1, DATAGRAM_SIZE);
+    if (window_status < 0 || session->send_buf == NULL || session->recv_buf == NULL) {
+        swp_session_free(session);
+        return NULL;
+    }
+    session->curr_acknum = decrement_mod(0, session->window.total);
+    return session;
+}
+
+// The session's clock: the transport's if it has one, else the wall clock.
+static uint64_t now_us(SwpSession *session) {
+    if (session->transport.now != NULL) {
+        return session->transport.now(session->transport.ctx);
+    }
+    struct timeval timenow;
+    gettimeofday(&timenow, NULL);
+    return (uint64_t)timenow.tv_sec * 1000000 + timenow.tv_usec;
+}
+
+static void now_tv(SwpSession *session, struct timeval *tv) {
+    uint64_t now = now_us(session);
+    tv->tv_sec = now / 1000000;
+    tv->tv_usec = now % 1000000;
+}
+
+static uint64_t timeval_us(struct timeval *tv) {
+    return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+SwpSession *swp_sender_new(int sockfd, const struct sockaddr_in *recv_addr,
+        const char *subdir, const char *filename) {
+    // Metadata has to fit in a single datagram.
+    size_t max_len = PACKET_SIZE - sizeof(Header) - 1;
+    if (strlen(subdir) > max_len || strlen(filename) > max_len) {
+        fprintf(stderr, "swp_sender_new: Path too long.\n");
+        return NULL;
+    }
+
+    SwpSession *session = session_new(SwpSender, sockfd);
+    if (session == NULL) {
+        return NULL;
+    }
+    session->state = SwpSubdir;
+    session->peer = *recv_addr;
+    session->paths[0].addr = *recv_addr;
+    session->paths[0].rto = INITIAL_RTO_US;
+    session->cwnd = WINDOW_SIZE;
+    session->ssthresh = WINDOW_SIZE;
+    session->rwnd = WINDOW_SIZE;
+    session->dupack_threshold = DUPACK_THRESHOLD;
+    session->subdir = strdup(subdir);
+    session->filename = strdup(filename);
+    if (timer_wheel_init(&(session->timers), TIMER_BUCKETS, TIMER_TICK_US,
+                now_us(session)) < 0
+            || session->subdir == NULL || session->filename == NULL) {
+        swp_session_free(session);
+        return NULL;
+    }
+    return session;
+}
+
+int swp_sender_set_buffer(SwpSession *session, const void *data, size_t len) {
+    if (session->role != SwpSender) {
+        return -1;
+    }
+    session->mem = data;
+    session->mem_len = len;
+    session->mem_pos = 0;
+    session->read_fn = NULL;
+    sparse_reader_free(session->sparse);
+    session->sparse = NULL;
+    return 0;
+}
+
+int swp_sender_set_reader(SwpSession *session, SwpReadFn read_fn, void *ctx) {
+    if (session->role != SwpSender) {
+        return -1;
+    }
+    session->mem = NULL;
+    session->read_fn = read_fn;
+    session->read_ctx = ctx;
+    session->input_fd = -1;
+    sparse_reader_free(session->sparse);
+    session->sparse = NULL;
+    return 0;
+}
+
+// Fills as much of buf as the descriptor has ready, so a pipe that trickles
+// in small writes still produces full packets.
+static ssize_t read_fd(void *ctx, void *buf, size_t len) {
+    SwpSession *session = ctx;
+    size_t filled = 0;
+    while (filled < len) {
+        ssize_t read_len = read(session->input_fd, (unsigned char *)buf + filled,
+                len - filled);
+        if (read_len == -1 && errno == EINTR) {
+            continue;
+        }
+        if (read_len <= 0) {
+            if (filled > 0) {
+                break;
+            }
+            return read_len;
+        }
+        filled += read_len;
+    }
+    return filled;
+}
+
+int swp_sender_set_fd_reader(SwpSession *session, int fd) {
+    if (swp_sender_set_reader(session, read_fd, session) < 0) {
+        return -1;
+    }
+    session->input_fd = fd;
+    return 0;
+}
+
+int swp_sender_set_file(SwpSession *session, int fd) {
+    if (swp_sender_set_reader(session, NULL, NULL) < 0) {
+        return -1;
+    }
+    if ((session->sparse = sparse_reader_new(fd)) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the next packet's worth of data, or sets *zeros to the length of a
+// run of zeros to send as a range instead.
+static ssize_t read_base(SwpSession *session, void *buf, size_t len,
+        uint64_t *zeros) {
+    *zeros = 0;
+    if (session->sparse != NULL) {
+        return sparse_reader_read(session->sparse, buf, len, zeros);
+    }
+
+    ssize_t read;
+    if (session->read_fn != NULL) {
+        read = session->read_fn(session->read_ctx, buf, len);
+    } else {
+        size_t remaining = session->mem_len - session->mem_pos;
+        read = len < remaining ? len : remaining;
+        memcpy(buf, session->mem + session->mem_pos, read);
+        session->mem_pos += read;
+    }
+
+    // Other sources cannot skip ahead, but a full packet of zeros still
+    // shrinks to a range.
+    if (read == (ssize_t)len && zero_prefix(buf, read) == len) {
+        *zeros = read;
+        return 0;
+    }
+    return read;
+}
+
+// The dedup reader's source: the base source with zero ranges written out,
+// since identical chunks of zeros deduplicate anyway.
+static ssize_t read_plain(void *ctx, void *buf, size_t len) {
+    SwpSession *session = ctx;
+    if (session->pending_zeros == 0) {
+        ssize_t read = read_base(session, buf, len, &(session->pending_zeros));
+        if (read != 0 || session->pending_zeros == 0) {
+            if (read > 0) {
+                session->stats.bytes += read;
+            }
+            return read;
+        }
+    }
+    size_t run = len < session->pending_zeros ? len : session->pending_zeros;
+    memset(buf, 0, run);
+    session->pending_zeros -= run;
+    session->stats.bytes += run;
+    return run;
+}
+
+// Starts waiting for the receiver's bitmap. It normally arrives unasked;
+// a lost one is asked for again from sender_timers().
+static void await_chunks(void *ctx, uint32_t id) {
+    SwpSession *session = ctx;
+    session->awaiting = true;
+    session->await_id = id;
+    session->query_interval = session->paths[0].rto;
+    session->query_deadline = now_us(session) + session->query_interval;
+}
+
+int swp_sender_set_dedup(SwpSession *session) {
+    // Receivers would each want different chunks of a multicast stream.
+    if (session->role != SwpSender || session->state != SwpSubdir
+            || session->dedup != NULL || session->members != NULL) {
+        return -1;
+    }
+    session->dedup = dedup_reader_new(read_plain, session, await_chunks, session);
+    return session->dedup != NULL ? 0 : -1;
+}
+
+int swp_sender_set_multicast(SwpSession *session, int receivers,
+        enum SwpSlowPolicy policy) {
+    if (session->role != SwpSender || session->state != SwpSubdir
+            || session->members != NULL || session->dedup != NULL
+            || session->npaths > 1 || receivers < 1 || receivers > MAX_RECEIVERS) {
+        return -1;
+    }
+    session->members = calloc(receivers, sizeof(SwpMember));
+    if (session->members == NULL) {
+        return -1;
+    }
+    session->receivers = receivers;
+    session->slow_policy = policy;
+    return 0;
+}
+
+int swp_sender_add_path(SwpSession *session, int sockfd,
+        const struct sockaddr_in *recv_addr) {
+    if (session->role != SwpSender || session->state != SwpSubdir
+            || session->members != NULL || session->npaths == SWP_MAX_PATHS) {
+        return -1;
+    }
+    SwpPath *path = &(session->paths[session->npaths++]);
+    path->sockfd = sockfd;
+    path->addr = *recv_addr;
+    path->rto = INITIAL_RTO_US;
+    return 0;
+}
+
+int swp_sender_set_window(SwpSession *session, int size) {
+    if (session->role != SwpSender || session->state != SwpSubdir
+            || size < 1 || size > MAX_WINDOW_SIZE) {
+        return -1;
+    }
+    // The old window stays if the new one cannot be had.
+    SlidingWindow window;
+    if (create_sliding_window(&window, size) < 0) {
+        return -1;
+    }
+    free_sliding_window(&(session->window));
+    session->window = window;
+    session->curr_acknum = decrement_mod(0, session->window.total);
+
+    // Large windows slow-start from the default instead of bursting.
+    session->cwnd = size < WINDOW_SIZE ? size : WINDOW_SIZE;
+    session->ssthresh = size;
+    session->rwnd = size;
+    return 0;
+}
+
+int swp_sender_set_dupack_threshold(SwpSession *session, int threshold) {
+    if (session->role != SwpSender || threshold < 0) {
+        return -1;
+    }
+    session->dupack_threshold = threshold;
+    return 0;
+}
+
+SwpSession *swp_receiver_new(int sockfd) {
+    SwpSession *session = session_new(SwpReceiver, sockfd);
+    if (session == NULL) {
+        return NULL;
+    }
+    session->state = SwpData;
+    session->ack_every = ACK_EVERY;
+    timerclear(&(session->ack_delay));
+    session->ack_delay.tv_usec = ACK_DELAY_US;
+    return session;
+}
+
+int swp_receiver_set_ack_policy(SwpSession *session, int ack_every, int delay_us) {
+    if (session->role != SwpReceiver || ack_every < 0) {
+        return -1;
+    }
+    if (ack_every > 0) {
+        session->ack_every = ack_every;
+    }
+    if (delay_us >= 0) {
+        session->ack_delay.tv_sec = delay_us / 1000000;
+        session->ack_delay.tv_usec = delay_us % 1000000;
+    }
+    return 0;
+}
+
+int swp_receiver_set_sink(SwpSession *session, SwpOpenFn open_fn,
+        SwpWriteFn write_fn, void *ctx) {
+    if (session->role != SwpReceiver) {
+        return -1;
+    }
+    session->open_fn = open_fn;
+    session->write_fn = write_fn;
+    session->skip_fn = NULL;
+    session->finish_fn = NULL;
+    session->sink_ctx = ctx;
+    session->output_fd = -1;
+    return 0;
+}
+
+int swp_receiver_set_group(SwpSession *session, int group_fd) {
+    if (session->role != SwpReceiver) {
+        return -1;
+    }
+    session->group_fd = group_fd;
+    if (session->transport.send == NULL) {
+        session->nak_seed = now_us(session) ^ getpid();
+    }
+    return 0;
+}
+
+int swp_receiver_add_socket(SwpSession *session, int sockfd) {
+    if (session->role != SwpReceiver || session->npaths == SWP_MAX_PATHS) {
+        return -1;
+    }
+    session->paths[session->npaths++].sockfd = sockfd;
+    return 0;
+}
+
+int swp_receiver_set_chunk_store(SwpSession *session, ChunkStore *store) {
+    if (session->role != SwpReceiver) {
+        return -1;
+    }
+    session->chunk_store = store;
+    return 0;
+}
+
+int swp_receiver_set_skip(SwpSession *session, SwpSkipFn skip_fn) {
+    if (session->role != SwpReceiver) {
+        return -1;
+    }
+    session->skip_fn = skip_fn;
+    return 0;
+}
+
+int swp_receiver_set_finish(SwpSession *session, SwpFinishFn finish_fn) {
+    if (session->role != SwpReceiver) {
+        return -1;
+    }
+    session->finish_fn = finish_fn;
+    return 0;
+}
+
+static ssize_t write_fd(void *ctx, const void *buf, size_t len) {
+    SwpSession *session = ctx;
+    ssize_t written;
+    while ((written = write(session->output_fd, buf, len)) == -1 && errno == EINTR) {
+        continue;
+    }
+    return written;
+}
+
+// Seeks past a zero range. The file is extended to its full length once
+// the terminal arrives, in case it ends in zeros.
+static int skip_fd(void *ctx, uint64_t len) {
+    SwpSession *session = ctx;
+    return lseek(session->output_fd, len, SEEK_CUR) < 0 ? -1 : 0;
+}
+
+int swp_receiver_set_fd_sink(SwpSession *session, int fd) {
+    if (swp_receiver_set_sink(session, NULL, write_fd, session) < 0) {
+        return -1;
+    }
+    session->output_fd = fd;
+    // Only a regular file reads a hole back as zeros, and an appending one
+    // would write the next data at its end rather than past the hole.
+    struct stat st;
+    int flags = fcntl(fd, F_GETFL);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && flags >= 0 && !(flags & O_APPEND)) {
+        session->skip_fn = skip_fd;
+    }
+    return 0;
+}
+
+void swp_session_set_log(SwpSession *session, FILE *log) {
+    session->log = log;
+}
+
+int swp_session_set_key(SwpSession *session, const unsigned char *key,
+        enum SwpCipher cipher) {
+    // The peer could not open what was already sent in the clear.
+    if (session->started) {
+        return -1;
+    }
+    Aead *aead = aead_new(key, cipher);
+    if (aead == NULL) {
+        return -1;
+    }
+    aead_free(session->aead);
+    session->aead = aead;
+    return 0;
+}
+
+const char *swp_session_cipher(SwpSession *session) {
+    return session->aead != NULL ? aead_cipher_name(aead_cipher(session->aead)) : NULL;
+}
+
+int swp_session_set_transport(SwpSession *session, const SwpTransport *transport) {
+    if (transport->send == NULL || transport->now == NULL) {
+        return -1;
+    }
+    session->transport = *transport;
+    session->nak_seed = transport->seed;
+    if (session->role == SwpSender) {
+        // Nothing is armed yet; restart the wheel on the new clock.
+        timer_wheel_free(&(session->timers));
+        if (timer_wheel_init(&(session->timers), TIMER_BUCKETS, TIMER_TICK_US,
+                    now_us(session)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void swp_session_free(SwpSession *session) {
+    if (session == NULL) {
+        return;
+    }
+    free_sliding_window(&(session->window));
+    if (session->role == SwpSender) {
+        timer_wheel_free(&(session->timers));
+        sparse_reader_free(session->sparse);
+        dedup_reader_free(session->dedup);
+        free(session->members);
+    } else {
+        dedup_writer_free(session->dedup_writer);
+        free(session->nak_due);
+        free(session->nak_time);
+    }
+    aead_free(session->aead);
+    free(session->send_buf);
+    free(session->recv_buf);
+    free(session->subdir);
+    free(session->filename);
+    free(session);
+}
+
+int swp_session_fd(SwpSession *session) {
+    return session->sockfd;
+}
+
+int swp_session_group_fd(SwpSession *session) {
+    return session->group_fd;
+}
+
+int swp_session_paths(SwpSession *session) {
+    return session->npaths;
+}
+
+int swp_session_path_fd(SwpSession *session, int path) {
+    if (path < 0 || path >= session->npaths) {
+        return -1;
+    }
+    return session->paths[path].sockfd;
+}
+
+int swp_session_path_stats(SwpSession *session, int path, SwpPathStats *stats) {
+    if (path < 0 || path >= session->npaths) {
+        return -1;
+    }
+    *stats = session->paths[path].stats;
+    stats->srtt_us = session->paths[path].srtt;
+    stats->cwnd = session->npaths > 1 ? session->paths[path].cwnd : session->cwnd;
+    return 0;
+}
+
+bool swp_session_input_blocked(SwpSession *session) {
+    return session->read_blocked;
+}
+
+bool swp_session_output_blocked(SwpSession *session) {
+    return session->write_blocked;
+}
+
+void swp_session_get_stats(SwpSession *session, SwpStats *stats) {
+    *stats = session->stats;
+    if (session->aead != NULL) {
+        stats->auth_failures = aead_rejected(session->aead);
+    }
+
+    DedupStats dedup_stats;
+    if (session->dedup != NULL) {
+        dedup_reader_get_stats(session->dedup, &dedup_stats);
+    } else if (session->dedup_writer != NULL) {
+        dedup_writer_get_stats(session->dedup_writer, &dedup_stats);
+    } else {
+        return;
+    }
+    stats->dedup_chunks = dedup_stats.chunks;
+    stats->dedup_hits = dedup_stats.hits;
+    stats->dedup_bytes = dedup_stats.saved;
+    stats->cache_evictions = dedup_stats.evictions;
+}
+
+bool swp_session_complete(SwpSession *session) {
+    if (session->role == SwpReceiver && session->state == SwpLinger) {
+        return true;
+    }
+    return session->state == SwpDone;
+}
+
+static int send_datagram_via(SwpSession *session, Packet packet, int fd,
+        const struct sockaddr_in *addr) {
+    ssize_t len = fill_send_buffer(session->send_buf, packet, session->aead);
+    if (len < 0) {
+        return -1;
+    }
+    if (session->transport.send != NULL) {
+        return session->transport.send(session->transport.ctx, session->send_buf, len, addr);
+    }
+
+    // A datagram the kernel cannot take right now is treated like one lost
+    // on the wire; the retransmission timer covers both.
+    ssize_t sent;
+    while ((sent = sendto(fd, session->send_buf,
+                    len, MSG_DONTWAIT,
+                    (const struct sockaddr *)addr, sizeof(*addr))) == -1 && errno == EINTR) {
+        continue;
+    }
+    return sent;
+}
+
+static int send_datagram_to(SwpSession *session, Packet packet,
+        const struct sockaddr_in *addr) {
+    return send_datagram_via(session, packet, session->sockfd, addr);
+}
+
+static int send_datagram(SwpSession *session, Packet packet) {
+    return send_datagram_via(session, packet, session->peer_fd, &(session->peer));
+}
+
+// Acks carry the offset of the selectively acked packet, if any, so a
+// straggler from an earlier trip round the sequence space cannot mark the
+// wrong packet as received.
+static void send_control(SwpSession *session, enum PacketType type,
+        int ack_num, int64_t offset, int sack_num, int64_t sack_offset, int rwnd) {
+    Packet packet;
+    packet.header.length = sizeof(packet.header) + sizeof(sack_offset);
+    packet.header.offset = offset;
+    packet.header.type = type;
+    packet.header.ack_num = ack_num;
+    packet.header.sack_num = sack_num;
+    packet.header.rwnd = rwnd;
+    packet.data = &sack_offset;
+    send_datagram(session, packet);
+}
+
+static void arm_timeout(SwpSession *session, uint64_t interval) {
+    struct timeval timenow, elapse = { interval / 1000000, interval % 1000000 };
+    now_tv(session, &timenow);
+    timeradd(&timenow, &elapse, &(session->window.timeout));
+    session->window.timeout_set = true;
+}
+
+static bool timeout_expired(SwpSession *session) {
+    if (!session->window.timeout_set) {
+        return false;
+    }
+    struct timeval timenow;
+    now_tv(session, &timenow);
+    return timercmp(&timenow, &(session->window.timeout), >=);
+}
+
+/*
+ * Sender
+ */
+
+static void send_metadata(SwpSession *session) {
+    char *data = session->state == SwpSubdir ? session->subdir : session->filename;
+
+    Packet packet;
+    packet.header.length = sizeof(packet.header) + strlen(data) + 1;
+    packet.header.offset = 0;
+    if (session->state == SwpFilename) {
+        packet.header.offset = (session->dedup != NULL ? STREAM_DEDUP : 0)
+            | (session->members != NULL ? STREAM_MULTICAST : 0);
+    }
+    packet.header.type = session->state == SwpSubdir ? FileSubdir : Filename;
+    // The receiver sizes its sequence space from this.
+    packet.header.ack_num = session->window.size;
+    packet.header.sack_num = -1;
+    packet.header.rwnd = 0;
+    packet.data = data;
+
+    // The first copy times the round trip for the retransmission timer; a
+    // resent one is ambiguous, and backs the timer off instead. Multicast
+    // metadata doubles as the call for receivers to join, and is repeated
+    // at the short interval regardless.
+    SwpPath *path = &(session->paths[0]);
+    if (session->members != NULL) {
+        send_datagram(session, packet);
+        arm_timeout(session, timeval_us(&(session->timeout_elapse)));
+        return;
+    }
+    if (!session->window.timeout_set) {
+        session->meta_sent_at = now_us(session);
+    } else {
+        session->meta_sent_at = 0;
+        path->rto = 2 * path->rto < MAX_RTO_US ? 2 * path->rto : MAX_RTO_US;
+    }
+    send_datagram(session, packet);
+    arm_timeout(session, path->rto);
+}
+
+// True if path a should carry the next packet rather than path b: paths
+// that timed out come last until they answer again, then the shortest round
+// trip wins, a path yet to be timed counting as the shortest so that it
+// gets timed, then the emptier path.
+static bool path_before(SwpPath *a, SwpPath *b) {
+    if (a->backoff != b->backoff) {
+        return b->backoff;
+    }
+    if (a->srtt != b->srtt) {
+        return a->srtt < b->srtt;
+    }
+    return a->inflight < b->inflight;
+}
+
+// Picks the path for the next transmission of a multipath sender: the best
+// with room in its congestion window, or -1 if none has room. With any
+// path at all, the best regardless of room, for a resend that cannot
+// wait. Filling the fastest path first keeps arrivals nearly in order,
+// and each path ends up carrying about cwnd packets per round trip, in
+// proportion to its throughput.
+static int choose_path(SwpSession *session, bool any) {
+    int best = -1;
+    for (int idx = 0; idx < session->npaths; idx++) {
+        SwpPath *path = &(session->paths[idx]);
+        if ((any || path->inflight < path->cwnd)
+                && (best < 0 || path_before(path, &(session->paths[best])))) {
+            best = idx;
+        }
+    }
+    return best;
+}
+
+// Adds a packet just sent on a multipath sender's path to the end of its
+// send order.
+static void path_append(SwpSession *session, PacketInfo *pack_info) {
+    SwpPath *path = &(session->paths[pack_info->path]);
+    pack_info->path_serial = ++path->serial;
+    pack_info->path_prev = path->newest;
+    pack_info->path_next = NULL;
+    if (path->newest != NULL) {
+        path->newest->path_next = pack_info;
+    } else {
+        path->oldest = pack_info;
+    }
+    path->newest = pack_info;
+    path->inflight++;
+}
+
+// Takes a packet off its path, acked or lost.
+static void path_unlink(SwpSession *session, PacketInfo *pack_info) {
+    SwpPath *path = &(session->paths[pack_info->path]);
+    if (pack_info->path_prev != NULL) {
+        pack_info->path_prev->path_next = pack_info->path_next;
+    } else {
+        path->oldest = pack_info->path_next;
+    }
+    if (pack_info->path_next != NULL) {
+        pack_info->path_next->path_prev = pack_info->path_prev;
+    } else {
+        path->newest = pack_info->path_prev;
+    }
+    path->inflight--;
+}
+
+// Sends a data or terminal packet and (re)arms its own retransmission timer.
+static void send_packet(SwpSession *session, PacketInfo *pack_info) {
+    uint64_t now = now_us(session);
+    bool resend = pack_info->transmissions > 0;
+    if (pack_info->lost) {
+        pack_info->lost = false;
+        session->lost--;
+    } else if (resend && session->npaths > 1) {
+        // A packet sent again has left its last path, lost.
+        path_unlink(session, pack_info);
+    }
+    if (session->npaths > 1) {
+        pack_info->path = choose_path(session, false);
+        if (pack_info->path < 0) {
+            pack_info->path = choose_path(session, true);
+        }
+        path_append(session, pack_info);
+    } else {
+        pack_info->path = 0;
+    }
+    SwpPath *path = &(session->paths[pack_info->path]);
+    pack_info->sent_at = now;
+    pack_info->transmissions++;
+    // Multicast packets are only resent when NAKed.
+    if (session->members == NULL) {
+        uint64_t rto = pack_info->terminal && path->rto > TERMINAL_RTO_MAX_US
+            ? TERMINAL_RTO_MAX_US : path->rto;
+        timer_wheel_arm(&(session->timers), &(pack_info->timer), now + rto);
+    }
+
+    session->stats.data_sent++;
+    path->stats.data_sent++;
+    if (resend) {
+        path->stats.retransmits++;
+    }
+    if (session->log != NULL) {
+        fprintf(session->log, "[send data] %zu (%" PRId64 ") %d\n",
+                pack_info->packet.header.length,
+                pack_info->packet.header.offset,
+                pack_info->packet.header.ack_num);
+    }
+    send_datagram_via(session, pack_info->packet, path->sockfd, &(path->addr));
+}
+
+// Packets sent but not yet cumulatively acked.
+static int flight_size(SwpSession *session) {
+    return (session->curr_acknum - session->window.min_accept + 1
+            + session->window.total) % session->window.total;
+}
+
+static ssize_t read_source(SwpSession *session, void *buf, size_t len,
+        uint64_t *zeros) {
+    if (session->dedup != NULL) {
+        *zeros = 0;
+        return dedup_reader_read(session->dedup, buf, len);
+    }
+    return read_base(session, buf, len, zeros);
+}
+
+// Packets still in the network: those timed out have left it.
+static int pipe_size(SwpSession *session) {
+    return flight_size(session) - session->lost;
+}
+
+// Room in the congestion window: the session's, or any path's.
+static bool cwnd_open(SwpSession *session) {
+    if (session->npaths > 1) {
+        return choose_path(session, false) >= 0;
+    }
+    return pipe_size(session) < session->cwnd;
+}
+
+static bool in_flight(SwpSession *session) {
+    return session->curr_acknum
+        != decrement_mod(session->window.min_accept, session->window.total);
+}
+
+// Receivers have nothing to answer while nothing is in flight, and send no
+// acks then. Their silence clocks start over once sending resumes, so that
+// a producer that pauses for longer than MEMBER_TIMEOUT_US drops no one.
+static void restart_member_clocks(SwpSession *session) {
+    uint64_t now = now_us(session);
+    int idx;
+    for (idx = 0; idx < session->nmembers; idx++) {
+        session->members[idx].heard_at = now;
+    }
+}
+
+// Resends a packet unless the receiver already holds it.
+static void retransmit(SwpSession *session, PacketInfo *pack_info) {
+    if (pack_info->ack) {
+        return;
+    }
+    session->stats.retransmits++;
+    send_packet(session, pack_info);
+}
+
+// Resends packets that timed out, oldest first, as the congestion window
+// makes room for them.
+static void resend_lost(SwpSession *session) {
+    SlidingWindow *window = &(session->window);
+    int seq = window->min_accept;
+    while (session->lost > 0 && cwnd_open(session)) {
+        PacketInfo *pack_info = get_packet_info(*window, seq);
+        if (pack_info->lost) {
+            retransmit(session, pack_info);
+        }
+        if (seq == session->curr_acknum) {
+            break;
+        }
+        seq = increment_mod(seq, window->total);
+    }
+}
+
+// Reads and sends new packets until the window is full or the source has
+// nothing more to give right now. The congestion window and the receiver's
+// advertised window both cap what is in flight, and lost packets take
+// their room first.
+static int fill_window(SwpSession *session) {
+    SlidingWindow *window = &(session->window);
+    session->read_blocked = false;
+    if (session->state == SwpData || session->state == SwpFinal) {
+        resend_lost(session);
+    }
+
+    while (session->state == SwpData
+            && session->curr_acknum != window->max_accept
+            && cwnd_open(session)
+            && flight_size(session) < session->rwnd) {
+        int next = increment_mod(session->curr_acknum, window->total);
+        PacketInfo *pack_info = get_packet_info(*window, next);
+        Header *head = &(pack_info->packet.header);
+
+        uint64_t zeros;
+        ssize_t read = read_source(session, pack_info->packet.data,
+                PACKET_SIZE - sizeof(*head), &zeros);
+        if (read < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Waiting on the receiver is not waiting on the source.
+                session->read_blocked = !session->awaiting;
+                return 0;
+            }
+            perror("fill_window: Failed to read source");
+            session->state = SwpFailed;
+            return -1;
+        }
+
+        head->offset = session->offset;
+        head->ack_num = next;
+        head->sack_num = -1;
+        head->rwnd = 0;
+        pack_info->ack = false;
+        pack_info->lost = false;
+        pack_info->transmissions = 0;
+        if (zeros > 0) {
+            head->length = sizeof(*head) + sizeof(zeros);
+            head->type = Zeros;
+            memcpy(pack_info->packet.data, &zeros, sizeof(zeros));
+            pack_info->terminal = false;
+            session->offset += zeros;
+            session->stats.bytes += zeros;
+            session->stats.zero_bytes += zeros;
+        } else if (read == 0) {
+            // End of stream: the terminal takes the next sequence number and
+            // carries the total length.
+            head->length = sizeof(*head) + 1;
+            head->type = Terminal;
+            ((unsigned char *)pack_info->packet.data)[0] = 0;
+            pack_info->terminal = true;
+            session->state = SwpFinal;
+            if (session->log != NULL) {
+                fprintf(session->log, "send_swp: End of file...\n");
+            }
+        } else {
+            head->length = sizeof(*head) + read;
+            head->type = Data;
+            pack_info->terminal = false;
+            session->offset += read;
+            if (session->dedup == NULL) {
+                session->stats.bytes += read;
+            }
+        }
+
+        if (session->members != NULL && !in_flight(session)) {
+            restart_member_clocks(session);
+        }
+        session->curr_acknum = next;
+        send_packet(session, pack_info);
+    }
+    return 0;
+}
+
+static PacketInfo *first_unacked(SwpSession *session) {
+    return get_packet_info(session->window, session->window.min_accept);
+}
+
+// Cuts the window of the path a multipath packet was lost on: to half its
+// flight for a loss found by duplicate acks, to one packet for a timeout.
+// Packets sent before the last cut were already in flight then, so their
+// losses belong to the same event and cut nothing more.
+static void path_on_loss(SwpSession *session, PacketInfo *pack_info, bool timeout) {
+    SwpPath *path = &(session->paths[pack_info->path]);
+    if (timeout) {
+        path->backoff = true;
+    }
+    if (pack_info->sent_at < path->reduced_at) {
+        return;
+    }
+    path->ssthresh = path->inflight / 2 < 2 ? 2 : path->inflight / 2;
+    path->cwnd = timeout ? 1 : path->ssthresh;
+    path->cwnd_acked = 0;
+    path->reduced_at = now_us(session);
+    if (timeout) {
+        path->rto = 2 * path->rto < MAX_RTO_US ? 2 * path->rto : MAX_RTO_US;
+    }
+}
+
+// Notes that the receiver holds a packet. On multipath it leaves its path's
+// flight and grows that path's window, by one per ack in slow start and one
+// per window's worth after.
+static void mark_acked(SwpSession *session, PacketInfo *pack_info) {
+    if (pack_info->ack) {
+        return;
+    }
+    pack_info->ack = true;
+    SwpPath *path = &(session->paths[pack_info->path]);
+    path->stats.delivered++;
+    // A packet taken for lost has already left its path.
+    bool was_lost = pack_info->lost;
+    if (was_lost) {
+        pack_info->lost = false;
+        session->lost--;
+    }
+    if (session->npaths == 1) {
+        return;
+    }
+
+    // An ack for a resent packet may be for an earlier copy, so it shows
+    // nothing about what was sent before the resend.
+    if (!was_lost) {
+        path_unlink(session, pack_info);
+    }
+    if (pack_info->transmissions == 1 && pack_info->path_serial > path->acked_serial) {
+        path->acked_serial = pack_info->path_serial;
+    }
+    if (path->cwnd < path->ssthresh) {
+        path->cwnd++;
+    } else if (++path->cwnd_acked >= path->cwnd) {
+        path->cwnd_acked = 0;
+        path->cwnd++;
+    }
+    if (path->cwnd > session->window.size) {
+        path->cwnd = session->window.size;
+    }
+}
+
+// Duplicate acks say little on multipath, where the hole at the front of
+// the window may just be a packet on a slower path. Each path instead
+// keeps its own order: a packet is lost once the threshold's worth of
+// packets sent after it on the same path have been acked, and is resent
+// at once.
+static void detect_path_losses(SwpSession *session) {
+    if (session->dupack_threshold == 0) {
+        return;
+    }
+    for (int idx = 0; idx < session->npaths; idx++) {
+        SwpPath *path = &(session->paths[idx]);
+        PacketInfo *pack_info;
+        while ((pack_info = path->oldest) != NULL && pack_info->path_serial
+                + session->dupack_threshold <= path->acked_serial) {
+            session->stats.fast_retransmits++;
+            path_on_loss(session, pack_info, false);
+            retransmit(session, pack_info);
+        }
+    }
+}
+
+// Halves the window for a loss detected by duplicate acks and resends the
+// missing packet straight away instead of waiting for the timeout. The
+// window is then inflated by one for every further duplicate, since each
+// one means a packet has left the network.
+static void on_dupack(SwpSession *session) {
+    session->dupacks++;
+    if (session->in_recovery) {
+        if (session->cwnd < session->window.size) {
+            session->cwnd++;
+        }
+        return;
+    }
+    if (session->dupack_threshold == 0 || session->dupacks != session->dupack_threshold) {
+        return;
+    }
+
+    session->ssthresh = flight_size(session) / 2;
+    if (session->ssthresh < 2) {
+        session->ssthresh = 2;
+    }
+    session->cwnd = session->ssthresh + session->dupack_threshold;
+    if (session->cwnd > session->window.size) {
+        session->cwnd = session->window.size;
+    }
+    session->in_recovery = true;
+    session->recover = session->curr_acknum;
+    session->stats.fast_retransmits++;
+    if (session->log != NULL) {
+        fprintf(session->log, "send_swp: Fast retransmit of %d after %d duplicate acks.\n",
+                session->window.min_accept, session->dupacks);
+    }
+    retransmit(session, first_unacked(session));
+}
+
+// Folds a round trip timed on a path into its estimate the usual way
+// (RFC 6298): the timeout is the smoothed round trip plus four times its
+// mean deviation.
+static void rtt_sample(SwpPath *path, uint64_t sample) {
+    if (path->srtt == 0) {
+        path->srtt = sample;
+        path->rttvar = sample / 2;
+    } else {
+        uint64_t delta = sample > path->srtt
+            ? sample - path->srtt : path->srtt - sample;
+        path->rttvar = (3 * path->rttvar + delta) / 4;
+        path->srtt = (7 * path->srtt + sample) / 8;
+    }
+    path->rto = path->srtt + 4 * path->rttvar;
+    if (path->rto < TIMEOUT_US) {
+        path->rto = TIMEOUT_US;
+    } else if (path->rto > MAX_RTO_US) {
+        path->rto = MAX_RTO_US;
+    }
+    path->backoff = false;
+}
+
+// Times the round trip on a packet's path. Only a packet sent once gives an
+// unambiguous sample.
+static void update_rto(SwpSession *session, PacketInfo *pack_info) {
+    if (pack_info->transmissions != 1) {
+        return;
+    }
+    rtt_sample(&(session->paths[pack_info->path]), now_us(session) - pack_info->sent_at);
+}
+
+// Grows the window for newly acked packets. In recovery, an ack that stops
+// short of the recovery point exposes the next hole, which is resent at
+// once; one that covers it deflates the window back to ssthresh.
+static void on_new_ack(SwpSession *session, int ack_num, int newly_acked) {
+    int total = session->window.total;
+    int prev_min = modulo(session->window.min_accept - newly_acked, total);
+    session->dupacks = 0;
+    if (session->npaths > 1) {
+        // Each path's window grew as its packets were acked.
+        return;
+    }
+    if (session->in_recovery) {
+        if (in_range(session->recover, prev_min, ack_num, total)) {
+            session->in_recovery = false;
+            session->cwnd = session->ssthresh;
+        } else {
+            session->cwnd -= newly_acked - 1;
+            if (session->cwnd < 1) {
+                session->cwnd = 1;
+            }
+            retransmit(session, first_unacked(session));
+        }
+        return;
+    }
+
+    if (session->cwnd < session->ssthresh) {
+        session->cwnd += newly_acked;
+    } else {
+        session->cwnd_acked += newly_acked;
+        if (session->cwnd_acked >= session->cwnd) {
+            session->cwnd_acked -= session->cwnd;
+            session->cwnd++;
+        }
+    }
+    if (session->cwnd > session->window.size) {
+        session->cwnd = session->window.size;
+    }
+}
+
+// Marks a packet the receiver holds beyond a hole, so its timer stops and it
+// is never resent. The receiver sacks a packet as soon as it arrives, so the
+// first sack also times the round trip.
+static void on_sack(SwpSession *session, Packet *packet) {
+    SlidingWindow *window = &(session->window);
+    Header *head = &(packet->header);
+    int64_t sack_offset;
+
+    if (head->sack_num < 0 || get_data_len(*packet) < sizeof(sack_offset)
+            || !in_range(head->sack_num, window->min_accept,
+                session->curr_acknum, window->total)) {
+        return;
+    }
+    memcpy(&sack_offset, packet->data, sizeof(sack_offset));
+    PacketInfo *pack_info = get_packet_info(*window, head->sack_num);
+    if (pack_info->packet.header.offset != sack_offset || pack_info->terminal
+            || pack_info->ack) {
+        return;
+    }
+    mark_acked(session, pack_info);
+    timer_wheel_cancel(&(session->timers), &(pack_info->timer));
+    update_rto(session, pack_info);
+}
+
+// Takes the receiver's window from an ack. A window that opens again stops
+// the persist timer, and probing starts over from the shortest interval.
+static void update_rwnd(SwpSession *session, int rwnd) {
+    if (rwnd < 0 || rwnd > session->window.size) {
+        return;
+    }
+    session->rwnd = rwnd;
+    if (rwnd > 0) {
+        session->window.timeout_set = false;
+        session->persist_backoff = 0;
+    }
+}
+
+static void arm_persist(SwpSession *session) {
+    uint64_t interval = timeval_us(&(session->timeout_elapse)) << session->persist_backoff;
+    struct timeval timenow, persist_elapse = { interval / 1000000, interval % 1000000 };
+    now_tv(session, &timenow);
+    timeradd(&timenow, &persist_elapse, &(session->window.timeout));
+    session->window.timeout_set = true;
+}
+
+// Asks a receiver that advertised a zero window to ack again, in case the
+// update that reopened it was lost.
+static void send_probe(SwpSession *session) {
+    int last_acked = decrement_mod(session->window.min_accept, session->window.total);
+    session->stats.window_probes++;
+    if (session->log != NULL) {
+        fprintf(session->log, "send_swp: Probing zero window.\n");
+    }
+    send_control(session, Ack, last_acked, 0, -1, 0, 0);
+}
+
+static void sender_handle(SwpSession *session, Packet *packet) {
+    SlidingWindow *window = &(session->window);
+    Header *head = &(packet->header);
+
+    if (head->type == ChunkNeed) {
+        if (session->awaiting && head->offset == session->await_id
+                && dedup_reader_need(session->dedup, session->await_id,
+                    packet->data, get_data_len(*packet))) {
+            session->awaiting = false;
+        }
+        return;
+    }
+    if (head->type == Leave) {
+        if (session->state != SwpDone) {
+            fprintf(stderr, "send_swp: The receiver failed.\n");
+            session->state = SwpFailed;
+        }
+        return;
+    }
+    if (head->type != Ack && head->type != Terminal) {
+        return;
+    }
+
+    if (session->state == SwpSubdir || session->state == SwpFilename) {
+        // Metadata acks echo the packet type in the offset field, so a late
+        // ack for the subdirectory cannot be mistaken for the file name's.
+        enum PacketType expected =
+            session->state == SwpSubdir ? FileSubdir : Filename;
+        if (head->type != Ack || head->ack_num != -1 || head->offset != expected) {
+            return;
+        }
+        window->timeout_set = false;
+        if (session->meta_sent_at != 0) {
+            rtt_sample(&(session->paths[0]), now_us(session) - session->meta_sent_at);
+        }
+        if (session->state == SwpSubdir) {
+            session->state = SwpFilename;
+            send_metadata(session);
+        } else {
+            session->state = SwpData;
+            // Paths share the initial window and slow-start from there.
+            for (int idx = 0; session->npaths > 1 && idx < session->npaths; idx++) {
+                SwpPath *path = &(session->paths[idx]);
+                path->cwnd = session->cwnd / session->npaths > 1
+                    ? session->cwnd / session->npaths : 1;
+                path->ssthresh = session->ssthresh;
+            }
+            if (session->log != NULL) {
+                fprintf(session->log, "send_swp: Metadata received and acknowledged.\n");
+            }
+        }
+        return;
+    }
+
+    if (session->state != SwpData && session->state != SwpFinal) {
+        return;
+    }
+    session->stats.acks_received++;
+
+    if (in_flight(session)) {
+        on_sack(session, packet);
+    }
+
+    // An ack for the packet just below the window, while later packets are
+    // in flight, means the receiver got something past a hole, unless it
+    // moves the window's right edge: then it is a window update.
+    int ack_num = head->ack_num;
+    int last_acked = decrement_mod(window->min_accept, window->total);
+    if (ack_num == last_acked) {
+        if (head->type == Ack && head->offset
+                == get_packet_info(*window, last_acked)->packet.header.offset) {
+            if (head->rwnd != session->rwnd) {
+                update_rwnd(session, head->rwnd);
+            } else if (in_flight(session) && session->npaths == 1) {
+                on_dupack(session);
+            }
+        }
+        return;
+    }
+
+    if (!in_flight(session)) {
+        return;
+    }
+
+    // Only acks for packets actually in flight can move the window; anything
+    // else is a straggler from an earlier cycle.
+    if (!in_range(ack_num, window->min_accept, session->curr_acknum, window->total)) {
+        return;
+    }
+    PacketInfo *pack_info = get_packet_info(*window, ack_num);
+    if (head->offset != pack_info->packet.header.offset) {
+        if (session->log != NULL) {
+            fprintf(session->log, "Sequence number mismatch: expected %" PRId64
+                    ", but received %" PRId64 ".\n",
+                    pack_info->packet.header.offset, head->offset);
+        }
+        return;
+    }
+
+    // Acks are cumulative: shift the window past everything up to ack_num.
+    // The round trip is timed on the latest packet this ack is the first
+    // news of; those sacked before it waited behind a hole at the receiver.
+    // If the ack also covers a resent packet, it was most likely the resend
+    // that drew it, and the latest packet may have waited behind the hole
+    // too: the time says nothing then.
+    PacketInfo *timed = NULL;
+    bool resent = false;
+    int newly_acked = 0;
+    while (window->min_accept != increment_mod(ack_num, window->total)) {
+        PacketInfo *check_pack_info = get_packet_info(*window, window->min_accept);
+        timer_wheel_cancel(&(session->timers), &(check_pack_info->timer));
+        if (check_pack_info->terminal) {
+            session->state = SwpDone;
+            return;
+        }
+        if (!check_pack_info->ack) {
+            mark_acked(session, check_pack_info);
+            timed = check_pack_info;
+            resent = resent || check_pack_info->transmissions > 1;
+        }
+        shift_window(window);
+        newly_acked++;
+    }
+    if (timed != NULL && !resent) {
+        update_rto(session, timed);
+    }
+    on_new_ack(session, ack_num, newly_acked);
+    // The ack clock waits on the hole this ack stops at, so one that timed
+    // out goes at once, whatever the window.
+    if (in_flight(session) && first_unacked(session)->lost) {
+        retransmit(session, first_unacked(session));
+    }
+    if (head->type == Ack) {
+        update_rwnd(session, head->rwnd);
+    }
+}
+
+// A packet whose deadline passed has left the network. The first timeout
+// since the window was last cut also means the ack clock has stopped, so
+// the window restarts from one packet and the timer backs off; packets
+// sent before the cut were in flight then and belong to the same loss.
+// Only the first unacked packet, which the ack clock waits on, is resent
+// at once. The rest are marked lost and resent by fill_window() as the
+// window reopens, so one late ack does not send the whole window again.
+static void on_timeout(SwpSession *session, PacketInfo *pack_info) {
+    SwpPath *path = &(session->paths[0]);
+
+    // On multipath only the path it was lost on starts over, and the resend
+    // goes another way if one is open.
+    if (session->npaths > 1) {
+        path_on_loss(session, pack_info, true);
+    } else if (pack_info->sent_at >= path->reduced_at) {
+        // A packet already resent leaves ssthresh where its first timeout
+        // put it (RFC 5681).
+        if (pack_info->transmissions == 1) {
+            session->ssthresh = pipe_size(session) / 2;
+            if (session->ssthresh < 2) {
+                session->ssthresh = 2;
+            }
+        }
+        session->cwnd = 1;
+        session->cwnd_acked = 0;
+        session->dupacks = 0;
+        session->in_recovery = false;
+        path->reduced_at = now_us(session);
+        // Back off until a fresh sample says otherwise.
+        path->rto = 2 * path->rto < MAX_RTO_US ? 2 * path->rto : MAX_RTO_US;
+    }
+
+    if (pack_info == first_unacked(session)) {
+        retransmit(session, pack_info);
+        return;
+    }
+    if (session->npaths > 1) {
+        path_unlink(session, pack_info);
+    }
+    pack_info->lost = true;
+    session->lost++;
+}
+
+/*
+ * Multicast sender
+ */
+
+static SwpMember *find_member(SwpSession *session, const struct sockaddr_in *addr) {
+    int idx;
+    for (idx = 0; idx < session->nmembers; idx++) {
+        SwpMember *member = &(session->members[idx]);
+        if (member->addr.sin_addr.s_addr == addr->sin_addr.s_addr
+                && member->addr.sin_port == addr->sin_port) {
+            return member;
+        }
+    }
+    return NULL;
+}
+
+static int members_in(SwpSession *session, enum SwpState state) {
+    int idx, count = 0;
+    for (idx = 0; idx < session->nmembers; idx++) {
+        count += session->members[idx].state == state;
+    }
+    return count;
+}
+
+// Packets past the window's left edge that the member has received.
+static int member_acked(SwpSession *session, SwpMember *member) {
+    return modulo(member->ack + 1 - session->window.min_accept, session->window.total);
+}
+
+// The window starts after the slowest receiver's ack, and packets may only
+// go as far as the tightest receive window allows. Receivers that have
+// everything no longer count.
+static void mcast_advance(SwpSession *session) {
+    SlidingWindow *window = &(session->window);
+    int idx, slowest = INT_MAX, limit = INT_MAX;
+
+    for (idx = 0; idx < session->nmembers; idx++) {
+        SwpMember *member = &(session->members[idx]);
+        if (member->state != SwpData) {
+            continue;
+        }
+        int acked = member_acked(session, member);
+        if (acked < slowest) {
+            slowest = acked;
+        }
+        if (acked + member->rwnd < limit) {
+            limit = acked + member->rwnd;
+        }
+    }
+
+    if (slowest == INT_MAX) {
+        if (members_in(session, SwpDone) > 0) {
+            session->state = SwpDone;
+        } else {
+            fprintf(stderr, "send_swp: Every receiver was dropped.\n");
+            session->state = SwpFailed;
+        }
+        return;
+    }
+
+    int shift;
+    for (shift = 0; shift < slowest; shift++) {
+        shift_window(window);
+    }
+    session->rwnd = limit - slowest;
+    if (slowest > 0) {
+        // Progress: heartbeats start over from the shortest interval.
+        window->timeout_set = false;
+        session->persist_backoff = 0;
+    }
+}
+
+static void drop_member(SwpSession *session, SwpMember *member, const char *reason) {
+    member->state = SwpFailed;
+    session->stats.receivers_dropped++;
+    if (session->log != NULL) {
+        fprintf(session->log, "send_swp: Dropped receiver %s:%d: %s.\n",
+                inet_ntoa(member->addr.sin_addr), ntohs(member->addr.sin_port), reason);
+    }
+
+    Packet packet;
+    int64_t unused = 0;
+    packet.header.length = sizeof(packet.header) + sizeof(unused);
+    packet.header.offset = 0;
+    packet.header.type = Leave;
+    packet.header.ack_num = -1;
+    packet.header.sack_num = -1;
+    packet.header.rwnd = 0;
+    packet.data = &unused;
+    send_datagram_to(session, packet, &(member->addr));
+}
+
+// The first NAK for a packet is answered by multicast, which also covers
+// the other receivers that lost it. A NAK that follows soon after a repair
+// comes from a receiver that lost the repair too, and is answered by
+// unicast.
+static void repair(SwpSession *session, PacketInfo *pack_info, SwpMember *member) {
+    session->stats.retransmits++;
+    if (pack_info->transmissions > 1 && now_us(session) - pack_info->sent_at < REPAIR_HOLDOFF_US) {
+        session->stats.data_sent++;
+        send_datagram_to(session, pack_info->packet, &(member->addr));
+        return;
+    }
+    send_packet(session, pack_info);
+}
+
+// Receivers join by acking the metadata, and data flows once all have.
+static void mcast_join(SwpSession *session, Header *head, struct sockaddr_in *from) {
+    SwpMember *member = find_member(session, from);
+    if (member == NULL) {
+        if (head->offset != FileSubdir || session->state != SwpSubdir
+                || session->nmembers == session->receivers) {
+            return;
+        }
+        member = &(session->members[session->nmembers++]);
+        member->addr = *from;
+        member->state = SwpSubdir;
+        if (session->log != NULL) {
+            fprintf(session->log, "send_swp: Receiver %s:%d joined (%d of %d).\n",
+                    inet_ntoa(from->sin_addr), ntohs(from->sin_port),
+                    session->nmembers, session->receivers);
+        }
+    }
+    member->heard_at = now_us(session);
+
+    if (head->offset == FileSubdir && member->state == SwpSubdir) {
+        member->state = SwpFilename;
+    } else if (head->offset == Filename && member->state == SwpFilename) {
+        member->state = SwpData;
+        member->ack = decrement_mod(session->window.min_accept, session->window.total);
+        member->rwnd = session->window.size;
+    }
+
+    if (session->state == SwpSubdir && members_in(session, SwpFilename) == session->receivers) {
+        session->window.timeout_set = false;
+        session->state = SwpFilename;
+        send_metadata(session);
+    } else if (session->state == SwpFilename
+            && members_in(session, SwpData) == session->receivers) {
+        // No congestion window across a group: the receivers' windows
+        // pace the sender.
+        session->window.timeout_set = false;
+        session->state = SwpData;
+        session->cwnd = session->window.size;
+        session->rwnd = session->window.size;
+        if (session->log != NULL) {
+            fprintf(session->log, "send_swp: Metadata received and acknowledged.\n");
+        }
+    }
+}
+
+static void mcast_sender_handle(SwpSession *session, Packet *packet,
+        struct sockaddr_in *from) {
+    SlidingWindow *window = &(session->window);
+    Header *head = &(packet->header);
+
+    if (head->type == Ack && head->ack_num == -1) {
+        if (session->state == SwpSubdir || session->state == SwpFilename) {
+            mcast_join(session, head, from);
+        }
+        return;
+    }
+
+    SwpMember *member = find_member(session, from);
+    if (member == NULL || member->state != SwpData
+            || (session->state != SwpData && session->state != SwpFinal)) {
+        return;
+    }
+    member->heard_at = now_us(session);
+    int last_acked = decrement_mod(window->min_accept, window->total);
+
+    if (head->type == Ack) {
+        // Acks only move forward, and must name a packet still held.
+        session->stats.acks_received++;
+        if (!in_range(head->ack_num, member->ack, session->curr_acknum, window->total)
+                || !in_range(head->ack_num, last_acked, session->curr_acknum, window->total)
+                || head->offset != get_packet_info(*window, head->ack_num)->packet.header.offset
+                || head->rwnd < 0 || head->rwnd > window->size) {
+            return;
+        }
+        member->ack = head->ack_num;
+        member->rwnd = head->rwnd;
+        mcast_advance(session);
+    } else if (head->type == Terminal) {
+        PacketInfo *pack_info = get_packet_info(*window, head->ack_num);
+        if (!in_range(head->ack_num, window->min_accept, session->curr_acknum, window->total)
+                || !pack_info->terminal || head->offset != pack_info->packet.header.offset) {
+            return;
+        }
+        member->state = SwpDone;
+        mcast_advance(session);
+    } else if (head->type == Leave) {
+        member->state = SwpFailed;
+        session->stats.receivers_dropped++;
+        if (session->log != NULL) {
+            fprintf(session->log, "send_swp: Receiver %s:%d failed.\n",
+                    inet_ntoa(member->addr.sin_addr), ntohs(member->addr.sin_port));
+        }
+        mcast_advance(session);
+    } else if (head->type == Nak) {
+        session->stats.naks++;
+        int seq = head->ack_num, last = head->sack_num;
+        if (!in_range(seq, window->min_accept, session->curr_acknum, window->total)
+                || !in_range(last, seq, session->curr_acknum, window->total)) {
+            return;
+        }
+        while (true) {
+            repair(session, get_packet_info(*window, seq), member);
+            if (seq == last) {
+                break;
+            }
+            seq = increment_mod(seq, window->total);
+        }
+    }
+}
+
+// Tells the receivers how far the stream has got, so that the last packets
+// before a pause can be NAKed too. Receivers answer with an ack, which also
+// covers lost acks.
+static void send_heartbeat(SwpSession *session) {
+    PacketInfo *pack_info = get_packet_info(session->window, session->curr_acknum);
+    send_control(session, Ack, session->curr_acknum,
+            pack_info->packet.header.offset, -1, 0, 0);
+}
+
+static void mcast_timers(SwpSession *session) {
+    uint64_t now = now_us(session);
+    int idx;
+    bool dropped = false;
+
+    for (idx = 0; idx < session->nmembers; idx++) {
+        SwpMember *member = &(session->members[idx]);
+        if (member->state == SwpData && now - member->heard_at > MEMBER_TIMEOUT_US) {
+            drop_member(session, member, "not responding");
+            dropped = true;
+        }
+    }
+
+    // Receivers whose window ends at what is in flight are the ones
+    // keeping it shut.
+    int flight = flight_size(session);
+    bool shut = session->state == SwpData && (flight == session->window.size
+            || flight >= session->rwnd);
+    if (!shut || session->slow_policy != SwpSlowDrop) {
+        session->stall_since = 0;
+    } else if (session->stall_since == 0) {
+        session->stall_since = now;
+    } else if (now - session->stall_since > SLOW_DROP_US) {
+        for (idx = 0; idx < session->nmembers; idx++) {
+            SwpMember *member = &(session->members[idx]);
+            int acked = member_acked(session, member);
+            if (member->state == SwpData && ((flight == session->window.size && acked == 0)
+                        || acked + member->rwnd <= flight)) {
+                drop_member(session, member, "too slow");
+                dropped = true;
+            }
+        }
+        session->stall_since = 0;
+    }
+    if (dropped) {
+        mcast_advance(session);
+    }
+
+    if (session->state != SwpFailed && session->state != SwpDone && in_flight(session)) {
+        if (!session->window.timeout_set) {
+            arm_persist(session);
+        } else if (timeout_expired(session)) {
+            send_heartbeat(session);
+            if (session->persist_backoff < PERSIST_BACKOFF_MAX) {
+                session->persist_backoff++;
+            }
+            arm_persist(session);
+        }
+    }
+}
+
+static void sender_timers(SwpSession *session) {
+    SlidingWindow *window = &(session->window);
+
+    if (session->state == SwpSubdir || session->state == SwpFilename) {
+        if (!window->timeout_set || timeout_expired(session)) {
+            send_metadata(session);
+        }
+        return;
+    }
+
+    if (session->state != SwpData && session->state != SwpFinal) {
+        return;
+    }
+    if (session->members != NULL) {
+        mcast_timers(session);
+        return;
+    }
+
+    // Ask again for a bitmap that is overdue, backing off like the
+    // retransmission timer.
+    uint64_t now = now_us(session);
+    if (session->awaiting && now >= session->query_deadline) {
+        if (session->log != NULL) {
+            fprintf(session->log, "send_swp: Querying the bitmap of batch %" PRIu32 ".\n",
+                    session->await_id);
+        }
+        send_control(session, ChunkQuery, -1, session->await_id, -1, 0, 0);
+        session->query_interval = 2 * session->query_interval < MAX_RTO_US
+            ? 2 * session->query_interval : MAX_RTO_US;
+        session->query_deadline = now + session->query_interval;
+    }
+
+    // With nothing in flight there are no acks to come, so a closed window
+    // is probed until it opens.
+    if (session->state == SwpData && session->rwnd == 0 && !in_flight(session)) {
+        if (!window->timeout_set) {
+            arm_persist(session);
+        } else if (timeout_expired(session)) {
+            send_probe(session);
+            if (session->persist_backoff < PERSIST_BACKOFF_MAX) {
+                session->persist_backoff++;
+            }
+            arm_persist(session);
+        }
+        return;
+    }
+
+    TimerNode *node = timer_wheel_expire(&(session->timers), now);
+    while (node != NULL) {
+        TimerNode *next = node->next;
+        PacketInfo *pack_info = (PacketInfo *)((char *)node - offsetof(PacketInfo, timer));
+        if (!pack_info->ack && in_flight(session) && in_range(
+                    pack_info->packet.header.ack_num, window->min_accept,
+                    session->curr_acknum, window->total)) {
+            on_timeout(session, pack_info);
+        }
+        node = next;
+    }
+    resend_lost(session);
+}
+
+/*
+ * Receiver
+ */
+
+static const unsigned char zero_block[64 * 1024];
+
+// Fails a transfer whose output could not be completed. The sender is
+// told, as it would otherwise take the missing ack for a lost terminal.
+static void abort_receiver(SwpSession *session) {
+    send_control(session, Leave, -1, 0, -1, 0, 0);
+    session->state = SwpFailed;
+}
+
+// A file sink that skipped a trailing zero range is still short of its
+// full length.
+static void extend_fd_sink(SwpSession *session) {
+    if (session->output_fd < 0 || session->skip_fn == NULL) {
+        return;
+    }
+    struct stat st;
+    off_t end = lseek(session->output_fd, 0, SEEK_CUR);
+    if (end >= 0 && fstat(session->output_fd, &st) == 0 && st.st_size < end
+            && ftruncate(session->output_fd, end) < 0) {
+        perror("deliver_ready: Failed to extend output");
+    }
+}
+
+// Output of the dedup writer: the rebuilt stream goes to the sink.
+static ssize_t sink_write(void *ctx, const void *buf, size_t len) {
+    SwpSession *session = ctx;
+    ssize_t written = len;
+    if (session->write_fn != NULL) {
+        written = session->write_fn(session->sink_ctx, buf, len);
+    }
+    if (written > 0) {
+        session->stats.bytes += written;
+    }
+    return written;
+}
+
+static void send_chunk_need(SwpSession *session) {
+    Packet packet;
+    packet.header.length = sizeof(packet.header) + session->need_len;
+    packet.header.offset = session->need_id;
+    packet.header.type = ChunkNeed;
+    packet.header.ack_num = -1;
+    packet.header.sack_num = -1;
+    packet.header.rwnd = 0;
+    packet.data = session->need;
+    send_datagram(session, packet);
+}
+
+// Tells the sender which chunks of a batch to send, and keeps the bitmap
+// in case it asks again.
+static void send_need(void *ctx, uint32_t id, const void *bitmap, size_t len) {
+    SwpSession *session = ctx;
+    memcpy(session->need, bitmap, len);
+    session->need_len = len;
+    session->need_id = id;
+    send_chunk_need(session);
+}
+
+// Hands in-order data to the sink, resuming a slot the sink only took part
+// of last time. While the sink is blocked the window stays put, so the
+// sender stalls instead of overrunning us. Returns true once the terminal is
+// at the front of the window.
+static bool deliver_ready(SwpSession *session) {
+    SlidingWindow *window = &(session->window);
+    session->write_blocked = false;
+
+    PacketInfo *check_pack_info = get_packet_info(*window, window->min_accept);
+    while (check_pack_info->ack) {
+        if (check_pack_info->terminal) {
+            if (session->dedup_writer != NULL
+                    && dedup_writer_flush(session->dedup_writer) < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    session->write_blocked = true;
+                    return false;
+                }
+                perror("deliver_ready: Failed to finish output");
+                abort_receiver(session);
+                return false;
+            }
+            extend_fd_sink(session);
+            if (session->finish_fn != NULL && !session->sink_finished) {
+                session->sink_finished = true;
+                if (session->finish_fn(session->sink_ctx) < 0) {
+                    fprintf(stderr, "deliver_ready: Failed to finish output.\n");
+                    abort_receiver(session);
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // A zero range is skipped if the sink can, or else written out
+        // from a block of zeros.
+        const unsigned char *data = check_pack_info->packet.data;
+        size_t len = get_data_len(check_pack_info->packet);
+        bool zeros = check_pack_info->packet.header.type == Zeros;
+        if (zeros) {
+            uint64_t run;
+            memcpy(&run, data, sizeof(run));
+            len = run;
+        }
+        // Offsets are signed, so a zero range the sender claims must not
+        // carry the stream past them.
+        if (len > (uint64_t)INT64_MAX - session->written) {
+            fprintf(stderr, "deliver_ready: Stream longer than 2^63 bytes.\n");
+            session->state = SwpFailed;
+            return false;
+        }
+        if (zeros && session->skip_fn != NULL && session->dedup_writer == NULL
+                && session->deliver_pos == 0) {
+            if (session->skip_fn(session->sink_ctx, len) < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    session->write_blocked = true;
+                    return false;
+                }
+                perror("deliver_ready: Failed to skip zeros");
+                session->state = SwpFailed;
+                return false;
+            }
+            session->deliver_pos = len;
+        }
+
+        while (session->deliver_pos < len) {
+            if (session->write_fn == NULL && session->dedup_writer == NULL) {
+                session->deliver_pos = len;
+                break;
+            }
+            size_t chunk = len - session->deliver_pos;
+            const unsigned char *src = data + session->deliver_pos;
+            if (zeros) {
+                src = zero_block;
+                if (chunk > sizeof(zero_block)) {
+                    chunk = sizeof(zero_block);
+                }
+            }
+            // A deduplicated stream is rebuilt on its way to the sink.
+            ssize_t written = session->dedup_writer != NULL
+                ? dedup_writer_write(session->dedup_writer, src, chunk)
+                : session->write_fn(session->sink_ctx, src, chunk);
+            if (written == 0 || (written < 0
+                        && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+                session->write_blocked = true;
+                return false;
+            } else if (written < 0) {
+                perror("deliver_ready: Failed to write sink");
+                session->state = SwpFailed;
+                return false;
+            }
+            session->deliver_pos += written;
+        }
+
+        session->written += len;
+        if (session->dedup_writer == NULL) {
+            session->stats.bytes += len;
+        }
+        if (zeros) {
+            session->stats.zero_bytes += len;
+        }
+        session->deliver_pos = 0;
+        session->buffered--;
+        check_pack_info->ack = false;
+        shift_window(window);
+        check_pack_info = get_packet_info(*window, window->min_accept);
+    }
+    return false;
+}
+
+// Packets received in order but not yet taken by the sink.
+static int held_in_order(SwpSession *session) {
+    SlidingWindow *window = &(session->window);
+    return (session->recv_next - window->min_accept + window->total) % window->total;
+}
+
+// Slots past the last packet received in order. Out-of-order packets held
+// in that range still count, since the sender will not resend them; data
+// waiting on a slow sink does not, so the sender throttles to the sink.
+static int advertised_window(SwpSession *session) {
+    return session->window.size - held_in_order(session);
+}
+
+// Buffers an incoming data or terminal packet in its slot. Returns true if
+// it was the next packet expected; duplicates, stragglers and packets
+// beyond a gap all return false.
+static bool process_swp_packet(SwpSession *session, Packet packet) {
+    SlidingWindow *window = &(session->window);
+    Header *head = &(packet.header);
+
+    if (!in_bounds(*window, head->ack_num)
+            || ((head->type == Data || head->type == Zeros)
+                && head->offset < session->written)
+            || (head->type == Zeros && get_data_len(packet) != sizeof(uint64_t))) {
+        if (session->log != NULL) {
+            fprintf(session->log, "[recv data] %" PRId64 " (%zu) IGNORED\n", head->offset, head->length);
+        }
+        return false;
+    }
+
+    PacketInfo *pack_info = get_packet_info(*window, head->ack_num);
+    if (pack_info->ack) {
+        if (session->log != NULL) {
+            fprintf(session->log, "[recv data] %" PRId64 " (%zu) IGNORED\n", head->offset, head->length);
+        }
+        return false;
+    }
+
+    // Copy packet into the slot's own buffer.
+    pack_info->packet.header = *head;
+    memcpy(pack_info->packet.data, packet.data, get_data_len(packet));
+    pack_info->terminal = head->type == Terminal;
+    pack_info->ack = true;
+    session->buffered++;
+
+    bool in_order = head->ack_num == session->recv_next;
+    while (held_in_order(session) < window->size
+            && get_packet_info(*window, session->recv_next)->ack) {
+        session->recv_next = increment_mod(session->recv_next, window->total);
+    }
+    if (session->log != NULL) {
+        fprintf(session->log, "[recv data] %" PRId64 " (%zu) ACCEPTED (%s)\n",
+                head->offset, head->length, in_order ? "in-order" : "out-of-order");
+    }
+    return in_order;
+}
+
+// Acks the last packet received in order, or echoes the terminal once
+// everything before it has been delivered. Acks carry the advertised window;
+// sack_num names a packet held beyond a hole, or is -1.
+static void send_receiver_ack(SwpSession *session, bool finished, int sack_num) {
+    SlidingWindow *window = &(session->window);
+    int64_t sack_offset = 0;
+    if (sack_num >= 0) {
+        sack_offset = get_packet_info(*window, sack_num)->packet.header.offset;
+    }
+    session->stats.acks_sent++;
+    session->unacked = 0;
+    session->ack_pending = false;
+    if (finished) {
+        PacketInfo *pack_info = get_packet_info(*window, window->min_accept);
+        send_control(session, Terminal, window->min_accept,
+                pack_info->packet.header.offset, -1, 0, 0);
+        if (session->state != SwpLinger) {
+            struct timeval timenow, linger_elapse = { 0, LINGER_US };
+            now_tv(session, &timenow);
+            timeradd(&timenow, &linger_elapse, &(session->linger));
+            session->state = SwpLinger;
+        }
+        return;
+    }
+
+    int status = decrement_mod(session->recv_next, window->total);
+    PacketInfo *pack_info = get_packet_info(*window, status);
+    session->last_rwnd = advertised_window(session);
+    send_control(session, Ack, status, pack_info->packet.header.offset,
+            sack_num, sack_offset, session->last_rwnd);
+}
+
+/*
+ * Multicast receiver
+ */
+
+// Notes that the sender has sent packet seq, from the packet itself or a
+// heartbeat. Packets before it that have not arrived are NAKed after a
+// random backoff, which lets one receiver's NAK, and the repair it draws,
+// spare the others theirs.
+static void note_sent(SwpSession *session, int seq) {
+    SlidingWindow *window = &(session->window);
+    int end = increment_mod(window->max_accept, window->total);
+    int next = increment_mod(seq, window->total);
+    if (!in_range(session->head, session->recv_next, end, window->total)) {
+        session->head = session->recv_next;
+    }
+    if (!in_range(next, session->recv_next, end, window->total)
+            || modulo(next - session->recv_next, window->total)
+                <= modulo(session->head - session->recv_next, window->total)) {
+        return;
+    }
+
+    uint64_t backoff = 3 * session->repair_rtt > NAK_BACKOFF_US
+        ? 3 * session->repair_rtt : NAK_BACKOFF_US;
+    uint64_t due = now_us(session) + rand_r(&(session->nak_seed)) % backoff;
+    for (; session->head != next; session->head = increment_mod(session->head, window->total)) {
+        if (!get_packet_info(*window, session->head)->ack) {
+            session->nak_due[session->head] = due;
+            session->nak_time[session->head] = 0;
+            if (!session->nak_pending || due < session->nak_deadline) {
+                session->nak_pending = true;
+                session->nak_deadline = due;
+            }
+        }
+    }
+}
+
+// A packet NAKed only once that turns up times the repair round trip.
+static void note_arrival(SwpSession *session, int seq) {
+    if (!in_bounds(session->window, seq)) {
+        return;
+    }
+    uint64_t sent = session->nak_time[seq];
+    if (sent != 0 && sent != UINT64_MAX) {
+        uint64_t sample = now_us(session) - sent;
+        session->repair_rtt = session->repair_rtt == 0
+            ? sample : (7 * session->repair_rtt + sample) / 8;
+    }
+    session->nak_time[seq] = 0;
+}
+
+// NAKs each run of missing packets whose backoff has run out, and NAKs
+// them again every two repair round trips until they arrive.
+static void send_naks(SwpSession *session) {
+    SlidingWindow *window = &(session->window);
+    uint64_t now = now_us(session);
+    uint64_t retry = 2 * session->repair_rtt > NAK_RETRY_US
+        ? 2 * session->repair_rtt : NAK_RETRY_US;
+    uint64_t next_due = UINT64_MAX;
+    int end = increment_mod(window->max_accept, window->total);
+    if (!in_range(session->head, session->recv_next, end, window->total)) {
+        session->head = session->recv_next;
+    }
+
+    int seq = session->recv_next;
+    while (seq != session->head) {
+        if (get_packet_info(*window, seq)->ack || session->nak_due[seq] > now) {
+            if (!get_packet_info(*window, seq)->ack && session->nak_due[seq] < next_due) {
+                next_due = session->nak_due[seq];
+            }
+            seq = increment_mod(seq, window->total);
+            continue;
+        }
+
+        int first = seq, next;
+        while (true) {
+            session->nak_time[seq] = session->nak_time[seq] == 0 ? now : UINT64_MAX;
+            session->nak_due[seq] = now + retry;
+            next = increment_mod(seq, window->total);
+            if (next == session->head || get_packet_info(*window, next)->ack
+                    || session->nak_due[next] > now) {
+                break;
+            }
+            seq = next;
+        }
+        session->stats.naks++;
+        if (session->log != NULL) {
+            fprintf(session->log, "recv_swp: NAK %d-%d.\n", first, seq);
+        }
+        send_control(session, Nak, first, 0, seq, 0, advertised_window(session));
+        if (now + retry < next_due) {
+            next_due = now + retry;
+        }
+        seq = next;
+    }
+    session->nak_pending = next_due != UINT64_MAX;
+    session->nak_deadline = next_due;
+}
+
+static void receiver_handle(SwpSession *session, Packet *packet,
+        struct sockaddr_in *from, SwpPath *path) {
+    Header *head = &(packet->header);
+    session->peer = *from;
+    session->peer_fd = path->sockfd;
+
+    if (session->state == SwpLinger) {
+        struct timeval timenow, linger_elapse = { 0, LINGER_US };
+        now_tv(session, &timenow);
+        timeradd(&timenow, &linger_elapse, &(session->linger));
+    }
+
+    if (head->type == FileSubdir) {
+        if (!session->subdir_opened) {
+            // Both ends must agree on the sequence space, so the receiver
+            // adopts the sender's window size.
+            int size = head->ack_num > 0 ? head->ack_num : WINDOW_SIZE;
+            if (size > MAX_WINDOW_SIZE) {
+                fprintf(stderr, "recv_swp: Window of %d packets is too large.\n", size);
+                session->state = SwpFailed;
+                return;
+            }
+            if (size != session->window.size) {
+                SlidingWindow window;
+                if (create_sliding_window(&window, size) < 0) {
+                    fprintf(stderr, "recv_swp: Failed to allocate a window of %d packets.\n", size);
+                    session->state = SwpFailed;
+                    return;
+                }
+                free_sliding_window(&(session->window));
+                session->window = window;
+            }
+            session->recv_next = session->window.min_accept;
+            session->head = session->recv_next;
+
+            session->subdir = strndup(packet->data, get_data_len(*packet));
+            session->subdir_opened = true;
+        }
+        send_control(session, Ack, -1, FileSubdir, -1, 0, 0);
+    } else if (head->type == Filename) {
+        if (!session->subdir_opened) {
+            return;
+        }
+        if (!session->file_opened) {
+            if ((head->offset & ~(int64_t)(STREAM_DEDUP | STREAM_MULTICAST))
+                    || (head->offset & STREAM_DEDUP && head->offset & STREAM_MULTICAST)) {
+                fprintf(stderr, "recv_swp: Unsupported stream options %#" PRIx64 ".\n",
+                        (uint64_t)head->offset);
+                session->state = SwpFailed;
+                return;
+            }
+            session->filename = strndup(packet->data, get_data_len(*packet));
+            if (session->open_fn != NULL && session->open_fn(
+                        session->sink_ctx, session->subdir, session->filename) != 0) {
+                session->state = SwpFailed;
+                return;
+            }
+            if ((head->offset & STREAM_DEDUP) && (session->dedup_writer = dedup_writer_new(
+                            session->chunk_store, sink_write, session, send_need, session)) == NULL) {
+                session->state = SwpFailed;
+                return;
+            }
+            if (head->offset & STREAM_MULTICAST) {
+                session->nak_due = calloc(session->window.total, sizeof(uint64_t));
+                session->nak_time = calloc(session->window.total, sizeof(uint64_t));
+                if (session->nak_due == NULL || session->nak_time == NULL) {
+                    session->state = SwpFailed;
+                    return;
+                }
+                // Acks from a whole group converge on the sender, so they
+                // come a quarter of the window at a time.
+                session->multicast = true;
+                if (session->ack_every < session->window.size / 4) {
+                    session->ack_every = session->window.size / 4;
+                }
+            }
+            session->file_opened = true;
+        }
+        send_control(session, Ack, -1, Filename, -1, 0, 0);
+    } else if (head->type == ChunkQuery) {
+        if (session->need_len > 0 && head->offset == session->need_id) {
+            send_chunk_need(session);
+        }
+    } else if (head->type == Leave) {
+        if (session->multicast) {
+            fprintf(stderr, "recv_swp: Dropped by the sender.\n");
+            session->state = SwpFailed;
+        }
+    } else if (head->type == Ack) {
+        // A zero-window probe, or a multicast sender's heartbeat.
+        if (session->multicast && session->state == SwpData) {
+            note_sent(session, head->ack_num);
+        }
+        if (session->file_opened && session->state == SwpData) {
+            send_receiver_ack(session, false, -1);
+        } else if (session->multicast && session->state == SwpLinger) {
+            send_receiver_ack(session, true, -1);
+        }
+    } else if (head->type == Data || head->type == Zeros || head->type == Terminal) {
+        if (!session->file_opened) {
+            return;
+        }
+
+        session->stats.data_received++;
+        path->stats.data_received++;
+        if (session->multicast) {
+            note_arrival(session, head->ack_num);
+        }
+        bool in_order = process_swp_packet(session, *packet);
+        bool finished = deliver_ready(session);
+        if (session->state == SwpFailed) {
+            return;
+        }
+
+        // Anything unusual is acked at once so the sender sees it quickly:
+        // duplicates, out-of-order arrivals, a gap still open after
+        // delivery, and the end of the transfer. Plain in-order data is
+        // coalesced into every ack_every-th packet or the delayed-ack timer.
+        // Multicast receivers NAK gaps instead.
+        SlidingWindow *window = &(session->window);
+        int sack_num = -1;
+        bool ack_now;
+        if (session->multicast) {
+            note_sent(session, head->ack_num);
+            ack_now = finished || ++session->unacked >= session->ack_every;
+        } else {
+            bool gap = session->buffered > held_in_order(session);
+            ack_now = finished || !in_order || gap
+                || ++session->unacked >= session->ack_every;
+            // Name a packet held past the hole so the sender stops its timer.
+            if (!in_order && in_bounds(*window, head->ack_num)
+                    && (head->ack_num - window->min_accept + window->total)
+                        % window->total > held_in_order(session)
+                    && get_packet_info(*window, head->ack_num)->ack) {
+                sack_num = head->ack_num;
+            }
+        }
+        if (ack_now) {
+            send_receiver_ack(session, finished, sack_num);
+        } else if (!session->ack_pending) {
+            struct timeval timenow;
+            now_tv(session, &timenow);
+            timeradd(&timenow, &(session->ack_delay), &(session->ack_deadline));
+            session->ack_pending = true;
+        }
+    }
+}
+
+/*
+ * Event loop integration
+ */
+
+uint64_t swp_session_deadline(SwpSession *session) {
+    uint64_t deadline = UINT64_MAX;
+    if (session->state == SwpDone || session->state == SwpFailed) {
+        return 0;
+    } else if (session->state == SwpLinger) {
+        deadline = timeval_us(&(session->linger));
+    } else if (session->role == SwpReceiver) {
+        if (session->ack_pending) {
+            deadline = timeval_us(&(session->ack_deadline));
+        }
+        if (session->nak_pending && session->nak_deadline < deadline) {
+            deadline = session->nak_deadline;
+        }
+    } else {
+        // The earliest of the metadata or persist timer, the next
+        // retransmission and a bitmap query.
+        if (session->window.timeout_set) {
+            deadline = timeval_us(&(session->window.timeout));
+        }
+        uint64_t next = timer_wheel_next(&(session->timers));
+        if (next < deadline) {
+            deadline = next;
+        }
+        if (session->awaiting && session->query_deadline < deadline) {
+            deadline = session->query_deadline;
+        }
+    }
+    return deadline;
+}
+
+int swp_session_timeout(SwpSession *session) {
+    uint64_t deadline = swp_session_deadline(session);
+    if (deadline == UINT64_MAX) {
+        return -1;
+    }
+
+    uint64_t now = now_us(session);
+    if (now >= deadline) {
+        return 0;
+    }
+    return (deadline - now + 999) / 1000;
+}
+
+// Dispatches the datagram of len bytes in recv_buf, which came in on path:
+// replies to it go back the same way.
+static void handle_datagram(SwpSession *session, size_t len, struct sockaddr_in *from,
+        SwpPath *path) {
+    Packet packet;
+    if (process_recv_data(session->recv_buf, len, &packet, session->aead) < 0) {
+        return;
+    }
+    if (session->role == SwpSender && session->members != NULL) {
+        mcast_sender_handle(session, &packet, from);
+    } else if (session->role == SwpSender) {
+        sender_handle(session, &packet);
+    } else {
+        receiver_handle(session, &packet, from, path);
+    }
+}
+
+// Largest datagram the session accepts: a sealed one only carries the
+// envelope and tag on top of a packet.
+static size_t datagram_limit(SwpSession *session) {
+    return session->aead != NULL ? DATAGRAM_SIZE : PACKET_SIZE;
+}
+
+static void drain_socket(SwpSession *session, int fd, SwpPath *path) {
+    while (session->state != SwpDone && session->state != SwpFailed) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t read = recvfrom(fd, session->recv_buf, datagram_limit(session),
+                MSG_DONTWAIT, (struct sockaddr *)&from, &from_len);
+        if (read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        handle_datagram(session, read, &from, path);
+    }
+}
+
+int swp_session_input(SwpSession *session, const void *buf, size_t len,
+        const struct sockaddr_in *from) {
+    if (len > datagram_limit(session)) {
+        return -1;
+    }
+    if (session->state == SwpDone || session->state == SwpFailed) {
+        return 0;
+    }
+    session->started = true;
+    struct sockaddr_in addr = *from;
+    memcpy(session->recv_buf, buf, len);
+    handle_datagram(session, len, &addr, &(session->paths[0]));
+    return 0;
+}
+
+int swp_session_process(SwpSession *session) {
+    session->started = true;
+    if (session->role == SwpSender && session->state == SwpSubdir
+            && !session->window.timeout_set) {
+        send_metadata(session);
+    }
+
+    for (int idx = 0; session->transport.send == NULL && idx < session->npaths; idx++) {
+        drain_socket(session, session->paths[idx].sockfd, &(session->paths[idx]));
+    }
+    // Group traffic is answered through the session socket.
+    if (session->group_fd >= 0) {
+        drain_socket(session, session->group_fd, &(session->paths[0]));
+    }
+
+    if (session->role == SwpSender) {
+        if (session->npaths > 1
+                && (session->state == SwpData || session->state == SwpFinal)) {
+            detect_path_losses(session);
+        }
+        fill_window(session);
+        sender_timers(session);
+    } else if (session->state == SwpData) {
+        if (session->write_blocked) {
+            // Retry a sink that pushed back earlier. The sender hears about
+            // the space it frees once a quarter of the window has opened,
+            // not a slot at a time.
+            bool finished = deliver_ready(session);
+            int update = session->window.size / 4 > 1 ? session->window.size / 4 : 1;
+            if (session->state != SwpFailed && (finished
+                        || advertised_window(session) >= session->last_rwnd + update)) {
+                send_receiver_ack(session, finished, -1);
+            }
+        }
+        if (session->state == SwpData && session->nak_pending
+                && now_us(session) >= session->nak_deadline) {
+            send_naks(session);
+        }
+        if (session->state == SwpData && session->ack_pending) {
+            struct timeval timenow;
+            now_tv(session, &timenow);
+            if (!timercmp(&timenow, &(session->ack_deadline), <)) {
+                send_receiver_ack(session, false, -1);
+            }
+        }
+    } else if (session->state == SwpLinger) {
+        struct timeval timenow;
+        now_tv(session, &timenow);
+        if (!timercmp(&timenow, &(session->linger), <)) {
+            session->state = SwpDone;
+        }
+    }
+
+    if (session->state == SwpDone) {
+        return SWP_DONE;
+    } else if (session->state == SwpFailed) {
+        return SWP_ERROR;
+    }
+    return SWP_AGAIN;
+}
+
+int swp_session_run(SwpSession *session) {
+    struct pollfd pfds[SWP_MAX_PATHS + 2];
+    nfds_t nsockets;
+    for (nsockets = 0; nsockets < (nfds_t)session->npaths; nsockets++) {
+        pfds[nsockets].fd = session->paths[nsockets].sockfd;
+        pfds[nsockets].events = POLLIN;
+    }
+    if (session->group_fd >= 0) {
+        pfds[nsockets].fd = session->group_fd;
+        pfds[nsockets++].events = POLLIN;
+    }
+
+    int status;
+    while ((status = swp_session_process(session)) == SWP_AGAIN) {
+        int timeout = swp_session_timeout(session);
+        nfds_t nfds = nsockets;
+
+        // Also wake up when a blocked source or sink becomes ready.
+        if (session->read_blocked && session->input_fd >= 0) {
+            pfds[nfds].fd = session->input_fd;
+            pfds[nfds++].events = POLLIN;
+        } else if (session->write_blocked && session->output_fd >= 0) {
+            pfds[nfds].fd = session->output_fd;
+            pfds[nfds++].events = POLLOUT;
+        } else if (session->read_blocked || session->write_blocked) {
+            // A callback with nothing to give yet has no fd we can wait on.
+            if (timeout < 0 || timeout > 1) {
+                timeout = 1;
+            }
+        }
+
+        if (poll(pfds, nfds, timeout) == -1 && errno != EINTR) {
+            perror("swp_session_run");
+            return SWP_ERROR;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,282 @@
+#ifndef SWP_H
+#define SWP_H
+
+/*
+ * libreliable: the sliding-window file transfer protocol as an embeddable,
+ * non-blocking library.
+ *
+ * A session wraps one UDP socket owned by the caller. Register
+ * swp_session_fd() with poll/epoll for reading, call swp_session_process()
+ * whenever it is readable or swp_session_timeout() milliseconds have passed,
+ * and stop once it returns SWP_DONE or SWP_ERROR.
+ */
+
+#include <netinet/in.h>
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SWP_ERROR -1
+#define SWP_AGAIN 0
+#define SWP_DONE 1
+
+// Paths of a multipath sender, or sockets of a receiver, at most; see
+// swp_sender_add_path() and swp_receiver_add_socket().
+#define SWP_MAX_PATHS 8
+
+typedef struct SwpSession SwpSession;
+
+struct ChunkStore;          // dedup.h
+
+typedef struct SwpStats {
+    uint64_t data_sent;         // Data and terminal packets, retransmits included.
+    uint64_t retransmits;
+    uint64_t fast_retransmits;  // Retransmits triggered by duplicate acks.
+    uint64_t window_probes;     // Probes of a receiver that advertised no room.
+    uint64_t data_received;     // Data and terminal packets, duplicates included.
+    uint64_t acks_sent;
+    uint64_t acks_received;
+    uint64_t bytes;             // Payload read by the sender or delivered by the receiver.
+    uint64_t zero_bytes;        // Of those, bytes that travelled as zero ranges.
+    uint64_t dedup_chunks;      // Chunks in a deduplicated stream.
+    uint64_t dedup_hits;        // Of those, chunks the receiver already had.
+    uint64_t dedup_bytes;       // Their bytes, which never crossed the wire.
+    uint64_t cache_evictions;   // Receiver: chunks evicted from the store.
+    uint64_t naks;              // Multicast: NAKs sent or received.
+    uint64_t receivers_dropped; // Multicast sender: receivers given up on.
+    uint64_t auth_failures;     // Datagrams dropped as forged, corrupted or replayed.
+} SwpStats;
+
+// One path of a multipath sender, or one socket of a receiver; see
+// swp_sender_add_path() and swp_receiver_add_socket().
+typedef struct SwpPathStats {
+    uint64_t data_sent;         // Sender: data and terminal packets sent on it.
+    uint64_t retransmits;       // Sender: of those, resends.
+    uint64_t delivered;         // Sender: packets sent on it that were acked.
+    uint64_t data_received;     // Receiver: data packets that came in on it.
+    uint64_t srtt_us;           // Sender: smoothed round trip, 0 before a sample.
+    int cwnd;                   // Sender: congestion window, in packets.
+} SwpPathStats;
+
+// What a multicast sender does about a receiver that cannot keep up.
+enum SwpSlowPolicy {
+    SwpSlowWait,    // Hold the window for it: the group goes at its pace.
+    SwpSlowDrop     // Drop it once it has held the window shut for a second.
+};
+
+// Datagram encryption; see aead.h.
+enum SwpCipher {
+    SwpCipherAuto,      // AES-256-GCM given AES instructions, else ChaCha20-Poly1305.
+    SwpCipherAesGcm,
+    SwpCipherChaCha
+};
+
+// Fills buf with up to len bytes. Returns the number of bytes read, 0 at end
+// of stream, or -1 with errno set. EAGAIN means no data is available yet;
+// the session will ask again on the next swp_session_process().
+typedef ssize_t (*SwpReadFn)(void *ctx, void *buf, size_t len);
+
+// Skips len zero bytes of output, leaving a hole where the sink can.
+// Returns 0, or -1 with errno set; EAGAIN retries on a later
+// swp_session_process().
+typedef int (*SwpSkipFn)(void *ctx, uint64_t len);
+
+// Called once the sender's subdirectory and file name have arrived.
+// Returns 0 to accept the transfer, -1 to abort it.
+typedef int (*SwpOpenFn)(void *ctx, const char *subdir, const char *filename);
+
+// Consumes up to len in-order bytes. Returns the number of bytes taken, or
+// -1 with errno set. A short count or EAGAIN holds the rest in the window
+// until the next swp_session_process(). Acks advertise only the slots not
+// taken by such a backlog, so a slow sink throttles the sender rather than
+// letting it time out on data that has already arrived.
+typedef ssize_t (*SwpWriteFn)(void *ctx, const void *buf, size_t len);
+
+// Called once every byte has been delivered, before the terminal is acked,
+// to complete the output. Returns 0, or -1 to fail the transfer; the
+// sender is told, so that it fails too.
+typedef int (*SwpFinishFn)(void *ctx);
+
+// Stands in for the socket and the wall clock, to run a session over
+// something other than UDP, such as a simulated network. send is handed
+// each outgoing datagram; its result is ignored, as a lost datagram is
+// covered by retransmission. now returns microseconds and must not go
+// backwards. seed feeds the session's own random choices (NAK backoff), so
+// that runs on the same clock and input repeat exactly.
+typedef struct SwpTransport {
+    ssize_t (*send)(void *ctx, const void *buf, size_t len, const struct sockaddr_in *to);
+    uint64_t (*now)(void *ctx);
+    void *ctx;
+    unsigned int seed;
+} SwpTransport;
+
+SwpSession *swp_sender_new(int sockfd, const struct sockaddr_in *recv_addr,
+        const char *subdir, const char *filename);
+
+// Sends len bytes starting at data. The buffer must outlive the session.
+int swp_sender_set_buffer(SwpSession *session, const void *data, size_t len);
+
+int swp_sender_set_reader(SwpSession *session, SwpReadFn read_fn, void *ctx);
+
+// Reads from fd, typically a non-blocking pipe of unknown length. Memory use
+// stays bounded by the window: nothing is read until a slot is free, so a
+// slow network pushes back on the producer.
+int swp_sender_set_fd_reader(SwpSession *session, int fd);
+
+// Sends the regular file open on fd. Holes (SEEK_DATA/SEEK_HOLE) and runs
+// of zeros at least a packet long go as compact zero ranges, which are
+// neither read off disk nor sent, respectively.
+int swp_sender_set_file(SwpSession *session, int fd);
+
+// Deduplicates the source against the receiver's chunk store (see
+// dedup.h): only chunks the receiver lacks are sent. Must be set before the
+// first swp_session_process(); works with any of the sources above.
+int swp_sender_set_dedup(SwpSession *session);
+
+// Multicasts the stream to the group address given to swp_sender_new(),
+// once `receivers` receivers have joined. Receivers NAK the packets they
+// miss, and the sender repairs them from the window: by multicast, or by
+// unicast if the packet was only just repaired for someone else. The window
+// advances as the slowest receiver acks; see SwpSlowPolicy. Receivers that
+// stop responding for five seconds are dropped under either policy. Must be
+// set before the first swp_session_process(); excludes dedup.
+int swp_sender_set_multicast(SwpSession *session, int receivers,
+        enum SwpSlowPolicy policy);
+
+// Stripes the stream over another path as well: datagrams to recv_addr
+// through sockfd, a socket owned by the caller and typically bound to
+// another local interface. recv_addr may be another address or port of
+// the same receiver, or the same one. The path given to swp_sender_new()
+// is the first and carries the handshake; up to SWP_MAX_PATHS in all.
+// Each has its own round-trip estimate and congestion window, and each
+// packet goes on the path with the shortest round trip that has room, so
+// every path carries about as much as its window allows per round trip.
+// Acks count on whichever path they arrive. Must be set before the first
+// swp_session_process(); excludes multicast.
+int swp_sender_add_path(SwpSession *session, int sockfd,
+        const struct sockaddr_in *recv_addr);
+
+// Packets in flight at most (default 60, up to 16383). Must be set before
+// the first swp_session_process(); the receiver adopts it from the
+// handshake. Every in-flight packet has its own retransmission timer.
+int swp_sender_set_window(SwpSession *session, int size);
+
+// Duplicate acks needed to resend a missing packet without waiting for
+// the timeout; 3 by default, 0 disables fast retransmit.
+int swp_sender_set_dupack_threshold(SwpSession *session, int threshold);
+
+SwpSession *swp_receiver_new(int sockfd);
+
+int swp_receiver_set_sink(SwpSession *session, SwpOpenFn open_fn,
+        SwpWriteFn write_fn, void *ctx);
+
+// Lets the sink skip zero ranges instead of writing them out. Set it after
+// the sink; without it the sink's write function is handed zeros.
+int swp_receiver_set_skip(SwpSession *session, SwpSkipFn skip_fn);
+
+// Lets the sink complete its output, e.g. set a file's length, before the
+// sender hears that the transfer succeeded. Set it after the sink.
+int swp_receiver_set_finish(SwpSession *session, SwpFinishFn finish_fn);
+
+// Writes in-order bytes straight to fd, e.g. a non-blocking stdout. A
+// regular file not open for appending skips zero ranges and stays sparse.
+int swp_receiver_set_fd_sink(SwpSession *session, int fd);
+
+// Also receives from group_fd, a socket bound to a multicast group's port
+// and joined to it. The session socket still carries everything sent back
+// to the sender, and unicast repairs, so it needs an address of its own.
+// Owned by the caller, like the session socket.
+int swp_receiver_set_group(SwpSession *session, int group_fd);
+
+// Also receives on sockfd, such as a socket on another port or interface
+// that a multipath sender stripes over. Replies leave through the socket
+// the latest datagram came in on. Owned by the caller; up to SWP_MAX_PATHS
+// sockets in all, counting the session socket.
+int swp_receiver_add_socket(SwpSession *session, int sockfd);
+
+// Chunk store that a deduplicating sender's stream is rebuilt from, and
+// new chunks are added to. It must outlive the session. Without one every
+// chunk is requested.
+int swp_receiver_set_chunk_store(SwpSession *session, struct ChunkStore *store);
+
+// Coalesces acks for in-order data: one ack per ack_every packets, or after
+// delay_us if fewer arrive. Keep delay_us well under the sender's
+// retransmission timeout. Out-of-order arrivals, duplicates and gaps are
+// always acked immediately. An ack_every of 0 or a negative delay_us keeps
+// that half of the policy as it is, the library default until set.
+int swp_receiver_set_ack_policy(SwpSession *session, int ack_every, int delay_us);
+
+// Per-packet trace output; NULL (the default) disables it.
+void swp_session_set_log(SwpSession *session, FILE *log);
+
+// Seals every datagram with a key derived from the 32-byte pre-shared key
+// (see aead.h) and drops any that arrive without a valid tag, as well as
+// replays, including the session's own datagrams reflected back at it.
+// Both ends need the same key. Fails once the session has sent or taken in
+// a datagram.
+int swp_session_set_key(SwpSession *session, const unsigned char *key,
+        enum SwpCipher cipher);
+
+// The cipher datagrams are sealed with, or NULL without a key.
+const char *swp_session_cipher(SwpSession *session);
+
+// Must be set before the first swp_session_process(). The session then
+// sends through the transport and never touches its socket, which may be
+// -1; datagrams reach it through swp_session_input().
+int swp_session_set_transport(SwpSession *session, const SwpTransport *transport);
+
+void swp_session_free(SwpSession *session);
+
+void swp_session_get_stats(SwpSession *session, SwpStats *stats);
+
+int swp_session_fd(SwpSession *session);
+
+// The receiver's group socket, or -1. An external event loop polls it as
+// well as swp_session_fd().
+int swp_session_group_fd(SwpSession *session);
+
+// Paths of a sender, or sockets of a receiver, counting the session's own
+// as path 0. An external event loop polls the socket of each.
+int swp_session_paths(SwpSession *session);
+
+int swp_session_path_fd(SwpSession *session, int path);
+
+int swp_session_path_stats(SwpSession *session, int path, SwpPathStats *stats);
+
+// True while the reader returned EAGAIN or the sink could not take more. An
+// external event loop should then also wait for its source to be readable
+// or its sink writable.
+bool swp_session_input_blocked(SwpSession *session);
+
+bool swp_session_output_blocked(SwpSession *session);
+
+// Milliseconds until the session next needs swp_session_process(), or -1 if
+// it only needs to run when the socket becomes readable.
+int swp_session_timeout(SwpSession *session);
+
+// Hands a session with a transport one datagram that arrived from `from`.
+// Call swp_session_process() after a batch of these to act on them.
+int swp_session_input(SwpSession *session, const void *buf, size_t len,
+        const struct sockaddr_in *from);
+
+// Like swp_session_timeout(), but as an absolute time on the session's
+// clock in microseconds: UINT64_MAX if there is nothing to wait for, and no
+// later than now once the session has finished.
+uint64_t swp_session_deadline(SwpSession *session);
+
+// Drains the socket, services timers and sends whatever the window allows.
+// Never blocks. Returns SWP_AGAIN, SWP_DONE or SWP_ERROR.
+int swp_session_process(SwpSession *session);
+
+// True once the receiver has delivered every byte to its sink. The session
+// keeps answering retransmitted terminals until swp_session_process()
+// returns SWP_DONE.
+bool swp_session_complete(SwpSession *session);
+
+// Blocking convenience loop around poll() and swp_session_process().
+int swp_session_run(SwpSession *session);
+
+#endif
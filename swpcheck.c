@@ -0,0 +1,1083 @@
+/*
+ * Checks of the parsers that read untrusted network data: tree records,
+ * fed to the receiver's tree writer, zero ranges, fed to a receiver
+ * session, deduplicated batches, fed to the dedup writer, and sealed
+ * datagrams, fed to aead_open() and to a keyed session. Each check builds
+ * its input by hand, well formed or not, and feeds it in as a hostile
+ * sender could: truncated, oversized, or aimed outside the receiver's root.
+ *
+ * `make check` builds this against the library sources with AddressSanitizer
+ * and UndefinedBehaviorSanitizer, so an overflow aborts the run even where
+ * the parser's answer looks right. The exit status is 1 if any check fails.
+ *
+ * Usage: swpcheck [-v]
+ *
+ * -v lets stderr through: the library's complaints about bad input, which
+ * most checks provoke on purpose, and any sanitizer report.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <netinet/in.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include "aead.h"
+#include "dedup.h"
+#include "reliable_file.h"
+#include "swp.h"
+#include "tree.h"
+
+static int checks;
+static int failures;
+
+static void check(bool ok, const char *what) {
+    checks++;
+    if (!ok) {
+        failures++;
+        printf("swpcheck: FAILED: %s\n", what);
+    }
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+// A fresh directory under /tmp, and its removal.
+static void make_dir(char *dir) {
+    strcpy(dir, "/tmp/swpcheck.XXXXXX");
+    if (mkdtemp(dir) == NULL) {
+        perror("swpcheck");
+        exit(1);
+    }
+}
+
+static void remove_dir(const char *dir) {
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static bool dir_empty(const char *dir) {
+    DIR *list = opendir(dir);
+    if (list == NULL) {
+        return false;
+    }
+    int entries = 0;
+    struct dirent *entry;
+    while ((entry = readdir(list)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            entries++;
+        }
+    }
+    closedir(list);
+    return entries == 0;
+}
+
+/*
+ * Tree records
+ */
+
+typedef struct Stream {
+    unsigned char buf[256 * 1024];
+    size_t len;
+} Stream;
+
+static void put_bytes(Stream *stream, const void *data, size_t len) {
+    if (len > 0) {
+        memcpy(stream->buf + stream->len, data, len);
+        stream->len += len;
+    }
+}
+
+// One record: header, path, then content, with the sizes given. path_len
+// and size may disagree with what follows, as a hostile sender's would.
+static void put_record(Stream *stream, uint32_t mode, uint32_t path_len,
+        const char *path, uint64_t size, const void *content, size_t content_len) {
+    TreeRecord record;
+    memset(&record, 0, sizeof(record));
+    record.mode = mode;
+    record.path_len = path_len;
+    record.size = size;
+    put_bytes(stream, &record, sizeof(record));
+    put_bytes(stream, path, strlen(path));
+    put_bytes(stream, content, content_len);
+}
+
+static void put_entry(Stream *stream, uint32_t mode, const char *path, const char *content) {
+    size_t len = content != NULL ? strlen(content) : 0;
+    put_record(stream, mode, strlen(path), path, len, content, len);
+}
+
+// Feeds the stream to a writer on root, step bytes at a time, and
+// finishes it. Returns 0 if every write and the finish succeeded.
+static int feed_tree(const char *root, Stream *stream, size_t step) {
+    TreeWriter *writer = tree_writer_new(root);
+    if (writer == NULL) {
+        return -1;
+    }
+    int status = 0;
+    size_t pos = 0;
+    while (pos < stream->len) {
+        size_t n = stream->len - pos < step ? stream->len - pos : step;
+        ssize_t used = tree_writer_write(writer, stream->buf + pos, n);
+        if (used <= 0) {
+            status = -1;
+            break;
+        }
+        pos += used;
+    }
+    if (tree_writer_finish(writer) < 0) {
+        status = -1;
+    }
+    tree_writer_free(writer);
+    return status;
+}
+
+static void check_tree_valid(void) {
+    char root[PATH_MAX];
+    static Stream stream;
+    stream.len = 0;
+    put_entry(&stream, S_IFDIR | 0755, "a", NULL);
+    put_entry(&stream, S_IFDIR | 0500, "a/b", NULL);
+    put_entry(&stream, S_IFREG | 0644, "a/b/file", "hello");
+    put_entry(&stream, S_IFREG | 0600, "empty", "");
+    put_entry(&stream, S_IFLNK | 0777, "link", "a/b/file");
+
+    size_t steps[] = { 1, 7, sizeof(stream.buf) };
+    for (size_t idx = 0; idx < sizeof(steps) / sizeof(steps[0]); idx++) {
+        make_dir(root);
+        check(feed_tree(root, &stream, steps[idx]) == 0, "tree: well-formed stream");
+
+        char path[PATH_MAX + 16], content[16] = { 0 };
+        snprintf(path, sizeof(path), "%s/link", root);
+        int fd = open(path, O_RDONLY);
+        check(fd >= 0 && read(fd, content, sizeof(content)) == 5
+                && strcmp(content, "hello") == 0, "tree: file reached through its link");
+        if (fd >= 0) {
+            close(fd);
+        }
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/a/b", root);
+        check(stat(path, &st) == 0 && (st.st_mode & 07777) == 0500,
+                "tree: directory mode applied at the end");
+        chmod(path, 0700);
+        remove_dir(root);
+    }
+}
+
+// Streams the writer must refuse, leaving nothing behind.
+static void check_tree_rejects(void) {
+    static const char *bad_paths[] = {
+        "/etc/passwd", "../escape", "a/../../escape", "a//b", "./a", "a/.", "a/",
+    };
+    char root[PATH_MAX];
+    static Stream stream;
+
+    for (size_t idx = 0; idx < sizeof(bad_paths) / sizeof(bad_paths[0]); idx++) {
+        make_dir(root);
+        stream.len = 0;
+        put_entry(&stream, S_IFREG | 0644, bad_paths[idx], "x");
+        check(feed_tree(root, &stream, sizeof(stream.buf)) < 0, bad_paths[idx]);
+        check(dir_empty(root), "tree: nothing created for a bad path");
+        remove_dir(root);
+    }
+
+    struct {
+        const char *what;
+        uint32_t mode;
+        uint32_t path_len;
+        uint64_t size;
+    } bad_records[] = {
+        { "tree: empty path", S_IFREG | 0644, 0, 0 },
+        { "tree: path longer than PATH_MAX", S_IFREG | 0644, PATH_MAX, 0 },
+        { "tree: path length near 2^32", S_IFREG | 0644, UINT32_MAX, 0 },
+        { "tree: directory with content", S_IFDIR | 0755, 1, 3 },
+        { "tree: symlink target longer than PATH_MAX", S_IFLNK | 0777, 1, PATH_MAX },
+        { "tree: symlink target near 2^64", S_IFLNK | 0777, 1, UINT64_MAX },
+        { "tree: device node", S_IFCHR | 0644, 1, 0 },
+        { "tree: fifo", S_IFIFO | 0644, 1, 0 },
+    };
+    for (size_t idx = 0; idx < sizeof(bad_records) / sizeof(bad_records[0]); idx++) {
+        make_dir(root);
+        stream.len = 0;
+        put_record(&stream, bad_records[idx].mode, bad_records[idx].path_len, "x",
+                bad_records[idx].size, "abc", 3);
+        check(feed_tree(root, &stream, sizeof(stream.buf)) < 0, bad_records[idx].what);
+        remove_dir(root);
+    }
+}
+
+// A stream cut short inside a record must fail at the finish, not before.
+// A cut between records leaves a shorter stream that is still whole.
+static void check_tree_truncated(void) {
+    char root[PATH_MAX];
+    static Stream stream;
+    size_t ends[3];
+    stream.len = 0;
+    put_entry(&stream, S_IFDIR | 0755, "d", NULL);
+    ends[0] = stream.len;
+    put_entry(&stream, S_IFREG | 0644, "d/f", "content");
+    ends[1] = stream.len;
+    put_entry(&stream, S_IFLNK | 0777, "l", "d/f");
+    ends[2] = stream.len;
+    size_t full = stream.len;
+
+    bool all_failed = true;
+    for (size_t cut = 1; cut < full; cut++) {
+        if (cut == ends[0] || cut == ends[1] || cut == ends[2]) {
+            continue;
+        }
+        make_dir(root);
+        stream.len = cut;
+        TreeWriter *writer = tree_writer_new(root);
+        ssize_t used = tree_writer_write(writer, stream.buf, cut);
+        if (used != (ssize_t)cut || tree_writer_finish(writer) == 0) {
+            all_failed = false;
+        }
+        tree_writer_free(writer);
+        remove_dir(root);
+    }
+    check(all_failed, "tree: every truncation fails at the finish");
+
+    // A file that claims more content than ever arrives.
+    make_dir(root);
+    stream.len = 0;
+    put_record(&stream, S_IFREG | 0644, 1, "f", UINT64_MAX, "abc", 3);
+    check(feed_tree(root, &stream, sizeof(stream.buf)) < 0, "tree: file size near 2^64");
+    remove_dir(root);
+}
+
+// Links already under the root, or created by the stream, must not carry
+// a write outside it.
+static void check_tree_symlinks(void) {
+    char root[PATH_MAX], outside[PATH_MAX], path[PATH_MAX + 16];
+    static Stream stream;
+
+    make_dir(root);
+    make_dir(outside);
+    snprintf(path, sizeof(path), "%s/sub", root);
+    check(symlink(outside, path) == 0, "tree: planting a link");
+    stream.len = 0;
+    put_entry(&stream, S_IFREG | 0644, "sub/file", "x");
+    check(feed_tree(root, &stream, sizeof(stream.buf)) < 0,
+            "tree: file through a link already in the root");
+    stream.len = 0;
+    put_entry(&stream, S_IFDIR | 0755, "sub", NULL);
+    put_entry(&stream, S_IFDIR | 0700, "sub/d", NULL);
+    check(feed_tree(root, &stream, sizeof(stream.buf)) < 0,
+            "tree: directory over a link already in the root");
+    stream.len = 0;
+    put_entry(&stream, S_IFREG | 0644, "sub", "x");
+    check(feed_tree(root, &stream, sizeof(stream.buf)) < 0,
+            "tree: file over a link already in the root");
+    check(dir_empty(outside), "tree: nothing written outside the root");
+    remove_dir(root);
+
+    // The stream's own links are created last, so nothing passes through them.
+    make_dir(root);
+    stream.len = 0;
+    put_entry(&stream, S_IFLNK | 0777, "lnk", outside);
+    put_entry(&stream, S_IFREG | 0644, "lnk/file", "x");
+    check(feed_tree(root, &stream, sizeof(stream.buf)) < 0,
+            "tree: file through a link from the stream");
+    check(dir_empty(outside), "tree: nothing written through the stream's link");
+    remove_dir(root);
+    remove_dir(outside);
+}
+
+/*
+ * Receiver sessions
+ */
+
+// A receiver session fed crafted datagrams, sealed if it has a key,
+// through a transport that keeps only its latest ack. The sink counts
+// what it is given.
+typedef struct Receiver {
+    SwpSession *session;
+    Aead *seal;         // The sender's side of the key, or NULL.
+    unsigned char sent[DATAGRAM_SIZE];
+    size_t sent_len;
+    uint64_t written;
+    uint64_t skipped;
+    uint64_t nonzero;   // Of the bytes written, those that were not zero.
+} Receiver;
+
+static ssize_t keep_send(void *ctx, const void *buf, size_t len, const struct sockaddr_in *to) {
+    Receiver *receiver = ctx;
+    memcpy(receiver->sent, buf, len);
+    receiver->sent_len = len;
+    return len;
+}
+
+static uint64_t fixed_now(void *ctx) {
+    return 1;
+}
+
+static int accept_open(void *ctx, const char *subdir, const char *filename) {
+    return 0;
+}
+
+static ssize_t count_write(void *ctx, const void *buf, size_t len) {
+    Receiver *receiver = ctx;
+    for (size_t idx = 0; idx < len; idx++) {
+        receiver->nonzero += ((const unsigned char *)buf)[idx] != 0;
+    }
+    receiver->written += len;
+    return len;
+}
+
+static int count_skip(void *ctx, uint64_t len) {
+    Receiver *receiver = ctx;
+    receiver->skipped += len;
+    return 0;
+}
+
+static int send_datagram(Receiver *receiver, const void *buf, size_t len) {
+    struct sockaddr_in from;
+    memset(&from, 0, sizeof(from));
+    from.sin_family = AF_INET;
+    return swp_session_input(receiver->session, buf, len, &from);
+}
+
+static void send_packet(Receiver *receiver, enum PacketType type, int16_t seq,
+        int64_t offset, const void *payload, size_t len) {
+    unsigned char buf[DATAGRAM_SIZE];
+    Packet packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.header.length = sizeof(packet.header) + len;
+    packet.header.offset = offset;
+    packet.header.type = type;
+    packet.header.ack_num = seq;
+    packet.header.sack_num = -1;
+    packet.data = (void *)payload;
+    ssize_t sealed = fill_send_buffer(buf, packet, receiver->seal);
+    send_datagram(receiver, buf, sealed);
+}
+
+static void send_zeros(Receiver *receiver, int16_t seq, int64_t offset, uint64_t run) {
+    send_packet(receiver, Zeros, seq, offset, &run, sizeof(run));
+}
+
+static void send_terminal(Receiver *receiver, int16_t seq, int64_t offset) {
+    send_packet(receiver, Terminal, seq, offset, "", 1);
+}
+
+// A receiver with no sink yet. key, if not NULL, seals both directions.
+static void receiver_start(Receiver *receiver, const unsigned char *key) {
+    memset(receiver, 0, sizeof(*receiver));
+    receiver->session = swp_receiver_new(-1);
+    SwpTransport transport = { keep_send, fixed_now, receiver, 1 };
+    swp_session_set_transport(receiver->session, &transport);
+    if (key != NULL) {
+        swp_session_set_key(receiver->session, key, SwpCipherAuto);
+        receiver->seal = aead_new(key, SwpCipherAuto);
+    }
+}
+
+// Takes the receiver through the handshake, to expect data from sequence
+// number 0.
+static void receiver_handshake(Receiver *receiver) {
+    send_packet(receiver, FileSubdir, 8, 0, "d", 1);
+    send_packet(receiver, Filename, -1, 0, "f", 1);
+    swp_session_process(receiver->session);
+}
+
+// A receiver past the handshake whose sink counts what it is given.
+static void receiver_open(Receiver *receiver, bool skip, const unsigned char *key) {
+    receiver_start(receiver, key);
+    swp_receiver_set_sink(receiver->session, accept_open, count_write, receiver);
+    if (skip) {
+        swp_receiver_set_skip(receiver->session, count_skip);
+    }
+    receiver_handshake(receiver);
+}
+
+static void receiver_close(Receiver *receiver) {
+    swp_session_free(receiver->session);
+    aead_free(receiver->seal);
+}
+
+/*
+ * Finishing the output
+ */
+
+static int finish_tree(void *ctx) {
+    return tree_writer_finish(ctx);
+}
+
+static enum PacketType sent_type(Receiver *receiver) {
+    Header head;
+    memcpy(&head, receiver->sent, sizeof(head));
+    return head.type;
+}
+
+// A tree that cannot be finished fails the transfer before the terminal is
+// acked, and the sender is told.
+static void check_tree_finish(void) {
+    char root[PATH_MAX];
+    static Stream stream;
+    stream.len = 0;
+    put_entry(&stream, S_IFDIR | 0755, "d", NULL);
+    put_entry(&stream, S_IFREG | 0644, "d/f", "content");
+    size_t full = stream.len;
+
+    for (int cut = 0; cut <= 1; cut++) {
+        size_t len = cut ? full - 1 : full;
+        make_dir(root);
+        TreeWriter *writer = tree_writer_new(root);
+        Receiver receiver;
+        receiver_start(&receiver, NULL);
+        swp_receiver_set_sink(receiver.session, accept_open, tree_writer_write, writer);
+        swp_receiver_set_finish(receiver.session, finish_tree);
+        receiver_handshake(&receiver);
+        send_packet(&receiver, Data, 0, 0, stream.buf, len);
+        send_terminal(&receiver, 1, len);
+        int status = swp_session_process(receiver.session);
+        if (cut) {
+            check(status == SWP_ERROR && sent_type(&receiver) == Leave,
+                    "finish: truncated tree fails and tells the sender");
+        } else {
+            check(swp_session_complete(receiver.session) && sent_type(&receiver) == Terminal,
+                    "finish: whole tree acked");
+        }
+        receiver_close(&receiver);
+        tree_writer_free(writer);
+        remove_dir(root);
+    }
+}
+
+// A sender told that the receiver failed fails as well.
+static void check_sender_leave(void) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    Receiver sender;
+    memset(&sender, 0, sizeof(sender));
+    sender.session = swp_sender_new(-1, &addr, "d", "f");
+    SwpTransport transport = { keep_send, fixed_now, &sender, 1 };
+    swp_session_set_transport(sender.session, &transport);
+    swp_sender_set_buffer(sender.session, "abc", 3);
+    int64_t unused = 0;     // Control packets carry a word of payload.
+
+    swp_session_process(sender.session);
+    send_packet(&sender, Ack, -1, FileSubdir, &unused, sizeof(unused));
+    swp_session_process(sender.session);
+    send_packet(&sender, Ack, -1, Filename, &unused, sizeof(unused));
+    check(swp_session_process(sender.session) == SWP_AGAIN && sent_type(&sender) == Terminal,
+            "finish: sender awaits the terminal's ack");
+    send_packet(&sender, Leave, -1, 0, &unused, sizeof(unused));
+    check(swp_session_process(sender.session) == SWP_ERROR, "finish: sender fails on a Leave");
+    receiver_close(&sender);
+}
+
+/*
+ * Zero ranges
+ */
+
+static void check_zeros(void) {
+    Receiver receiver;
+    SwpStats stats;
+
+    // A range around two pieces of data, skipped or written out.
+    for (int skip = 0; skip <= 1; skip++) {
+        receiver_open(&receiver, skip, NULL);
+        send_packet(&receiver, Data, 0, 0, "abc", 3);
+        send_zeros(&receiver, 1, 3, 100000);
+        send_packet(&receiver, Data, 2, 100003, "xyz", 3);
+        send_terminal(&receiver, 3, 100006);
+        swp_session_process(receiver.session);
+        swp_session_get_stats(receiver.session, &stats);
+        check(swp_session_complete(receiver.session), "zeros: transfer completes");
+        check(receiver.written + receiver.skipped == 100006, "zeros: every byte delivered");
+        check(receiver.nonzero == 6, "zeros: range written as zeros");
+        check(receiver.skipped == (skip ? 100000 : 0), "zeros: range skipped if the sink can");
+        check(stats.zero_bytes == 100000, "zeros: range counted");
+        receiver_close(&receiver);
+    }
+
+    // A payload that is not exactly one length is ignored.
+    size_t bad_lens[] = { 0, 4, 7, 9, 16 };
+    for (size_t idx = 0; idx < sizeof(bad_lens) / sizeof(bad_lens[0]); idx++) {
+        unsigned char payload[16];
+        memset(payload, 0xff, sizeof(payload));
+        receiver_open(&receiver, true, NULL);
+        send_packet(&receiver, Zeros, 0, 0, payload, bad_lens[idx]);
+        swp_session_process(receiver.session);
+        swp_session_get_stats(receiver.session, &stats);
+        check(receiver.skipped == 0 && stats.zero_bytes == 0,
+                "zeros: payload of the wrong length ignored");
+        receiver_close(&receiver);
+    }
+
+    // A range behind what has been delivered is a stale duplicate.
+    receiver_open(&receiver, true, NULL);
+    send_packet(&receiver, Data, 0, 0, "abc", 3);
+    send_zeros(&receiver, 1, 0, 1000);
+    swp_session_process(receiver.session);
+    check(receiver.skipped == 0, "zeros: range behind the stream ignored");
+    receiver_close(&receiver);
+
+    // Ranges that would take the stream past 2^63 bytes fail the session
+    // before the sink sees them, whether the sink skips or writes.
+    for (int skip = 0; skip <= 1; skip++) {
+        receiver_open(&receiver, skip, NULL);
+        send_zeros(&receiver, 0, 0, UINT64_MAX);
+        check(swp_session_process(receiver.session) == SWP_ERROR,
+                "zeros: range near 2^64 fails the session");
+        check(receiver.written == 0 && receiver.skipped == 0,
+                "zeros: range near 2^64 not delivered");
+        receiver_close(&receiver);
+    }
+    receiver_open(&receiver, true, NULL);
+    send_zeros(&receiver, 0, 0, INT64_MAX);
+    send_packet(&receiver, Data, 1, INT64_MAX, "abc", 3);
+    check(swp_session_process(receiver.session) == SWP_ERROR,
+            "zeros: data past 2^63 fails the session");
+    check(receiver.written == 0, "zeros: data past 2^63 not delivered");
+    receiver_close(&receiver);
+}
+
+// A file sink gets its zero ranges where they belong, as holes or, when it
+// is open for appending, as zeros written after what it already held.
+static void check_zeros_fd(void) {
+    char dir[PATH_MAX], path[PATH_MAX + 16];
+    static unsigned char expect[8192], got[sizeof(expect) + 1];
+    make_dir(dir);
+    snprintf(path, sizeof(path), "%s/out", dir);
+
+    for (int append = 0; append <= 1; append++) {
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        size_t expect_len = 0;
+        if (append) {
+            check(write(fd, "head", 4) == 4, "zeros: file written before the transfer");
+            close(fd);
+            fd = open(path, O_RDWR | O_APPEND);
+            memcpy(expect, "head", 4);
+            expect_len = 4;
+        }
+        memcpy(expect + expect_len, "abc", 3);
+        memset(expect + expect_len + 3, 0, 5000);
+        memcpy(expect + expect_len + 5003, "xyz", 3);
+        memset(expect + expect_len + 5006, 0, 1000);
+        expect_len += 6006;
+
+        Receiver receiver;
+        receiver_start(&receiver, NULL);
+        swp_receiver_set_fd_sink(receiver.session, fd);
+        receiver_handshake(&receiver);
+        send_packet(&receiver, Data, 0, 0, "abc", 3);
+        send_zeros(&receiver, 1, 3, 5000);
+        send_packet(&receiver, Data, 2, 5003, "xyz", 3);
+        send_zeros(&receiver, 3, 5006, 1000);
+        send_terminal(&receiver, 4, 6006);
+        swp_session_process(receiver.session);
+        check(swp_session_complete(receiver.session), "zeros: transfer to a file completes");
+        receiver_close(&receiver);
+        close(fd);
+
+        fd = open(path, O_RDONLY);
+        ssize_t len = read(fd, got, sizeof(got));
+        close(fd);
+        check(len == (ssize_t)expect_len && memcmp(got, expect, expect_len) == 0,
+                append ? "zeros: file open for appending gets zeros in place"
+                : "zeros: file gets holes in place");
+    }
+    remove_dir(dir);
+}
+
+/*
+ * Deduplicated batches
+ */
+
+// The batch layouts private to dedup.c.
+#define BATCH_MAGIC 0x50554444
+
+typedef struct BatchHeader {
+    uint32_t magic;
+    uint32_t id;
+    uint32_t count;
+} BatchHeader;
+
+typedef struct ChunkRef {
+    unsigned char hash[DEDUP_HASH_SIZE];
+    uint32_t len;
+} ChunkRef;
+
+// A reader and a writer joined back to back, the writer's bitmaps going
+// straight to the reader.
+typedef struct DedupPipe {
+    const unsigned char *src;
+    size_t src_len;
+    size_t src_pos;
+    unsigned char *out;
+    size_t out_len;
+    size_t out_max;
+    uint32_t need_id;
+    unsigned char need[DEDUP_BATCH_CHUNKS / 8];
+    size_t need_len;
+    bool need_ready;
+} DedupPipe;
+
+static ssize_t pipe_read(void *ctx, void *buf, size_t len) {
+    DedupPipe *pipe = ctx;
+    size_t n = pipe->src_len - pipe->src_pos < len ? pipe->src_len - pipe->src_pos : len;
+    memcpy(buf, pipe->src + pipe->src_pos, n);
+    pipe->src_pos += n;
+    return n;
+}
+
+static void pipe_await(void *ctx, uint32_t id) {
+}
+
+static void pipe_need(void *ctx, uint32_t id, const void *bitmap, size_t len) {
+    DedupPipe *pipe = ctx;
+    pipe->need_id = id;
+    pipe->need_len = len < sizeof(pipe->need) ? len : sizeof(pipe->need);
+    memcpy(pipe->need, bitmap, pipe->need_len);
+    pipe->need_ready = true;
+}
+
+static ssize_t pipe_write(void *ctx, const void *buf, size_t len) {
+    DedupPipe *pipe = ctx;
+    if (len > pipe->out_max - pipe->out_len) {
+        errno = ENOSPC;
+        return -1;
+    }
+    memcpy(pipe->out + pipe->out_len, buf, len);
+    pipe->out_len += len;
+    return len;
+}
+
+// Feeds bytes to the writer step at a time. Returns 0 if it took them all,
+// or -1 as soon as it refuses any.
+static int feed_dedup(DedupWriter *writer, const unsigned char *buf, size_t len, size_t step) {
+    size_t pos = 0;
+    while (pos < len) {
+        size_t n = len - pos < step ? len - pos : step;
+        ssize_t used = dedup_writer_write(writer, buf + pos, n);
+        if (used <= 0) {
+            return -1;
+        }
+        pos += used;
+    }
+    return 0;
+}
+
+// Sends src through a reader and a writer on store. Returns 0 if the
+// writer rebuilt it exactly.
+static int dedup_round_trip(const unsigned char *src, size_t len, ChunkStore *store,
+        size_t step, DedupStats *stats) {
+    DedupPipe pipe;
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.src = src;
+    pipe.src_len = len;
+    pipe.out_max = len;
+    pipe.out = malloc(len);
+    DedupReader *reader = dedup_reader_new(pipe_read, &pipe, pipe_await, &pipe);
+    DedupWriter *writer = dedup_writer_new(store, pipe_write, &pipe, pipe_need, &pipe);
+
+    int status = 0;
+    unsigned char buf[PACKET_SIZE];
+    while (status == 0) {
+        ssize_t n = dedup_reader_read(reader, buf, sizeof(buf));
+        if (n > 0) {
+            status = feed_dedup(writer, buf, n, step);
+        } else if (n == 0) {
+            break;
+        } else if (errno == EAGAIN && pipe.need_ready) {
+            pipe.need_ready = false;
+            if (!dedup_reader_need(reader, pipe.need_id, pipe.need, pipe.need_len)) {
+                status = -1;
+            }
+        } else {
+            status = -1;
+        }
+    }
+    if (status == 0 && (dedup_writer_flush(writer) < 0 || pipe.out_len != len
+                || memcmp(pipe.out, src, len) != 0)) {
+        status = -1;
+    }
+    dedup_writer_get_stats(writer, stats);
+    dedup_writer_free(writer);
+    dedup_reader_free(reader);
+    free(pipe.out);
+    return status;
+}
+
+static void put_batch(Stream *stream, uint32_t magic, uint32_t count) {
+    BatchHeader head = { magic, 1, count };
+    put_bytes(stream, &head, sizeof(head));
+}
+
+static void put_ref(Stream *stream, const void *data, uint32_t len) {
+    ChunkRef ref;
+    memset(&ref, 0, sizeof(ref));
+    SHA256(data, len, ref.hash);
+    ref.len = len;
+    put_bytes(stream, &ref, sizeof(ref));
+}
+
+// Feeds a hand-built stream to a fresh writer with no store and finishes
+// it. Returns 0 if the writer took it all and the stream was whole.
+static int feed_batches(Stream *stream, size_t step) {
+    DedupPipe pipe;
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.out_max = sizeof(stream->buf);
+    pipe.out = malloc(pipe.out_max);
+    DedupWriter *writer = dedup_writer_new(NULL, pipe_write, &pipe, pipe_need, &pipe);
+    int status = feed_dedup(writer, stream->buf, stream->len, step);
+    if (status == 0 && dedup_writer_flush(writer) < 0) {
+        status = -1;
+    }
+    dedup_writer_free(writer);
+    free(pipe.out);
+    return status;
+}
+
+static void check_dedup_round_trip(void) {
+    // Noise with a repeat in it, so that some chunks recur within the
+    // stream and the store catches the rest the second time round.
+    size_t len = 3 * DEDUP_BATCH_BYTES / 2;
+    unsigned char *src = malloc(len);
+    uint64_t state = 1;
+    for (size_t idx = 0; idx < len; idx++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        src[idx] = state >> 56;
+    }
+    memcpy(src + len / 2, src, len / 4);
+
+    char dir[PATH_MAX];
+    make_dir(dir);
+    ChunkStore *store = chunk_store_open(dir, 64 * 1024 * 1024);
+    DedupStats stats;
+    check(dedup_round_trip(src, len, NULL, PACKET_SIZE, &stats) == 0,
+            "dedup: stream rebuilt without a store");
+    check(stats.hits > 0, "dedup: repeats within the stream found");
+    check(dedup_round_trip(src, len, store, 1, &stats) == 0,
+            "dedup: stream rebuilt a byte at a time");
+    check(dedup_round_trip(src, len, store, 7, &stats) == 0
+            && stats.hits == stats.chunks, "dedup: stream rebuilt from the store");
+    chunk_store_close(store);
+    remove_dir(dir);
+    free(src);
+}
+
+// Headers and tables the writer must refuse before any chunk comes in.
+static void check_dedup_rejects(void) {
+    static Stream stream;
+    static unsigned char chunk[DEDUP_MAX_CHUNK + 1];
+
+    struct {
+        const char *what;
+        uint32_t magic;
+        uint32_t count;
+    } bad_heads[] = {
+        { "dedup: bad magic", BATCH_MAGIC ^ 1, 1 },
+        { "dedup: empty batch", BATCH_MAGIC, 0 },
+        { "dedup: batch of too many chunks", BATCH_MAGIC, DEDUP_BATCH_CHUNKS + 1 },
+        { "dedup: batch of 2^32 chunks", BATCH_MAGIC, UINT32_MAX },
+    };
+    for (size_t idx = 0; idx < sizeof(bad_heads) / sizeof(bad_heads[0]); idx++) {
+        stream.len = 0;
+        put_batch(&stream, bad_heads[idx].magic, bad_heads[idx].count);
+        put_ref(&stream, "abc", 3);
+        put_bytes(&stream, "abc", 3);
+        check(feed_batches(&stream, sizeof(stream.buf)) < 0 && errno == EINVAL,
+                bad_heads[idx].what);
+    }
+
+    uint32_t bad_lens[] = { 0, DEDUP_MAX_CHUNK + 1, UINT32_MAX };
+    for (size_t idx = 0; idx < sizeof(bad_lens) / sizeof(bad_lens[0]); idx++) {
+        stream.len = 0;
+        put_batch(&stream, BATCH_MAGIC, 2);
+        put_ref(&stream, "abc", 3);
+        ChunkRef ref;
+        memset(&ref, 0, sizeof(ref));
+        ref.len = bad_lens[idx];
+        put_bytes(&stream, &ref, sizeof(ref));
+        check(feed_batches(&stream, sizeof(stream.buf)) < 0 && errno == EINVAL,
+                "dedup: bad chunk length");
+    }
+
+    // Full-sized chunks, one more than the batch buffer holds.
+    stream.len = 0;
+    uint32_t count = (DEDUP_BATCH_BYTES + DEDUP_MAX_CHUNK) / DEDUP_MAX_CHUNK + 1;
+    put_batch(&stream, BATCH_MAGIC, count);
+    for (uint32_t idx = 0; idx < count; idx++) {
+        chunk[0] = idx;
+        put_ref(&stream, chunk, DEDUP_MAX_CHUNK);
+    }
+    check(feed_batches(&stream, sizeof(stream.buf)) < 0 && errno == EINVAL,
+            "dedup: batch larger than the buffer");
+
+    stream.len = 0;
+    put_batch(&stream, BATCH_MAGIC, 1);
+    put_ref(&stream, "abc", 3);
+    put_bytes(&stream, "abd", 3);
+    check(feed_batches(&stream, sizeof(stream.buf)) < 0 && errno == EINVAL,
+            "dedup: chunk that does not match its hash");
+}
+
+// A stream cut short anywhere but between batches must fail at the finish.
+static void check_dedup_truncated(void) {
+    static Stream stream;
+    stream.len = 0;
+    put_batch(&stream, BATCH_MAGIC, 3);
+    put_ref(&stream, "first", 5);
+    put_ref(&stream, "second", 6);
+    put_ref(&stream, "first", 5);
+    put_bytes(&stream, "first", 5);
+    put_bytes(&stream, "second", 6);
+    size_t end = stream.len;
+    put_batch(&stream, BATCH_MAGIC, 1);
+    put_ref(&stream, "third", 5);
+    put_bytes(&stream, "third", 5);
+    size_t full = stream.len;
+
+    bool all_failed = true;
+    for (size_t cut = 1; cut < full; cut++) {
+        if (cut == end) {
+            continue;
+        }
+        stream.len = cut;
+        if (feed_batches(&stream, 3) == 0 || errno != EINVAL) {
+            all_failed = false;
+        }
+    }
+    check(all_failed, "dedup: every truncation fails at the finish");
+    stream.len = full;
+    check(feed_batches(&stream, 3) == 0, "dedup: whole stream accepted");
+}
+
+// Bitmaps the reader must not take: for another batch, too short, or
+// before the table has gone out.
+static void check_dedup_bitmaps(void) {
+    static unsigned char src[64 * 1024];
+    memset(src, 'x', sizeof(src));
+    DedupPipe pipe;
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.src = src;
+    pipe.src_len = sizeof(src);
+    DedupReader *reader = dedup_reader_new(pipe_read, &pipe, pipe_await, &pipe);
+    unsigned char all[DEDUP_BATCH_CHUNKS / 8], buf[PACKET_SIZE];
+    memset(all, 0xff, sizeof(all));
+
+    check(!dedup_reader_need(reader, 1, all, sizeof(all)),
+            "dedup: bitmap before the table refused");
+    ssize_t n;
+    while ((n = dedup_reader_read(reader, buf, sizeof(buf))) > 0) {
+    }
+    check(n < 0 && errno == EAGAIN, "dedup: reader waits for the bitmap");
+    check(!dedup_reader_need(reader, 2, all, sizeof(all)),
+            "dedup: bitmap for another batch refused");
+    check(!dedup_reader_need(reader, 1, all, 0), "dedup: short bitmap refused");
+    check(dedup_reader_need(reader, 1, all, sizeof(all)), "dedup: bitmap taken");
+    dedup_reader_free(reader);
+}
+
+/*
+ * Sealed datagrams
+ */
+
+static const unsigned char test_key[AEAD_KEY_SIZE] = "swpcheck: a key of 32 bytes.....";
+
+// Seals len bytes of text into buf, which holds DATAGRAM_SIZE bytes.
+static size_t seal(Aead *aead, unsigned char *buf, const char *text, size_t len) {
+    memcpy(buf + AEAD_ENVELOPE_SIZE, text, len);
+    return aead_seal(aead, buf, len);
+}
+
+// Opens a copy of the datagram, leaving the original to be sent again.
+static ssize_t open_copy(Aead *aead, const unsigned char *buf, size_t len) {
+    unsigned char copy[DATAGRAM_SIZE];
+    memcpy(copy, buf, len);
+    return aead_open(aead, copy, len);
+}
+
+static void check_aead_cipher(enum SwpCipher cipher) {
+    unsigned char key2[AEAD_KEY_SIZE];
+    memcpy(key2, test_key, sizeof(key2));
+    key2[0] ^= 1;
+    Aead *sender = aead_new(test_key, cipher);
+    Aead *receiver = aead_new(test_key, SwpCipherAuto);
+    Aead *stranger = aead_new(key2, cipher);
+
+    unsigned char buf[DATAGRAM_SIZE], copy[DATAGRAM_SIZE];
+    size_t len = seal(sender, buf, "attack at dawn", 14);
+    check(len == 14 + AEAD_OVERHEAD, "aead: sealed length");
+
+    // Every cut and every flipped bit is refused, and none of them uses up
+    // the counter of the datagram they were made from.
+    bool all_failed = true;
+    for (size_t cut = 0; cut < len; cut++) {
+        if (open_copy(receiver, buf, cut) >= 0) {
+            all_failed = false;
+        }
+    }
+    check(all_failed, "aead: every truncation refused");
+    all_failed = true;
+    for (size_t pos = 0; pos < len; pos++) {
+        for (int bit = 0; bit < 8; bit++) {
+            memcpy(copy, buf, len);
+            copy[pos] ^= 1 << bit;
+            if (aead_open(receiver, copy, len) >= 0) {
+                all_failed = false;
+            }
+        }
+    }
+    check(all_failed, "aead: every flipped bit refused");
+    check(open_copy(stranger, buf, len) < 0, "aead: wrong key refused");
+    check(open_copy(sender, buf, len) < 0, "aead: own datagram refused");
+
+    memcpy(copy, buf, len);
+    check(aead_open(receiver, copy, len) == 14
+            && memcmp(copy + AEAD_ENVELOPE_SIZE, "attack at dawn", 14) == 0,
+            "aead: datagram opens after the forgeries");
+    check(open_copy(receiver, buf, len) < 0, "aead: replay refused");
+
+    // Later datagrams may arrive in any order inside the replay window,
+    // but once each.
+    static unsigned char sealed[1100][DATAGRAM_SIZE];
+    size_t lens[1100];
+    for (int idx = 0; idx < 1100; idx++) {
+        lens[idx] = seal(sender, sealed[idx], "x", 1);
+    }
+    bool all_opened = true;
+    for (int idx = 1099; idx >= 1099 - 1000; idx--) {
+        if (open_copy(receiver, sealed[idx], lens[idx]) != 1) {
+            all_opened = false;
+        }
+    }
+    check(all_opened, "aead: datagrams out of order inside the window");
+    all_failed = true;
+    for (int idx = 1099; idx >= 1099 - 1000; idx -= 100) {
+        if (open_copy(receiver, sealed[idx], lens[idx]) >= 0) {
+            all_failed = false;
+        }
+    }
+    check(all_failed, "aead: replays inside the window refused");
+    check(open_copy(receiver, sealed[0], lens[0]) < 0, "aead: datagram behind the window refused");
+    check(aead_rejected(receiver) == len + 8 * len + 11 + 1 + 1,
+            "aead: refusals counted");
+
+    aead_free(stranger);
+    aead_free(receiver);
+    aead_free(sender);
+}
+
+// The parser in front of the window slots, with and without a key.
+static void check_datagrams(void) {
+    unsigned char buf[DATAGRAM_SIZE];
+    Packet packet;
+    Header head;
+    memset(&head, 0, sizeof(head));
+    head.type = Data;
+    memset(buf, 'x', sizeof(buf));
+
+    size_t lens[] = { 0, sizeof(head), PACKET_SIZE + 1, DATAGRAM_SIZE };
+    for (size_t idx = 0; idx < sizeof(lens) / sizeof(lens[0]); idx++) {
+        head.length = lens[idx];
+        memcpy(buf, &head, sizeof(head));
+        check(process_recv_data(buf, lens[idx], &packet, NULL) < 0,
+                "datagram: empty or longer than a packet refused");
+    }
+    head.length = PACKET_SIZE;
+    memcpy(buf, &head, sizeof(head));
+    check(process_recv_data(buf, PACKET_SIZE, &packet, NULL) == 0,
+            "datagram: full packet taken");
+    check(process_recv_data(buf, PACKET_SIZE - 1, &packet, NULL) < 0,
+            "datagram: length that disagrees with the header refused");
+
+    // An unkeyed session takes no more than a packet; a keyed one takes a
+    // sealed packet, and nothing that is not sealed for it.
+    Receiver receiver;
+    SwpStats stats;
+    receiver_open(&receiver, false, NULL);
+    head.length = DATAGRAM_SIZE;
+    head.ack_num = 0;
+    memcpy(buf, &head, sizeof(head));
+    check(send_datagram(&receiver, buf, DATAGRAM_SIZE) < 0,
+            "datagram: unkeyed session refuses a sealed size");
+    static const unsigned char payload[PACKET_SIZE];
+    send_packet(&receiver, Data, 0, 0, payload, PACKET_SIZE - sizeof(head));
+    send_terminal(&receiver, 1, PACKET_SIZE - sizeof(head));
+    swp_session_process(receiver.session);
+    check(swp_session_complete(receiver.session)
+            && receiver.written == PACKET_SIZE - sizeof(head),
+            "datagram: full packet delivered");
+    check(swp_session_set_key(receiver.session, test_key, SwpCipherAuto) < 0,
+            "datagram: key refused after traffic");
+    receiver_close(&receiver);
+
+    receiver_open(&receiver, false, test_key);
+    send_packet(&receiver, Data, 0, 0, payload, PACKET_SIZE - sizeof(head));
+    swp_session_get_stats(receiver.session, &stats);
+    check(stats.auth_failures == 0 && receiver.sent_len > 0, "datagram: sealed packet taken");
+
+    Aead *plain = receiver.seal;
+    receiver.seal = NULL;
+    send_packet(&receiver, Data, 1, PACKET_SIZE - sizeof(head), "abc", 3);
+    receiver.seal = plain;
+    check(send_datagram(&receiver, receiver.sent, receiver.sent_len) == 0,
+            "datagram: reflected ack passed in");
+    unsigned char big[DATAGRAM_SIZE + 1];
+    memset(big, 0, sizeof(big));
+    check(send_datagram(&receiver, big, sizeof(big)) < 0,
+            "datagram: keyed session refuses more than a sealed packet");
+    swp_session_get_stats(receiver.session, &stats);
+    check(stats.auth_failures == 2, "datagram: unsealed and reflected datagrams dropped");
+    send_packet(&receiver, Data, 1, PACKET_SIZE - sizeof(head), "abc", 3);
+    send_terminal(&receiver, 2, PACKET_SIZE - sizeof(head) + 3);
+    swp_session_process(receiver.session);
+    check(swp_session_complete(receiver.session)
+            && receiver.written == PACKET_SIZE - sizeof(head) + 3,
+            "datagram: sealed transfer completes");
+    receiver_close(&receiver);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+        argc--;
+    } else if (freopen("/dev/null", "w", stderr) == NULL) {
+        perror("swpcheck");
+        return 1;
+    }
+    if (argc != 1) {
+        fprintf(stdout, "Usage: swpcheck [-v]\n");
+        return 1;
+    }
+
+    check_tree_valid();
+    check_tree_rejects();
+    check_tree_truncated();
+    check_tree_symlinks();
+    check_zeros();
+    check_zeros_fd();
+    check_tree_finish();
+    check_sender_leave();
+    check_dedup_round_trip();
+    check_dedup_rejects();
+    check_dedup_truncated();
+    check_dedup_bitmaps();
+    check_aead_cipher(SwpCipherAesGcm);
+    check_aead_cipher(SwpCipherChaCha);
+    check_datagrams();
+
+    printf("swpcheck: %d checks, %d failed.\n", checks, failures);
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,729 @@
+/*
+ * Deterministic discrete-event simulator for the protocol. A sender and a
+ * receiver session run on a virtual clock, joined by a simulated link with
+ * delay, jitter, bursty loss, reordering, a bottleneck rate with a
+ * drop-tail queue and, optionally, a slow sink. Nothing sleeps and no
+ * sockets are involved, so a transfer that takes minutes of virtual time
+ * runs in however long the sessions need to process its packets.
+ *
+ * Every random choice of a scenario, including its link parameters, comes
+ * from its seed, so any scenario replays exactly with -s <seed> -n 1.
+ * A scenario fails if the data arrives corrupted, a session gives up, or
+ * STALL_LIMIT_US of virtual time pass without the receiver delivering
+ * anything (or, once it has everything, without the sender finishing); the
+ * exit status is 1 if any did.
+ *
+ * With -p, the sender stripes the transfer over that many paths, each a
+ * link of its own with parameters drawn separately.
+ *
+ * Usage: swpsim [-n scenarios] [-s first_seed] [-b bytes[K|M|G]] [-p paths]
+ *               [-w window] [-l loss] [-d delay_us] [-r rate_mbps] [-a] [-v]
+ *
+ * -l, -d, -r and -w pin that parameter for every scenario; -l, -d and -r
+ * take a comma-separated value per path, the last covering the rest. -a
+ * prints every scenario rather than just failures; -v traces both sessions
+ * to stderr.
+ */
+
+#include <arpa/inet.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "reliable_file.h"
+#include "swp.h"
+
+// No delivery for this long is a stall. The retransmission timer backs off
+// to a minute, so this leaves room for a few tries at that.
+#define STALL_LIMIT_US 300000000ULL
+
+// The stream repeats with a prime period, so packet boundaries fall at a
+// different phase every time round.
+#define PATTERN_PERIOD 65521
+#define PATTERN_CHUNK 65536
+
+#define SENDER 0
+#define RECEIVER 1
+
+typedef struct Rng {
+    uint64_t state;
+} Rng;
+
+// splitmix64.
+static uint64_t rng_next(Rng *rng) {
+    uint64_t z = (rng->state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, 1).
+static double rng_unit(Rng *rng) {
+    return (rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Log-uniform in [lo, hi).
+static double rng_log(Rng *rng, double lo, double hi) {
+    return lo * exp(rng_unit(rng) * log(hi / lo));
+}
+
+typedef struct Params {
+    uint64_t delay_us;      // One way.
+    uint64_t jitter_us;     // Uniform extra delay up to this.
+    double loss;            // Long-run loss rate.
+    double burst;           // Mean length of a loss burst, in packets.
+    double reorder;         // Share of packets held back by reorder_us.
+    uint64_t reorder_us;
+    double rate_bps;        // Bottleneck rate, 0 for none.
+    uint64_t queue_bytes;   // Bottleneck queue before drop-tail.
+    double sink_bps;        // Receiver's sink rate, 0 for unlimited.
+    int window;
+} Params;
+
+// One direction of the link. Loss follows a Gilbert-Elliott chain that
+// drops everything in the bad state, with transitions picked so bursts
+// average `burst` packets and the loss rate comes out at `loss`. A burst
+// hits packets sent close together: one sent a round trip or more after
+// the last starts the chain afresh, so a sender backing off its timer
+// does not sit out a burst one packet per timeout.
+typedef struct Link {
+    double p_bad;           // Good to bad.
+    double p_good;          // Bad to good.
+    bool bad;
+    uint64_t last_sent;
+    uint64_t busy_until;    // When the bottleneck has sent what it holds.
+    uint64_t sent;
+    uint64_t dropped;
+} Link;
+
+typedef struct Event {
+    uint64_t at;
+    uint64_t serial;        // Ties go to the earlier send.
+    int node;
+    int path;
+    size_t len;
+    unsigned char data[DATAGRAM_SIZE];     // Room for a sealed packet.
+} Event;
+
+typedef struct Sim Sim;
+
+typedef struct Node {
+    Sim *sim;
+    int id;
+    SwpSession *session;
+    bool touched;           // Input arrived since it last ran.
+    int status;
+} Node;
+
+struct Sim {
+    Rng rng;
+    Params params[SWP_MAX_PATHS];   // Path 0 also holds the sink and window.
+    int npaths;
+    uint64_t now;
+    uint64_t serial;
+    Node nodes[2];
+    Link links[SWP_MAX_PATHS][2];   // Indexed by path and sending node.
+
+    Event *pool;            // Heap slots point into the pool.
+    size_t *heap;
+    size_t *free_list;
+    size_t nheap;
+    size_t nfree;
+    size_t cap;
+
+    const unsigned char *pattern;
+    uint64_t size;
+    uint64_t read_pos;
+    uint64_t write_pos;
+    bool corrupt;
+    uint64_t sink_ready;    // When the sink can take more.
+    uint64_t last_delivery;
+    uint64_t longest_stall;
+};
+
+static bool event_before(Sim *sim, size_t a, size_t b) {
+    Event *x = &(sim->pool[a]), *y = &(sim->pool[b]);
+    return x->at < y->at || (x->at == y->at && x->serial < y->serial);
+}
+
+static void heap_swap(Sim *sim, size_t i, size_t j) {
+    size_t tmp = sim->heap[i];
+    sim->heap[i] = sim->heap[j];
+    sim->heap[j] = tmp;
+}
+
+static Event *event_alloc(Sim *sim, size_t *slot) {
+    if (sim->nfree == 0) {
+        size_t cap = sim->cap ? 2 * sim->cap : 1024;
+        Event *pool = realloc(sim->pool, cap * sizeof(*pool));
+        size_t *heap = realloc(sim->heap, cap * sizeof(*heap));
+        size_t *free_list = realloc(sim->free_list, cap * sizeof(*free_list));
+        if (pool == NULL || heap == NULL || free_list == NULL) {
+            perror("swpsim");
+            exit(2);
+        }
+        sim->pool = pool;
+        sim->heap = heap;
+        sim->free_list = free_list;
+        for (size_t idx = cap; idx > sim->cap; idx--) {
+            sim->free_list[sim->nfree++] = idx - 1;
+        }
+        sim->cap = cap;
+    }
+    *slot = sim->free_list[--sim->nfree];
+    return &(sim->pool[*slot]);
+}
+
+static void heap_push(Sim *sim, size_t slot) {
+    size_t pos = sim->nheap++;
+    sim->heap[pos] = slot;
+    while (pos > 0 && event_before(sim, sim->heap[pos], sim->heap[(pos - 1) / 2])) {
+        heap_swap(sim, pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
+}
+
+static size_t heap_pop(Sim *sim) {
+    size_t top = sim->heap[0];
+    sim->heap[0] = sim->heap[--sim->nheap];
+    size_t pos = 0;
+    while (true) {
+        size_t least = pos, left = 2 * pos + 1, right = left + 1;
+        if (left < sim->nheap && event_before(sim, sim->heap[left], sim->heap[least])) {
+            least = left;
+        }
+        if (right < sim->nheap && event_before(sim, sim->heap[right], sim->heap[least])) {
+            least = right;
+        }
+        if (least == pos) {
+            break;
+        }
+        heap_swap(sim, pos, least);
+        pos = least;
+    }
+    return top;
+}
+
+/*
+ * Transport
+ */
+
+static uint64_t sim_now(void *ctx) {
+    Node *node = ctx;
+    return node->sim->now;
+}
+
+// Node id's address on a path: 10.0.<path>.<id + 1>.
+static struct sockaddr_in sim_addr(int path, int id) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x0a000001 + (path << 8) + id);
+    addr.sin_port = htons(9000 + id);
+    return addr;
+}
+
+// Puts a datagram on the link of the path it is addressed to: through the
+// loss chain, the bottleneck queue, and delay with jitter and the odd
+// reordering hold.
+static ssize_t sim_send(void *ctx, const void *buf, size_t len, const struct sockaddr_in *to) {
+    Node *node = ctx;
+    Sim *sim = node->sim;
+    int path = (ntohl(to->sin_addr.s_addr) >> 8) & 0xff;
+    // As a socket would, refuse what no datagram on the link could carry.
+    if (len > DATAGRAM_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (path >= sim->npaths) {
+        return len;
+    }
+    Params *params = &(sim->params[path]);
+    Link *link = &(sim->links[path][node->id]);
+    link->sent++;
+
+    if (sim->now - link->last_sent >= 2 * params->delay_us) {
+        link->bad = rng_unit(&(sim->rng)) < params->loss;
+    } else {
+        link->bad = link->bad ? rng_unit(&(sim->rng)) >= link->p_good
+            : rng_unit(&(sim->rng)) < link->p_bad;
+    }
+    link->last_sent = sim->now;
+    if (link->bad) {
+        link->dropped++;
+        return len;
+    }
+
+    uint64_t depart = sim->now;
+    if (params->rate_bps > 0) {
+        uint64_t start = link->busy_until > sim->now ? link->busy_until : sim->now;
+        uint64_t queued = (start - sim->now) * params->rate_bps / 8e6;
+        if (queued + len > params->queue_bytes) {
+            link->dropped++;
+            return len;
+        }
+        link->busy_until = start + (uint64_t)(len * 8e6 / params->rate_bps) + 1;
+        depart = link->busy_until;
+    }
+
+    uint64_t at = depart + params->delay_us;
+    if (params->jitter_us > 0) {
+        at += rng_next(&(sim->rng)) % params->jitter_us;
+    }
+    if (params->reorder > 0 && rng_unit(&(sim->rng)) < params->reorder) {
+        at += params->reorder_us;
+    }
+
+    size_t slot;
+    Event *event = event_alloc(sim, &slot);
+    event->at = at;
+    event->serial = sim->serial++;
+    event->node = 1 - node->id;
+    event->path = path;
+    event->len = len;
+    memcpy(event->data, buf, len);
+    heap_push(sim, slot);
+    return len;
+}
+
+/*
+ * Source and sink
+ */
+
+static ssize_t source_read(void *ctx, void *buf, size_t len) {
+    Sim *sim = ctx;
+    uint64_t left = sim->size - sim->read_pos;
+    if (len > left) {
+        len = left;
+    }
+    if (len > PATTERN_CHUNK) {
+        len = PATTERN_CHUNK;
+    }
+    memcpy(buf, sim->pattern + sim->read_pos % PATTERN_PERIOD, len);
+    sim->read_pos += len;
+    return len;
+}
+
+static int sink_open(void *ctx, const char *subdir, const char *filename) {
+    return 0;
+}
+
+// Checks the bytes against the pattern. A sink with a rate takes what it
+// has had time for since it last filled up, and pushes back on the rest.
+static ssize_t sink_write(void *ctx, const void *buf, size_t len) {
+    Sim *sim = ctx;
+    if (sim->params[0].sink_bps > 0) {
+        if (sim->now < sim->sink_ready) {
+            errno = EAGAIN;
+            return -1;
+        }
+        sim->sink_ready = sim->now + (uint64_t)(len * 8e6 / sim->params[0].sink_bps) + 1;
+    }
+
+    const unsigned char *ptr = buf;
+    size_t done = 0;
+    while (done < len) {
+        size_t run = len - done < PATTERN_CHUNK ? len - done : PATTERN_CHUNK;
+        if (sim->write_pos + run > sim->size
+                || memcmp(ptr + done, sim->pattern + sim->write_pos % PATTERN_PERIOD, run) != 0) {
+            sim->corrupt = true;
+        }
+        sim->write_pos += run;
+        done += run;
+    }
+
+    if (sim->now - sim->last_delivery > sim->longest_stall) {
+        sim->longest_stall = sim->now - sim->last_delivery;
+    }
+    sim->last_delivery = sim->now;
+    return len;
+}
+
+/*
+ * Scenarios
+ */
+
+// Draws the scenario's link from its seed. Every draw is made whatever the
+// overrides, so pinning one parameter leaves the others as they were.
+static void draw_params(Rng *rng, Params *params) {
+    static const int windows[] = { 8, 60, 256, 1024, 4096 };
+
+    params->delay_us = rng_log(rng, 50, 200000);
+    params->jitter_us = rng_unit(rng) < 0.5 ? 0 : rng_unit(rng) * params->delay_us / 2;
+    params->loss = rng_unit(rng) < 0.25 ? 0 : rng_log(rng, 0.0001, 0.2);
+    params->burst = rng_unit(rng) < 0.5 ? 1 : rng_log(rng, 1, 8);
+    params->reorder = rng_unit(rng) < 0.5 ? 0 : rng_log(rng, 0.001, 0.1);
+    params->reorder_us = params->delay_us + rng_next(rng) % (params->delay_us + 1);
+    params->rate_bps = rng_unit(rng) < 0.25 ? 0 : rng_log(rng, 1e6, 1e9);
+    params->queue_bytes = (uint64_t)rng_log(rng, 16, 1024) * PACKET_SIZE;
+    params->sink_bps = rng_unit(rng) < 0.875 ? 0 : rng_log(rng, 1e6, 1e8);
+    params->window = windows[rng_next(rng) % (sizeof(windows) / sizeof(windows[0]))];
+}
+
+static void link_init(Link *link, Params *params) {
+    memset(link, 0, sizeof(*link));
+    if (params->loss > 0) {
+        link->p_good = 1 / params->burst;
+        link->p_bad = params->loss * link->p_good / (1 - params->loss);
+    }
+}
+
+static void node_init(Sim *sim, int id, SwpSession *session, bool verbose) {
+    Node *node = &(sim->nodes[id]);
+    node->sim = sim;
+    node->id = id;
+    node->session = session;
+    node->status = SWP_AGAIN;
+    node->touched = true;   // Runs once at time zero to get going.
+
+    SwpTransport transport = { sim_send, sim_now, node, (unsigned int)rng_next(&(sim->rng)) };
+    swp_session_set_transport(session, &transport);
+    if (verbose) {
+        swp_session_set_log(session, stderr);
+    }
+}
+
+static void node_run(Sim *sim, Node *node) {
+    if (node->status == SWP_AGAIN) {
+        node->status = swp_session_process(node->session);
+    }
+    node->touched = false;
+}
+
+typedef struct Result {
+    bool ok;
+    const char *why;
+    uint64_t elapsed_us;
+    uint64_t longest_stall;
+    SwpStats stats;
+    SwpPathStats paths[SWP_MAX_PATHS];
+    uint64_t dropped;
+} Result;
+
+static void run_scenario(Params *params, int npaths, uint64_t seed, uint64_t size,
+        const unsigned char *pattern, bool verbose, Result *result) {
+    Sim sim;
+    memset(&sim, 0, sizeof(sim));
+    sim.rng.state = seed;
+    memcpy(sim.params, params, npaths * sizeof(*params));
+    sim.npaths = npaths;
+    sim.pattern = pattern;
+    sim.size = size;
+
+    struct sockaddr_in addr = sim_addr(0, RECEIVER);
+    SwpSession *sender = swp_sender_new(-1, &addr, "sim", "data");
+    SwpSession *receiver = swp_receiver_new(-1);
+    for (int path = 0; path < npaths; path++) {
+        link_init(&(sim.links[path][SENDER]), &(params[path]));
+        link_init(&(sim.links[path][RECEIVER]), &(params[path]));
+        addr = sim_addr(path, RECEIVER);
+        if (path > 0) {
+            swp_sender_add_path(sender, -1, &addr);
+        }
+    }
+    node_init(&sim, SENDER, sender, verbose);
+    node_init(&sim, RECEIVER, receiver, verbose);
+    swp_sender_set_window(sender, params->window);
+    swp_sender_set_reader(sender, source_read, &sim);
+    swp_receiver_set_sink(receiver, sink_open, sink_write, &sim);
+
+    memset(result, 0, sizeof(*result));
+    result->why = "ok";
+    while (true) {
+        Node *snd = &(sim.nodes[SENDER]), *rcv = &(sim.nodes[RECEIVER]);
+        if (snd->status == SWP_ERROR || rcv->status == SWP_ERROR) {
+            result->why = snd->status == SWP_ERROR ? "sender failed" : "receiver failed";
+            break;
+        }
+        if (snd->status == SWP_DONE && swp_session_complete(receiver)) {
+            break;
+        }
+
+        // Next event: a datagram landing, a session timer or the sink.
+        uint64_t next = UINT64_MAX;
+        if (sim.nheap > 0) {
+            next = sim.pool[sim.heap[0]].at;
+        }
+        for (int id = 0; id < 2; id++) {
+            uint64_t deadline = sim.nodes[id].status == SWP_AGAIN
+                ? swp_session_deadline(sim.nodes[id].session) : UINT64_MAX;
+            if (deadline < next) {
+                next = deadline;
+            }
+        }
+        if (swp_session_output_blocked(receiver) && sim.sink_ready < next) {
+            next = sim.sink_ready;
+        }
+        if (snd->touched || rcv->touched) {
+            next = sim.now;
+        } else if (next == UINT64_MAX) {
+            result->why = "deadlock";
+            break;
+        } else {
+            // A deadline that is already due and stays due must still move
+            // the clock on.
+            next = next > sim.now ? next : sim.now + 1;
+        }
+        sim.now = next;
+        if (sim.now - sim.last_delivery > STALL_LIMIT_US) {
+            result->why = sim.write_pos < size ? "stalled" : "sender hung";
+            break;
+        }
+
+        while (sim.nheap > 0 && sim.pool[sim.heap[0]].at <= sim.now) {
+            size_t slot = heap_pop(&sim);
+            Event *event = &(sim.pool[slot]);
+            Node *node = &(sim.nodes[event->node]);
+            struct sockaddr_in from = sim_addr(event->path, 1 - event->node);
+            swp_session_input(node->session, event->data, event->len, &from);
+            node->touched = true;
+            sim.free_list[sim.nfree++] = slot;
+        }
+        for (int id = 0; id < 2; id++) {
+            Node *node = &(sim.nodes[id]);
+            if (node->touched || swp_session_deadline(node->session) <= sim.now
+                    || (id == RECEIVER && swp_session_output_blocked(receiver)
+                        && sim.sink_ready <= sim.now)) {
+                node_run(&sim, node);
+            }
+        }
+    }
+
+    result->elapsed_us = sim.now;
+    result->longest_stall = sim.longest_stall;
+    for (int path = 0; path < npaths; path++) {
+        result->dropped += sim.links[path][SENDER].dropped + sim.links[path][RECEIVER].dropped;
+        swp_session_path_stats(sender, path, &(result->paths[path]));
+    }
+    swp_session_get_stats(sender, &(result->stats));
+    if (strcmp(result->why, "ok") == 0 && (sim.corrupt || sim.write_pos != size)) {
+        result->why = "corrupt";
+    }
+    result->ok = strcmp(result->why, "ok") == 0;
+
+    swp_session_free(sender);
+    swp_session_free(receiver);
+    free(sim.pool);
+    free(sim.heap);
+    free(sim.free_list);
+}
+
+static void print_scenario(uint64_t seed, Params *params, Result *result, uint64_t size) {
+    double secs = result->elapsed_us / 1e6;
+    printf("seed %-8" PRIu64 " %-15s %9.3fs %9.2f Mbit/s  stall %7.3fs  "
+            "delay %6.2fms jitter %6.2fms loss %6.4f burst %4.1f reorder %5.3f "
+            "rate %7.1f Mbit/s queue %4" PRIu64 " sink %5.1f window %4d  "
+            "retx %" PRIu64 " dropped %" PRIu64 "\n",
+            seed, result->why, secs, secs > 0 ? size * 8 / secs / 1e6 : 0,
+            result->longest_stall / 1e6, params->delay_us / 1e3, params->jitter_us / 1e3,
+            params->loss, params->burst, params->reorder, params->rate_bps / 1e6,
+            params->queue_bytes / PACKET_SIZE, params->sink_bps / 1e6, params->window,
+            result->stats.retransmits, result->dropped);
+}
+
+// Each path's link and its share of the traffic.
+static void print_paths(Params *params, int npaths, Result *result) {
+    for (int path = 0; path < npaths; path++) {
+        Params *link = &(params[path]);
+        SwpPathStats *stats = &(result->paths[path]);
+        printf("    path %d: delay %6.2fms jitter %6.2fms loss %6.4f burst %4.1f "
+                "reorder %5.3f rate %7.1f Mbit/s queue %4" PRIu64 "  sent %" PRIu64
+                " (%4.1f%%) retx %" PRIu64 " srtt %.2fms\n",
+                path, link->delay_us / 1e3, link->jitter_us / 1e3, link->loss, link->burst,
+                link->reorder, link->rate_bps / 1e6, link->queue_bytes / PACKET_SIZE,
+                stats->data_sent, result->stats.data_sent
+                    ? 100.0 * stats->data_sent / result->stats.data_sent : 0.0,
+                stats->retransmits, stats->srtt_us / 1e3);
+    }
+}
+
+// Parses one value per path, separated by commas; the last one also
+// covers the paths after it.
+static int parse_list(const char *arg, double *values) {
+    int count = 0;
+    while (true) {
+        char *end;
+        values[count++] = strtod(arg, &end);
+        if (end == arg || (*end != ',' && *end != '\0')
+                || (*end == ',' && count == SWP_MAX_PATHS)) {
+            return -1;
+        }
+        if (*end == '\0') {
+            break;
+        }
+        arg = end + 1;
+    }
+    for (; count < SWP_MAX_PATHS; count++) {
+        values[count] = values[count - 1];
+    }
+    return 0;
+}
+
+static int parse_size(const char *arg, uint64_t *size) {
+    char *end;
+    double value = strtod(arg, &end);
+    switch (*end) {
+        case 'G': value *= 1024;
+        // fall through
+        case 'M': value *= 1024;
+        // fall through
+        case 'K': value *= 1024;
+            end++;
+            break;
+    }
+    if (*end != '\0' || value <= 0) {
+        return -1;
+    }
+    *size = value;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    char *usage_str = "swpsim [-n scenarios] [-s first_seed] [-b bytes[K|M|G]] [-p paths] [-w window] [-l loss] [-d delay_us] [-r rate_mbps] [-a] [-v]";
+    uint64_t count = 100, first = 1, size = 1024 * 1024;
+    int window = 0, npaths = 1;
+    double loss[SWP_MAX_PATHS], delay[SWP_MAX_PATHS], rate[SWP_MAX_PATHS];
+    bool all = false, verbose = false;
+    for (int path = 0; path < SWP_MAX_PATHS; path++) {
+        loss[path] = delay[path] = rate[path] = -1;
+    }
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:b:p:w:l:d:r:av")) != -1) {
+        switch (opt) {
+            case 'n':
+                count = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                first = strtoull(optarg, NULL, 10);
+                break;
+            case 'b':
+                if (parse_size(optarg, &size) < 0) {
+                    fprintf(stderr, "Bad size: %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'p':
+                npaths = atoi(optarg);
+                if (npaths < 1 || npaths > SWP_MAX_PATHS) {
+                    fprintf(stderr, "Paths must be 1 to %d.\n", SWP_MAX_PATHS);
+                    return 2;
+                }
+                break;
+            case 'w':
+                window = atoi(optarg);
+                if (window < 1 || window > MAX_WINDOW_SIZE) {
+                    fprintf(stderr, "Window must be 1 to %d.\n", MAX_WINDOW_SIZE);
+                    return 2;
+                }
+                break;
+            case 'l':
+                if (parse_list(optarg, loss) < 0) {
+                    fprintf(stderr, "Bad loss: %s\n", optarg);
+                    return 2;
+                }
+                for (int path = 0; path < SWP_MAX_PATHS; path++) {
+                    if (loss[path] < 0 || loss[path] >= 1) {
+                        fprintf(stderr, "Loss must be at least 0 and below 1.\n");
+                        return 2;
+                    }
+                }
+                break;
+            case 'd':
+                if (parse_list(optarg, delay) < 0) {
+                    fprintf(stderr, "Bad delay: %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'r':
+                if (parse_list(optarg, rate) < 0) {
+                    fprintf(stderr, "Bad rate: %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'a':
+                all = true;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s\n", usage_str);
+                return 2;
+        }
+    }
+
+    unsigned char *pattern = malloc(PATTERN_PERIOD + PATTERN_CHUNK);
+    Rng pattern_rng = { 0 };
+    for (size_t idx = 0; idx < PATTERN_PERIOD + PATTERN_CHUNK; idx++) {
+        pattern[idx] = idx < PATTERN_PERIOD ? rng_next(&pattern_rng) : pattern[idx - PATTERN_PERIOD];
+    }
+
+    uint64_t failures = 0, total_us = 0;
+    uint64_t worst_stall = 0, worst_stall_seed = first;
+    double slowest = INFINITY;
+    uint64_t slowest_seed = first;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (uint64_t seed = first; seed < first + count; seed++) {
+        Rng rng = { seed };
+        Params params[SWP_MAX_PATHS];
+        for (int path = 0; path < npaths; path++) {
+            draw_params(&rng, &(params[path]));
+            if (loss[path] >= 0) {
+                params[path].loss = loss[path];
+            }
+            if (delay[path] >= 0) {
+                params[path].delay_us = delay[path];
+            }
+            if (rate[path] >= 0) {
+                params[path].rate_bps = rate[path] * 1e6;
+            }
+        }
+        if (window > 0) {
+            params[0].window = window;
+        }
+
+        Result result;
+        run_scenario(params, npaths, rng_next(&rng), size, pattern, verbose, &result);
+        total_us += result.elapsed_us;
+        if (!result.ok) {
+            failures++;
+        }
+        if (!result.ok || all) {
+            print_scenario(seed, params, &result, size);
+            if (npaths > 1) {
+                print_paths(params, npaths, &result);
+            }
+        }
+        if (result.longest_stall > worst_stall) {
+            worst_stall = result.longest_stall;
+            worst_stall_seed = seed;
+        }
+        double mbps = size * 8 / (result.elapsed_us / 1e6) / 1e6;
+        if (mbps < slowest) {
+            slowest = mbps;
+            slowest_seed = seed;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("swpsim: %" PRIu64 " scenarios of %" PRIu64 " bytes, %" PRIu64 " failed; "
+            "%.1fs simulated in %.2fs.\n",
+            count, size, failures, total_us / 1e6, wall);
+    printf("swpsim: slowest seed %" PRIu64 " at %.2f Mbit/s; longest stall seed %" PRIu64
+            " at %.3fs.\n", slowest_seed, slowest, worst_stall_seed, worst_stall / 1e6);
+    free(pattern);
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,128 @@
+#include <stdlib.h>
+
+#include "timer_wheel.h"
+
+int timer_wheel_init(TimerWheel *wheel, size_t nbuckets, uint64_t tick_us,
+        uint64_t now_us) {
+    size_t size = 1;
+    while (size < nbuckets) {
+        size <<= 1;
+    }
+
+    wheel->buckets = calloc(size, sizeof(TimerNode));
+    if (wheel->buckets == NULL) {
+        return -1;
+    }
+    size_t idx;
+    for (idx = 0; idx < size; idx++) {
+        wheel->buckets[idx].next = &(wheel->buckets[idx]);
+        wheel->buckets[idx].prev = &(wheel->buckets[idx]);
+    }
+
+    wheel->mask = size - 1;
+    wheel->tick_us = tick_us;
+    wheel->now_tick = now_us / tick_us;
+    wheel->count = 0;
+    return 0;
+}
+
+void timer_wheel_free(TimerWheel *wheel) {
+    free(wheel->buckets);
+    wheel->buckets = NULL;
+    wheel->count = 0;
+}
+
+void timer_node_init(TimerNode *node) {
+    node->next = NULL;
+    node->prev = NULL;
+    node->expires = 0;
+}
+
+bool timer_armed(TimerNode *node) {
+    return node->prev != NULL;
+}
+
+static void unlink_node(TimerWheel *wheel, TimerNode *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = NULL;
+    node->prev = NULL;
+    wheel->count--;
+}
+
+void timer_wheel_arm(TimerWheel *wheel, TimerNode *node, uint64_t deadline_us) {
+    if (timer_armed(node)) {
+        unlink_node(wheel, node);
+    }
+
+    // Round up, and never into a tick that has already been expired.
+    uint64_t tick = (deadline_us + wheel->tick_us - 1) / wheel->tick_us;
+    if (tick < wheel->now_tick) {
+        tick = wheel->now_tick;
+    }
+    node->expires = tick;
+
+    TimerNode *head = &(wheel->buckets[tick & wheel->mask]);
+    node->next = head;
+    node->prev = head->prev;
+    head->prev->next = node;
+    head->prev = node;
+    wheel->count++;
+}
+
+void timer_wheel_cancel(TimerWheel *wheel, TimerNode *node) {
+    if (timer_armed(node)) {
+        unlink_node(wheel, node);
+    }
+}
+
+TimerNode *timer_wheel_expire(TimerWheel *wheel, uint64_t now_us) {
+    uint64_t target = now_us / wheel->tick_us;
+    if (target < wheel->now_tick) {
+        return NULL;
+    }
+
+    TimerNode *expired = NULL;
+    TimerNode **tail = &expired;
+
+    // One revolution visits every bucket, so a long gap between calls
+    // costs no more than that.
+    uint64_t first = wheel->now_tick;
+    if (target - first > wheel->mask) {
+        first = target - wheel->mask;
+    }
+
+    uint64_t tick;
+    for (tick = first; tick <= target && wheel->count > 0; tick++) {
+        TimerNode *head = &(wheel->buckets[tick & wheel->mask]);
+        TimerNode *node = head->next;
+        while (node != head) {
+            TimerNode *next = node->next;
+            if (node->expires <= target) {
+                unlink_node(wheel, node);
+                *tail = node;
+                tail = &(node->next);
+            }
+            node = next;
+        }
+    }
+    *tail = NULL;
+
+    wheel->now_tick = target + 1;
+    return expired;
+}
+
+uint64_t timer_wheel_next(TimerWheel *wheel) {
+    if (wheel->count == 0) {
+        return UINT64_MAX;
+    }
+
+    uint64_t tick;
+    for (tick = wheel->now_tick; tick <= wheel->now_tick + wheel->mask; tick++) {
+        TimerNode *head = &(wheel->buckets[tick & wheel->mask]);
+        if (head->next != head) {
+            return tick * wheel->tick_us;
+        }
+    }
+    return UINT64_MAX;
+}
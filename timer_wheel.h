@@ -0,0 +1,54 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hashed timer wheel. Deadlines are rounded up to whole ticks and hashed
+ * into a bucket by tick number, so arming and cancelling are O(1) and
+ * expiring costs O(1) per tick plus O(1) per timer that fires. Timers more
+ * than one revolution out share a bucket with nearer ones and are simply
+ * skipped until their tick comes round.
+ */
+
+typedef struct TimerNode {
+    struct TimerNode *next;
+    struct TimerNode *prev;
+    uint64_t expires;           // Absolute tick.
+} TimerNode;
+
+typedef struct TimerWheel {
+    TimerNode *buckets;         // Circular list heads, one per bucket.
+    size_t mask;
+    uint64_t tick_us;
+    uint64_t now_tick;          // Every tick before this has been expired.
+    size_t count;
+} TimerWheel;
+
+// nbuckets is rounded up to a power of two.
+int timer_wheel_init(TimerWheel *wheel, size_t nbuckets, uint64_t tick_us,
+        uint64_t now_us);
+
+void timer_wheel_free(TimerWheel *wheel);
+
+void timer_node_init(TimerNode *node);
+
+bool timer_armed(TimerNode *node);
+
+// (Re)arms node to fire at the first tick at or after deadline_us.
+void timer_wheel_arm(TimerWheel *wheel, TimerNode *node, uint64_t deadline_us);
+
+void timer_wheel_cancel(TimerWheel *wheel, TimerNode *node);
+
+// Advances the wheel to now_us and returns the timers that fired as a
+// list linked through `next` (NULL terminated). They are disarmed, so the
+// caller may re-arm them while walking the list.
+TimerNode *timer_wheel_expire(TimerWheel *wheel, uint64_t now_us);
+
+// Time of the earliest non-empty bucket, which is never later than the next
+// timer to fire, or UINT64_MAX if nothing is armed.
+uint64_t timer_wheel_next(TimerWheel *wheel);
+
+#endif
@@ -0,0 +1,617 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tree.h"
+
+/*
+ * Reader
+ */
+
+typedef struct TreeDir {
+    DIR *dir;
+    size_t base;            // Length of the path prefix of its entries.
+} TreeDir;
+
+struct TreeReader {
+    TreeDir *stack;         // Directories being walked, innermost last.
+    int depth;
+    int max_depth;
+    char path[PATH_MAX];
+    // Record header, path and symlink target of the current entry.
+    unsigned char head[sizeof(TreeRecord) + 2 * PATH_MAX];
+    size_t head_len;
+    size_t head_pos;
+    int fd;                 // File whose content is being sent, or -1.
+    uint64_t remaining;
+    bool short_file;
+    TreeStats stats;
+};
+
+static int push_dir(TreeReader *reader, DIR *dir, size_t base) {
+    if (reader->depth == reader->max_depth) {
+        int max_depth = reader->max_depth ? 2 * reader->max_depth : 16;
+        TreeDir *stack = realloc(reader->stack, max_depth * sizeof(TreeDir));
+        if (stack == NULL) {
+            return -1;
+        }
+        reader->stack = stack;
+        reader->max_depth = max_depth;
+    }
+    reader->stack[reader->depth].dir = dir;
+    reader->stack[reader->depth].base = base;
+    reader->depth++;
+    return 0;
+}
+
+TreeReader *tree_reader_new(const char *root) {
+    int fd = open(root, O_RDONLY | O_DIRECTORY);
+    DIR *dir;
+    if (fd < 0 || (dir = fdopendir(fd)) == NULL) {
+        fprintf(stderr, "tree_reader_new: Failed to open %s: %s\n", root, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    TreeReader *reader = calloc(1, sizeof(*reader));
+    if (reader == NULL || push_dir(reader, dir, 0) < 0) {
+        closedir(dir);
+        free(reader);
+        return NULL;
+    }
+    reader->fd = -1;
+    return reader;
+}
+
+static void set_head(TreeReader *reader, mode_t mode, size_t path_len,
+        uint64_t size, const char *target) {
+    TreeRecord record;
+    record.mode = mode;
+    record.path_len = path_len;
+    record.size = size;
+
+    unsigned char *ptr = reader->head;
+    memcpy(ptr, &record, sizeof(record));
+    ptr += sizeof(record);
+    memcpy(ptr, reader->path, path_len);
+    ptr += path_len;
+    if (target != NULL) {
+        memcpy(ptr, target, size);
+        ptr += size;
+    }
+    reader->head_len = ptr - reader->head;
+    reader->head_pos = 0;
+}
+
+static void skip_entry(TreeReader *reader) {
+    fprintf(stderr, "tree_reader_read: Skipping %s: %s\n", reader->path, strerror(errno));
+}
+
+// Queues the record for the next entry of the walk. Returns 1 if there is
+// one, 0 once the whole tree has been sent, or -1 on error.
+static int next_entry(TreeReader *reader) {
+    while (reader->depth > 0) {
+        TreeDir *top = &(reader->stack[reader->depth - 1]);
+        errno = 0;
+        struct dirent *entry = readdir(top->dir);
+        if (entry == NULL) {
+            if (errno != 0) {
+                perror("tree_reader_read: Failed to read directory");
+                return -1;
+            }
+            closedir(top->dir);
+            reader->depth--;
+            continue;
+        }
+
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        size_t path_len = top->base + strlen(name);
+        if (path_len + 1 >= PATH_MAX) {
+            fprintf(stderr, "tree_reader_read: Path too long, skipping %s\n", name);
+            continue;
+        }
+        strcpy(reader->path + top->base, name);
+
+        int dir_fd = dirfd(top->dir);
+        unsigned char type = entry->d_type;
+        struct stat st;
+        if (type == DT_UNKNOWN) {
+            if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                skip_entry(reader);
+                continue;
+            }
+            type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR
+                : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+        }
+
+        if (type == DT_REG) {
+            int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW);
+            if (fd < 0 || fstat(fd, &st) < 0) {
+                skip_entry(reader);
+                if (fd >= 0) {
+                    close(fd);
+                }
+                continue;
+            }
+            if (!S_ISREG(st.st_mode)) {
+                close(fd);
+                continue;
+            }
+            set_head(reader, st.st_mode, path_len, st.st_size, NULL);
+            reader->remaining = st.st_size;
+            reader->short_file = false;
+            if (reader->remaining > 0) {
+                reader->fd = fd;
+            } else {
+                close(fd);
+            }
+            reader->stats.files++;
+            return 1;
+        } else if (type == DT_DIR) {
+            int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            DIR *dir = NULL;
+            if (fd < 0 || fstat(fd, &st) < 0 || (dir = fdopendir(fd)) == NULL) {
+                skip_entry(reader);
+                if (fd >= 0) {
+                    close(fd);
+                }
+                continue;
+            }
+            set_head(reader, st.st_mode, path_len, 0, NULL);
+            // Its entries are named relative to the root, below this one.
+            reader->path[path_len] = '/';
+            if (push_dir(reader, dir, path_len + 1) < 0) {
+                closedir(dir);
+                return -1;
+            }
+            reader->stats.dirs++;
+            return 1;
+        } else if (type == DT_LNK) {
+            char target[PATH_MAX];
+            ssize_t target_len = readlinkat(dir_fd, name, target, sizeof(target));
+            if (target_len < 0 || target_len == sizeof(target)) {
+                skip_entry(reader);
+                continue;
+            }
+            set_head(reader, S_IFLNK | 0777, path_len, target_len, target);
+            reader->stats.links++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Packs as many records as fit, so one packet can carry many small files.
+ssize_t tree_reader_read(void *ctx, void *buf, size_t len) {
+    TreeReader *reader = ctx;
+    unsigned char *out = buf;
+    size_t filled = 0;
+
+    while (filled < len) {
+        if (reader->head_pos < reader->head_len) {
+            size_t n = reader->head_len - reader->head_pos;
+            if (n > len - filled) {
+                n = len - filled;
+            }
+            memcpy(out + filled, reader->head + reader->head_pos, n);
+            reader->head_pos += n;
+            filled += n;
+            continue;
+        }
+
+        if (reader->remaining > 0) {
+            size_t want = len - filled;
+            if (want > reader->remaining) {
+                want = reader->remaining;
+            }
+            ssize_t n = read(reader->fd, out + filled, want);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("tree_reader_read: Failed to read file");
+                return -1;
+            }
+            if (n == 0) {
+                // The file shrank after its size went out; pad it to match.
+                if (!reader->short_file) {
+                    fprintf(stderr, "tree_reader_read: %s shrank while being sent.\n",
+                            reader->path);
+                    reader->short_file = true;
+                }
+                memset(out + filled, 0, want);
+                n = want;
+            }
+            filled += n;
+            reader->remaining -= n;
+            reader->stats.bytes += n;
+            if (reader->remaining == 0) {
+                close(reader->fd);
+                reader->fd = -1;
+            }
+            continue;
+        }
+
+        int status = next_entry(reader);
+        if (status < 0) {
+            return -1;
+        } else if (status == 0) {
+            break;
+        }
+    }
+    return filled;
+}
+
+void tree_reader_get_stats(TreeReader *reader, TreeStats *stats) {
+    *stats = reader->stats;
+}
+
+void tree_reader_free(TreeReader *reader) {
+    if (reader == NULL) {
+        return;
+    }
+    while (reader->depth > 0) {
+        closedir(reader->stack[--reader->depth].dir);
+    }
+    if (reader->fd >= 0) {
+        close(reader->fd);
+    }
+    free(reader->stack);
+    free(reader);
+}
+
+/*
+ * Writer
+ */
+
+enum TreeState {
+    TreeHead,
+    TreePath,
+    TreeBody
+};
+
+// Work held back until the end: directory modes, which could otherwise
+// lock us out of our own tree, and symlinks, which a later path could
+// otherwise follow out of the root.
+typedef struct TreeDeferred {
+    char *path;
+    char *target;           // Symlinks only.
+    mode_t mode;
+} TreeDeferred;
+
+struct TreeWriter {
+    int root_fd;
+    enum TreeState state;
+    TreeRecord record;
+    size_t pos;             // Bytes of the header or path received so far.
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    int fd;                 // File being written, or -1.
+    uint64_t remaining;
+    TreeDeferred *deferred;
+    size_t ndeferred;
+    size_t max_deferred;
+    TreeStats stats;
+};
+
+TreeWriter *tree_writer_new(const char *root) {
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY);
+    if (root_fd < 0) {
+        fprintf(stderr, "tree_writer_new: Failed to open %s: %s\n", root, strerror(errno));
+        return NULL;
+    }
+
+    TreeWriter *writer = calloc(1, sizeof(*writer));
+    if (writer == NULL) {
+        close(root_fd);
+        return NULL;
+    }
+    writer->root_fd = root_fd;
+    writer->state = TreeHead;
+    writer->fd = -1;
+    return writer;
+}
+
+static int defer(TreeWriter *writer, const char *target, mode_t mode) {
+    if (writer->ndeferred == writer->max_deferred) {
+        size_t max_deferred = writer->max_deferred ? 2 * writer->max_deferred : 64;
+        TreeDeferred *deferred = realloc(writer->deferred,
+                max_deferred * sizeof(TreeDeferred));
+        if (deferred == NULL) {
+            return -1;
+        }
+        writer->deferred = deferred;
+        writer->max_deferred = max_deferred;
+    }
+    TreeDeferred *entry = &(writer->deferred[writer->ndeferred]);
+    entry->path = strdup(writer->path);
+    entry->target = target != NULL ? strdup(target) : NULL;
+    entry->mode = mode;
+    writer->ndeferred++;
+    return 0;
+}
+
+// Relative, with no empty, "." or ".." components.
+static bool valid_path(const char *path) {
+    const char *component = path;
+    while (true) {
+        const char *slash = strchr(component, '/');
+        size_t len = slash != NULL ? (size_t)(slash - component) : strlen(component);
+        if (len == 0 || (len == 1 && component[0] == '.')
+                || (len == 2 && component[0] == '.' && component[1] == '.')) {
+            return false;
+        }
+        if (slash == NULL) {
+            return true;
+        }
+        component = slash + 1;
+    }
+}
+
+static void close_parent(TreeWriter *writer, int dir_fd) {
+    if (dir_fd != writer->root_fd) {
+        close(dir_fd);
+    }
+}
+
+// Opens the directory that path's last component lives in, one component
+// at a time and never through a symlink, so that neither the stream nor
+// links already in the root can lead a write outside it. Points *name at
+// the last component. Returns the root itself for a top-level entry; see
+// close_parent().
+static int open_parent(TreeWriter *writer, const char *path, const char **name) {
+    int dir_fd = writer->root_fd;
+    const char *component = path;
+    const char *slash;
+    while ((slash = strchr(component, '/')) != NULL) {
+        char part[NAME_MAX + 1];
+        size_t len = slash - component;
+        if (len > NAME_MAX) {
+            errno = ENAMETOOLONG;
+            close_parent(writer, dir_fd);
+            return -1;
+        }
+        memcpy(part, component, len);
+        part[len] = '\0';
+        int next_fd = openat(dir_fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (next_fd < 0) {
+            int saved = errno;
+            close_parent(writer, dir_fd);
+            errno = saved;
+            return -1;
+        }
+        close_parent(writer, dir_fd);
+        dir_fd = next_fd;
+        component = slash + 1;
+    }
+    *name = component;
+    return dir_fd;
+}
+
+static int bad_record(const char *reason) {
+    fprintf(stderr, "tree_writer_write: %s.\n", reason);
+    errno = EINVAL;
+    return -1;
+}
+
+static int begin_entry(TreeWriter *writer) {
+    mode_t mode = writer->record.mode;
+    writer->remaining = writer->record.size;
+
+    if (S_ISDIR(mode)) {
+        if (writer->record.size != 0) {
+            return bad_record("Directory record with content");
+        }
+        // Owner access until the end, whatever the final mode.
+        const char *name;
+        int dir_fd = open_parent(writer, writer->path, &name);
+        int made = dir_fd < 0 ? -1 : mkdirat(dir_fd, name, 0700 | (mode & 0777));
+        if (made < 0 && errno == EEXIST) {
+            // Only an actual directory will do, not a link to one.
+            struct stat st;
+            if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+                made = 0;
+            } else {
+                errno = EEXIST;
+            }
+        }
+        if (dir_fd >= 0) {
+            close_parent(writer, dir_fd);
+        }
+        if (made < 0) {
+            fprintf(stderr, "tree_writer_write: Failed to create %s: %s\n",
+                    writer->path, strerror(errno));
+            return -1;
+        }
+        writer->stats.dirs++;
+        return defer(writer, NULL, mode & 07777);
+    } else if (S_ISREG(mode)) {
+        const char *name;
+        int dir_fd = open_parent(writer, writer->path, &name);
+        if (dir_fd >= 0) {
+            writer->fd = openat(dir_fd, name,
+                    O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, mode & 0777);
+            close_parent(writer, dir_fd);
+        }
+        if (writer->fd < 0) {
+            fprintf(stderr, "tree_writer_write: Failed to create %s: %s\n",
+                    writer->path, strerror(errno));
+            return -1;
+        }
+        writer->stats.files++;
+        return 0;
+    } else if (S_ISLNK(mode)) {
+        if (writer->record.size >= PATH_MAX) {
+            return bad_record("Symlink target too long");
+        }
+        writer->stats.links++;
+        return 0;
+    }
+    return bad_record("Unsupported entry type");
+}
+
+static int end_entry(TreeWriter *writer) {
+    int status = 0;
+    if (writer->fd >= 0) {
+        if (close(writer->fd) < 0) {
+            fprintf(stderr, "tree_writer_write: Failed to close %s: %s\n",
+                    writer->path, strerror(errno));
+            status = -1;
+        }
+        writer->fd = -1;
+    } else if (S_ISLNK(writer->record.mode)) {
+        writer->target[writer->record.size] = '\0';
+        status = defer(writer, writer->target, 0);
+    }
+    writer->state = TreeHead;
+    writer->pos = 0;
+    return status;
+}
+
+ssize_t tree_writer_write(void *ctx, const void *buf, size_t len) {
+    TreeWriter *writer = ctx;
+    const unsigned char *in = buf;
+    size_t used = 0;
+
+    while (used < len) {
+        size_t n;
+        if (writer->state == TreeHead) {
+            n = sizeof(writer->record) - writer->pos;
+            if (n > len - used) {
+                n = len - used;
+            }
+            memcpy((unsigned char *)&(writer->record) + writer->pos, in + used, n);
+            used += n;
+            writer->pos += n;
+            if (writer->pos == sizeof(writer->record)) {
+                if (writer->record.path_len == 0 || writer->record.path_len >= PATH_MAX) {
+                    return bad_record("Bad path length");
+                }
+                writer->state = TreePath;
+                writer->pos = 0;
+            }
+        } else if (writer->state == TreePath) {
+            n = writer->record.path_len - writer->pos;
+            if (n > len - used) {
+                n = len - used;
+            }
+            memcpy(writer->path + writer->pos, in + used, n);
+            used += n;
+            writer->pos += n;
+            if (writer->pos == writer->record.path_len) {
+                writer->path[writer->pos] = '\0';
+                if (!valid_path(writer->path)) {
+                    return bad_record("Path outside the tree");
+                }
+                if (begin_entry(writer) < 0) {
+                    return -1;
+                }
+                writer->state = TreeBody;
+                if (writer->remaining == 0 && end_entry(writer) < 0) {
+                    return -1;
+                }
+            }
+        } else {
+            n = len - used;
+            if (n > writer->remaining) {
+                n = writer->remaining;
+            }
+            if (writer->fd >= 0) {
+                ssize_t written = write(writer->fd, in + used, n);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    fprintf(stderr, "tree_writer_write: Failed to write %s: %s\n",
+                            writer->path, strerror(errno));
+                    return -1;
+                }
+                n = written;
+                writer->stats.bytes += n;
+            } else {
+                memcpy(writer->target + (writer->record.size - writer->remaining),
+                        in + used, n);
+            }
+            used += n;
+            writer->remaining -= n;
+            if (writer->remaining == 0 && end_entry(writer) < 0) {
+                return -1;
+            }
+        }
+    }
+    return used;
+}
+
+int tree_writer_finish(TreeWriter *writer) {
+    int status = 0;
+    if (writer->state != TreeHead || writer->pos != 0) {
+        fprintf(stderr, "tree_writer_finish: Stream ended mid-record.\n");
+        status = -1;
+    }
+
+    // Innermost first, so a read-only directory is locked last.
+    while (writer->ndeferred > 0) {
+        TreeDeferred *entry = &(writer->deferred[--writer->ndeferred]);
+        const char *name;
+        int dir_fd = open_parent(writer, entry->path, &name);
+        if (entry->target != NULL) {
+            if ((dir_fd < 0 || symlinkat(entry->target, dir_fd, name) < 0)
+                    && errno != EEXIST) {
+                fprintf(stderr, "tree_writer_finish: Failed to link %s: %s\n",
+                        entry->path, strerror(errno));
+                status = -1;
+            }
+        } else {
+            // Through the directory itself, which a link cannot stand in for.
+            int fd = dir_fd < 0 ? -1 : openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (fd < 0 || fchmod(fd, entry->mode) < 0) {
+                fprintf(stderr, "tree_writer_finish: Failed to set mode of %s: %s\n",
+                        entry->path, strerror(errno));
+                status = -1;
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        if (dir_fd >= 0) {
+            close_parent(writer, dir_fd);
+        }
+        free(entry->path);
+        free(entry->target);
+    }
+    return status;
+}
+
+void tree_writer_get_stats(TreeWriter *writer, TreeStats *stats) {
+    *stats = writer->stats;
+}
+
+void tree_writer_free(TreeWriter *writer) {
+    if (writer == NULL) {
+        return;
+    }
+    if (writer->fd >= 0) {
+        close(writer->fd);
+    }
+    while (writer->ndeferred > 0) {
+        TreeDeferred *entry = &(writer->deferred[--writer->ndeferred]);
+        free(entry->path);
+        free(entry->target);
+    }
+    free(writer->deferred);
+    close(writer->root_fd);
+    free(writer);
+}
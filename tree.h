@@ -0,0 +1,68 @@
+#ifndef TREE_H
+#define TREE_H
+
+/*
+ * Directory trees as a single byte stream, so a whole tree moves in one
+ * session instead of one handshake per file.
+ *
+ * The stream is a sequence of records, each a TreeRecord header, the
+ * entry's path relative to the root, and `size` bytes of content: the
+ * file's data, a symlink's target, or nothing for a directory. Directories
+ * come before their contents. Small files therefore pack back to back into
+ * shared packets, while large ones are read a packet at a time.
+ *
+ * By convention a file name ending in '/' in the session handshake names a
+ * tree rather than a single file.
+ */
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct TreeRecord {
+    uint32_t mode;          // st_mode: file type and permission bits.
+    uint32_t path_len;      // Path bytes that follow, no terminator.
+    uint64_t size;          // Content bytes after the path.
+} TreeRecord;
+
+typedef struct TreeStats {
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t links;
+    uint64_t bytes;         // File content only.
+} TreeStats;
+
+typedef struct TreeReader TreeReader;
+
+typedef struct TreeWriter TreeWriter;
+
+// Walks the directory at root. Entries that cannot be opened are reported
+// and skipped; sockets, devices and the like are skipped silently.
+TreeReader *tree_reader_new(const char *root);
+
+// SwpReadFn: fills buf with the next len bytes of the stream.
+ssize_t tree_reader_read(void *ctx, void *buf, size_t len);
+
+void tree_reader_get_stats(TreeReader *reader, TreeStats *stats);
+
+void tree_reader_free(TreeReader *reader);
+
+// Recreates a tree under root, which must already exist.
+TreeWriter *tree_writer_new(const char *root);
+
+// SwpWriteFn: consumes the next len bytes of the stream. Paths that are
+// absolute or climb out of the root are rejected, and no entry is created
+// through a symlink, whether the stream or an earlier run left it there.
+ssize_t tree_writer_write(void *ctx, const void *buf, size_t len);
+
+// Creates the symlinks and applies the directory modes, both held back
+// until every file is written. Returns -1 if the stream stopped mid-record.
+int tree_writer_finish(TreeWriter *writer);
+
+void tree_writer_get_stats(TreeWriter *writer, TreeStats *stats);
+
+void tree_writer_free(TreeWriter *writer);
+
+#endif